@@ -80,6 +80,14 @@ struct AdminVirtualMachine
       });
   }
 
+  // An instruction from a user and the message buffer it was read from
+  struct UserInput
+  {
+    std::shared_ptr<TClient> user;
+    std::shared_ptr<const void> buffer;
+    Guacamole::GuacClientInstruction::Reader instruction;
+  };
+
   struct VmState final
     : TurnController<std::shared_ptr<TClient>>,
       VoteController<VmState>,
@@ -98,8 +106,9 @@ struct AdminVirtualMachine
       CollabVmServerMessage::AdminVmInfo::Builder admin_vm_info)
       : VmTurnController(strand),
         VmVoteController(strand),
-        VmUserChannel(id),
+        VmUserChannel(strand, id),
         connect_delay_timer_(strand),
+        input_timer_(strand),
         message_builder_(std::make_unique<capnp::MallocMessageBuilder>()),
         settings_(GetInitialSettings(initial_settings)),
         guacamole_client_(strand, admin_vm),
@@ -211,21 +220,19 @@ struct AdminVirtualMachine
         {
           queue_message(std::move(description_message));
           queue_message(std::move(vote_status_message));
+          // The join instructions are sent in one frame
+          auto instructions = GuacInstructionMessage::Buffer();
           guacamole_client.AddUser(
-            [queue_message=std::move(queue_message)]
+            [&instructions]
             (capnp::MallocMessageBuilder&& message_builder)
             {
-              // TODO: Avoid copying
-              auto guac_instr =
-                message_builder.getRoot<Guacamole::GuacServerInstruction>();
-              auto socket_message = SocketMessage::CreateShared();
-              socket_message->GetMessageBuilder()
-                            .initRoot<CollabVmServerMessage>()
-                            .initMessage()
-                            .setGuacInstr(guac_instr);
-              socket_message->CreateFrame();
-              queue_message(std::move(socket_message));
+              GuacInstructionMessage::Append(instructions, message_builder);
             });
+          if (!instructions.empty())
+          {
+            queue_message(std::make_shared<GuacInstructionMessage>(
+              std::move(instructions)));
+          }
       });
     }
 
@@ -279,9 +286,8 @@ struct AdminVirtualMachine
       auto i = 0u;
       const auto& channel_users = VmUserChannel::GetUsers();
       for (auto& user_in_queue : users_queue) {
-        if (const auto channel_user = channel_users.find(user_in_queue);
-            channel_user != channel_users.end()) {
-          users_list.set(i++, channel_user->second.username);
+        if (const auto user_data = channel_users.Find(user_in_queue)) {
+          users_list.set(i++, user_data->username);
         }
       }
       VmUserChannel::BroadcastMessage(std::move(message));
@@ -383,6 +389,13 @@ struct AdminVirtualMachine
       return user_data.has_value() && user_data.value().get().IsAdmin();
     }
 
+    [[nodiscard]]
+    bool CanSendInput(const std::shared_ptr<TClient>& user) const
+    {
+      return connected_
+        && (HasCurrentTurn(user) && !IsPaused() || IsAdmin(user));
+    }
+
     [[nodiscard]]
     std::shared_ptr<SocketMessage> GetVoteStatus() const
     {
@@ -454,6 +467,27 @@ struct AdminVirtualMachine
       }
     }
 
+    void SendInput(const UserInput& input)
+    {
+      if (connected_)
+      {
+        guacamole_client_.ReadInstruction(input.instruction);
+      }
+    }
+
+    void FlushInput()
+    {
+      input_coalescer_.Flush([this](auto&& input)
+        {
+          // The user may have lost their turn or the VM may have been
+          // paused while the move was held
+          if (CanSendInput(input.user))
+          {
+            SendInput(input);
+          }
+        });
+    }
+
     [[nodiscard]]
     bool GetVotesEnabled() const
     {
@@ -477,6 +511,8 @@ struct AdminVirtualMachine
     bool active_ = false;
     bool connected_ = false;
     boost::asio::steady_timer connect_delay_timer_;
+    boost::asio::steady_timer input_timer_;
+    InputCoalescer<UserInput> input_coalescer_;
     std::size_t viewer_count_ = 0;
     std::unique_ptr<capnp::MallocMessageBuilder> message_builder_;
     capnp::List<VmSetting>::Builder settings_;
@@ -492,6 +528,33 @@ struct AdminVirtualMachine
     });
   }
 
+  // Sends the whole display to a user whose queued instructions were
+  // discarded because they fell behind
+  void ResyncDisplay(std::shared_ptr<TClient>&& user)
+  {
+    state_.dispatch([user = std::move(user)](auto& state) mutable
+    {
+      if (!state.GetUserData(user).has_value())
+      {
+        user->QueueDisplayResync(nullptr);
+        return;
+      }
+      auto instructions = GuacInstructionMessage::Buffer();
+      state.guacamole_client_.AddUser(
+        [&instructions](capnp::MallocMessageBuilder&& message_builder)
+        {
+          GuacInstructionMessage::Append(instructions, message_builder);
+        });
+      if (instructions.empty())
+      {
+        user->QueueDisplayResync(nullptr);
+        return;
+      }
+      user->QueueDisplayResync(
+        std::make_shared<GuacInstructionMessage>(std::move(instructions)));
+    });
+  }
+
   void Start()
   {
     state_.dispatch([this](auto& state)
@@ -514,6 +577,14 @@ struct AdminVirtualMachine
     });
   }
 
+  void SetUserListBatching(const UserListBatchOptions& options)
+  {
+    state_.dispatch([options](auto& state)
+    {
+      state.SetUserListBatching(options);
+    });
+  }
+
   void Stop()
   {
     state_.dispatch([this](auto& state)
@@ -530,6 +601,8 @@ struct AdminVirtualMachine
 
       state.active_ = false;
       state.connect_delay_timer_.cancel();
+      state.input_timer_.cancel();
+      state.input_coalescer_.Clear();
       state.guacamole_client_.Stop();
     });
   }
@@ -663,18 +736,45 @@ struct AdminVirtualMachine
     });
   }
 
-  template<typename TCallback>
-  void ReadInstruction(std::shared_ptr<TClient> user, TCallback&& callback)
+  // The buffer keeps the instruction's message alive while it's held
+  void ReadInstruction(std::shared_ptr<TClient> user,
+                       std::shared_ptr<const void> buffer,
+                       Guacamole::GuacClientInstruction::Reader instruction)
   {
     state_.dispatch(
-      [user = std::move(user),
-       callback=std::forward<TCallback>(callback)](auto& state)
+      [this, input = UserInput{std::move(user), std::move(buffer), instruction}]
+      (auto& state) mutable
       {
-        if (state.connected_
-            && (state.HasCurrentTurn(user) && !state.IsPaused()
-                || state.IsAdmin(user))) {
-          state.guacamole_client_.ReadInstruction(callback());
+        if (!state.CanSendInput(input.user)) {
+          return;
+        }
+        // Mouse movements are coalesced, and everything else is sent after
+        // the movements that came before it
+        if (!input.instruction.isMouse())
+        {
+          state.FlushInput();
+          state.SendInput(input);
+          return;
         }
+        const auto window = server_.input_coalesce_window_;
+        const auto held = state.input_coalescer_.AddMove(
+          std::move(input), window, std::chrono::steady_clock::now(),
+          &CanMergeInput,
+          [&state](auto&& input) { state.SendInput(input); });
+        if (!held)
+        {
+          return;
+        }
+        state.input_timer_.expires_at(
+          state.input_coalescer_.GetFlushTime(window));
+        state.input_timer_.async_wait(
+          state_.wrap([](auto& state, auto error_code)
+          {
+            if (!error_code)
+            {
+              state.FlushInput();
+            }
+          }));
       });
   }
 
@@ -706,32 +806,18 @@ private:
       state.connected_ = true;
       UpdateVmInfo();
 
-      auto messages = std::vector<std::shared_ptr<SharedSocketMessage>>();
+      auto instructions = GuacInstructionMessage::Buffer();
       state.guacamole_client_.AddUser(
-        [&messages](capnp::MallocMessageBuilder&& message_builder)
+        [&instructions](capnp::MallocMessageBuilder&& message_builder)
         {
-           // TODO: Avoid copying
-          const auto guac_instr =
-            message_builder.getRoot<Guacamole::GuacServerInstruction>();
-          auto socket_message = messages.emplace_back(SocketMessage::CreateShared());
-          socket_message->GetMessageBuilder()
-                        .initRoot<CollabVmServerMessage>()
-                        .initMessage()
-                        .setGuacInstr(guac_instr);
-          socket_message->CreateFrame();
+          GuacInstructionMessage::Append(instructions, message_builder);
         });
-      const auto& users = state.GetUsers();
-      for (auto& user : users)
+      if (instructions.empty())
       {
-        user.first->QueueMessageBatch(
-          [&messages](auto queue_message)
-          {
-            for (auto& message : messages)
-            {
-              queue_message(message);
-            }
-          });
+        return;
       }
+      state.VmUserChannel::BroadcastMessage(
+        std::make_shared<GuacInstructionMessage>(std::move(instructions)));
     });
   }
 
@@ -740,6 +826,9 @@ private:
     state_.dispatch([this](auto& state)
       {
         state.connected_ = false;
+        // A held move must not reach the VM after it's reset
+        state.input_timer_.cancel();
+        state.input_coalescer_.Clear();
         UpdateVmInfo();
         if (!state.active_)
         {
@@ -757,6 +846,56 @@ private:
       });
   }
 
+  // Mouse instructions from the same user can be merged when only their
+  // positions differ, so buttons are never pressed or released out of order.
+  // The other fields are compared by reflection so this doesn't depend on
+  // the name of the button mask.
+  static bool CanMergeInput(const UserInput& pending, const UserInput& input)
+  {
+    if (pending.user != input.user)
+    {
+      return false;
+    }
+    const auto previous = capnp::toDynamic(pending.instruction.getMouse());
+    const auto current = capnp::toDynamic(input.instruction.getMouse());
+    for (const auto field : previous.getSchema().getFields())
+    {
+      const auto name = field.getProto().getName();
+      if (name == "x" || name == "y")
+      {
+        continue;
+      }
+      const auto previous_value = previous.get(field);
+      const auto current_value = current.get(field);
+      switch (previous_value.getType())
+      {
+      case capnp::DynamicValue::BOOL:
+        if (previous_value.as<bool>() != current_value.as<bool>())
+        {
+          return false;
+        }
+        break;
+      case capnp::DynamicValue::INT:
+        if (previous_value.as<std::int64_t>()
+            != current_value.as<std::int64_t>())
+        {
+          return false;
+        }
+        break;
+      case capnp::DynamicValue::UINT:
+        if (previous_value.as<std::uint64_t>()
+            != current_value.as<std::uint64_t>())
+        {
+          return false;
+        }
+        break;
+      default:
+        return false;
+      }
+    }
+    return true;
+  }
+
   static bool ValidateSettings(capnp::List<VmSetting>::Reader settings)
   {
     for (auto i = 0u; i < settings.size(); i++)
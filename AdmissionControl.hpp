@@ -0,0 +1,104 @@
+#pragma once
+#include <boost/asio/socket_base.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace CollabVm::Server {
+struct AdmissionOptions {
+  // Connections over these limits are closed as soon as they're accepted,
+  // zero means unlimited
+  std::size_t max_connections = 0;
+  std::size_t max_listener_connections = 0;
+  // The length of the kernel's queue of connections waiting to be accepted
+  int backlog = boost::asio::socket_base::max_listen_connections;
+  // New WebSocket connections are turned away with a 503 (Service
+  // Unavailable) while the server is over either threshold, zero disables
+  std::size_t shed_connections = 0;
+  std::chrono::milliseconds shed_lag = std::chrono::milliseconds(0);
+  // How long clients are told to wait before reconnecting
+  std::chrono::seconds retry_after = std::chrono::seconds(10);
+};
+
+/**
+ * Decides whether new connections should be accepted based on the number
+ * of open connections and how far behind the event loops are running.
+ * Can be used from any thread.
+ */
+class AdmissionControl {
+ public:
+  void SetOptions(const AdmissionOptions& options) {
+    options_ = options;
+  }
+
+  const AdmissionOptions& GetOptions() const {
+    return options_;
+  }
+
+  // Must be called before any lag is reported
+  void SetEventLoopCount(std::size_t count) {
+    event_loop_lag_ = std::make_unique<std::atomic<std::int64_t>[]>(count);
+    event_loop_count_ = count;
+  }
+
+  // Counts the connection if it's within the limits
+  bool TryAdmit(std::atomic<std::size_t>& listener_connections) {
+    if (!TryIncrement(connections_, options_.max_connections)) {
+      return false;
+    }
+    if (!TryIncrement(listener_connections,
+                      options_.max_listener_connections)) {
+      connections_--;
+      return false;
+    }
+    return true;
+  }
+
+  void Release(std::atomic<std::size_t>& listener_connections) {
+    listener_connections--;
+    connections_--;
+  }
+
+  void ReportLag(std::size_t event_loop, std::chrono::steady_clock::duration lag) {
+    event_loop_lag_[event_loop] =
+      std::chrono::duration_cast<std::chrono::microseconds>(lag).count();
+  }
+
+  std::chrono::microseconds GetMaxLag() const {
+    auto max_lag = std::int64_t(0);
+    for (auto i = std::size_t(0); i < event_loop_count_; i++) {
+      max_lag = std::max<std::int64_t>(max_lag, event_loop_lag_[i]);
+    }
+    return std::chrono::microseconds(max_lag);
+  }
+
+  bool IsOverloaded() const {
+    return (options_.shed_connections
+            && connections_ > options_.shed_connections)
+           || (options_.shed_lag.count() && GetMaxLag() > options_.shed_lag);
+  }
+
+  std::size_t GetConnectionCount() const {
+    return connections_;
+  }
+
+ private:
+  static bool TryIncrement(std::atomic<std::size_t>& count, std::size_t max) {
+    auto current = count.load();
+    do {
+      if (max && current >= max) {
+        return false;
+      }
+    } while (!count.compare_exchange_weak(current, current + 1));
+    return true;
+  }
+
+  AdmissionOptions options_;
+  std::atomic<std::size_t> connections_ = 0;
+  std::unique_ptr<std::atomic<std::int64_t>[]> event_loop_lag_;
+  std::size_t event_loop_count_ = 0;
+};
+}  // namespace CollabVm::Server
@@ -0,0 +1,176 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace CollabVm::Server {
+/**
+ * The users in a channel, stored contiguously with the admins before
+ * everyone else so each group can be iterated without checking every
+ * user's role. Users can be found by their socket or by their username,
+ * which several users can share when one account is logged in more than
+ * once. Usernames and roles must only be changed with Update() so the
+ * indexes stay correct.
+ */
+template<typename TUser, typename TUserData>
+class ChannelUsers {
+ public:
+  struct Slot {
+    TUser user;
+    TUserData data;
+  };
+  using const_iterator = typename std::vector<Slot>::const_iterator;
+
+  struct Range {
+    const_iterator first;
+    const_iterator last;
+    const_iterator begin() const { return first; }
+    const_iterator end() const { return last; }
+  };
+
+  // Returns false if the user was already added
+  bool Insert(TUser user, TUserData data) {
+    if (indexes_.find(user) != indexes_.end()) {
+      return false;
+    }
+    const auto is_admin = data.IsAdmin();
+    const auto index = slots_.size();
+    indexes_.emplace(user, index);
+    usernames_.emplace(data.username, index);
+    slots_.push_back({std::move(user), std::move(data)});
+    if (is_admin) {
+      SwapSlots(index, admin_count_++);
+    }
+    return true;
+  }
+
+  bool Erase(const TUser& user) {
+    const auto it = indexes_.find(user);
+    if (it == indexes_.end()) {
+      return false;
+    }
+    auto index = it->second;
+    if (index < admin_count_) {
+      SwapSlots(index, --admin_count_);
+      index = admin_count_;
+    }
+    SwapSlots(index, slots_.size() - 1);
+    usernames_.erase(
+      FindUsername(slots_.back().data.username, slots_.size() - 1));
+    indexes_.erase(slots_.back().user);
+    slots_.pop_back();
+    return true;
+  }
+
+  // Calls the callback with the user's data, which it can change,
+  // and returns false if the user wasn't found
+  template<typename TCallback>
+  bool Update(const TUser& user, TCallback&& callback) {
+    const auto it = indexes_.find(user);
+    if (it == indexes_.end()) {
+      return false;
+    }
+    const auto index = it->second;
+    auto& data = slots_[index].data;
+    const auto was_admin = index < admin_count_;
+    usernames_.erase(FindUsername(data.username, index));
+    callback(data);
+    usernames_.emplace(data.username, index);
+    if (data.IsAdmin() != was_admin) {
+      SwapSlots(index, was_admin ? --admin_count_ : admin_count_++);
+    }
+    return true;
+  }
+
+  // Calls the callback with each user's data and user, the data can be
+  // changed except for the username and role
+  template<typename TCallback>
+  void ForEach(TCallback&& callback) {
+    for (auto& slot : slots_) {
+      callback(slot.data, slot.user);
+    }
+  }
+
+  TUserData* Find(const TUser& user) {
+    const auto it = indexes_.find(user);
+    return it == indexes_.end() ? nullptr : &slots_[it->second].data;
+  }
+
+  const TUserData* Find(const TUser& user) const {
+    return const_cast<ChannelUsers&>(*this).Find(user);
+  }
+
+  // Returns any of the users with the username if there are several
+  const Slot* FindByUsername(std::string_view username) const {
+    const auto it = usernames_.find(std::string(username));
+    return it == usernames_.end() ? nullptr : &slots_[it->second];
+  }
+
+  Range GetAdmins() const {
+    return {slots_.begin(), slots_.begin() + admin_count_};
+  }
+
+  Range GetRegularUsers() const {
+    return {slots_.begin() + admin_count_, slots_.end()};
+  }
+
+  const_iterator begin() const {
+    return slots_.begin();
+  }
+
+  const_iterator end() const {
+    return slots_.end();
+  }
+
+  std::size_t size() const {
+    return slots_.size();
+  }
+
+  bool empty() const {
+    return slots_.empty();
+  }
+
+  void clear() {
+    slots_.clear();
+    indexes_.clear();
+    usernames_.clear();
+    admin_count_ = 0;
+  }
+
+ private:
+  using Usernames = std::unordered_multimap<std::string, std::size_t>;
+
+  // Finds the username's entry for the user in the slot
+  typename Usernames::iterator FindUsername(const std::string& username,
+                                            std::size_t index) {
+    auto it = usernames_.equal_range(username).first;
+    while (it->second != index) {
+      ++it;
+    }
+    return it;
+  }
+
+  void SwapSlots(std::size_t first, std::size_t second) {
+    if (first == second) {
+      return;
+    }
+    const auto first_username =
+      FindUsername(slots_[first].data.username, first);
+    const auto second_username =
+      FindUsername(slots_[second].data.username, second);
+    first_username->second = second;
+    second_username->second = first;
+    std::swap(slots_[first], slots_[second]);
+    indexes_[slots_[first].user] = first;
+    indexes_[slots_[second].user] = second;
+  }
+
+  std::vector<Slot> slots_;
+  std::size_t admin_count_ = 0;
+  std::unordered_map<TUser, std::size_t> indexes_;
+  Usernames usernames_;
+};
+}  // namespace CollabVm::Server
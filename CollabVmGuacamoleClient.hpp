@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <mutex>
 #include <queue>
 #include <string_view>
@@ -38,51 +39,39 @@ struct CollabVmGuacamoleClient final
 
   void OnInstruction(capnp::MallocMessageBuilder& message_builder)
   {
-    // TODO: Avoid copying
-    auto guac_instr =
-      message_builder.getRoot<Guacamole::GuacServerInstruction>();
-    auto socket_message = SocketMessage::CreateShared();
-    socket_message->GetMessageBuilder()
-                  .initRoot<CollabVmServerMessage>()
-                  .initMessage()
-                  .setGuacInstr(guac_instr);
-    socket_message->CreateFrame();
-
-    const auto lock = std::lock_guard(instruction_queue_mutex_);
-    instruction_queue_.emplace_back(std::move(socket_message));
+    const auto lock = std::lock_guard(instruction_buffer_mutex_);
+    GuacInstructionMessage::Append(instruction_buffer_, message_builder);
   }
 
+  // Every instruction since the last flush is sent to each user as a
+  // single message in one WebSocket frame
   void OnFlush()
   {
-    auto lock = std::unique_lock(instruction_queue_mutex_);
-    if (instruction_queue_.empty()) {
+    auto lock = std::unique_lock(instruction_buffer_mutex_);
+    if (instruction_buffer_.empty()) {
       return;
     }
-    auto instruction_queue =
-      std::make_shared<std::vector<std::shared_ptr<SocketMessage>>>(
-        std::move(instruction_queue_));
+    const auto flush_size = instruction_buffer_.size();
+    auto instructions = std::shared_ptr<SocketMessage>(
+      std::make_shared<GuacInstructionMessage>(
+        std::move(instruction_buffer_)));
+    instruction_buffer_ = GuacInstructionMessage::Buffer();
+    // Usually avoids growing the buffer during the next flush, but a large
+    // update shouldn't keep every later buffer large
+    instruction_buffer_.reserve(std::min(flush_size, max_reserved_words));
     lock.unlock();
 
     admin_vm_.GetUserChannel(
-      [instruction_queue = std::move(instruction_queue)](auto& channel) {
-        channel.ForEachUser(
-          [instruction_queue = std::move(instruction_queue)]
-          (const auto&, auto& user)
-          {
-            user.QueueMessageBatch([instruction_queue](auto enqueue)
-            {
-              for (auto& instruction : *instruction_queue)
-              {
-                enqueue(instruction);
-              }
-            });
-          });
+      [instructions = std::move(instructions)](auto& channel) mutable {
+        channel.BroadcastMessage(std::move(instructions));
       });
   }
 
+  constexpr static auto max_reserved_words = std::size_t(16 * 1024);
+
   TAdminVirtualMachine& admin_vm_;
-  std::vector<std::shared_ptr<SocketMessage>> instruction_queue_;
-  std::mutex instruction_queue_mutex_;
+  GuacInstructionMessage::Buffer instruction_buffer_;
+  std::mutex instruction_buffer_mutex_;
 };
 
 }
@@ -1,10 +1,14 @@
 #pragma once
 #include <algorithm>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
 #include <boost/functional/hash.hpp>
+#include <charconv>
 #include <filesystem>
+#include <iostream>
 #include <gsl/span>
+#include <map>
 #include <memory>
 #include <string_view>
 #include <type_traits>
@@ -24,17 +28,26 @@
 #include "CollabVmCommon.hpp"
 #include "CollabVmChatRoom.hpp"
 #include "CollabVmGuacamoleClient.hpp"
+#include "ConnectionExecutor.hpp"
+#include "CopyOnWriteMap.hpp"
+#include "FanOut.hpp"
+#include "SendQueue.hpp"
 #include "SocketMessage.hpp"
 #include "Database/Database.h"
 #include "GuacamoleClient.hpp"
+#include "InputCoalescer.hpp"
 #include "CaptchaVerifier.hpp"
+#include "ChannelUsers.hpp"
 #include "StrandGuard.hpp"
 #include "Totp.hpp"
 #include "TurnController.hpp"
 #include "VoteController.hpp"
+#include "WebSocketServer.hpp"
+#include "UserListChanges.hpp"
 #include "UserChannel.hpp"
 #include "AdminVirtualMachine.hpp"
 #include "IPData.hpp"
+#include "Utils.hpp"
 
 namespace CollabVm::Server
 {
@@ -60,6 +73,8 @@ namespace CollabVm::Server
         >;
 
     public:
+      using MessageQueue = SendQueue<std::shared_ptr<SocketMessage>>;
+
       struct UserData
       {
         std::string username;
@@ -73,18 +88,24 @@ namespace CollabVm::Server
       };
 
       CollabVmSocket(boost::asio::io_context& io_context,
-                     const std::filesystem::path& doc_root,
+                     StaticFileCache& file_cache,
                      CollabVmServer& server)
-        : TSocket(io_context, doc_root),
+        : TSocket(io_context, file_cache),
           server_(server),
-          send_queue_(io_context),
-          chat_rooms_(io_context),
-          username_(io_context)
+          send_queue_(TSocket::CreateStrand(), server.send_queue_options_),
+          chat_rooms_(TSocket::CreateStrand()),
+          username_(TSocket::CreateStrand())
       {
       }
 
       ~CollabVmSocket() noexcept override { }
 
+      std::size_t GetMemoryUsage() const override
+      {
+        return sizeof(CollabVmSocket) - sizeof(TSocket)
+               + TSocket::GetMemoryUsage();
+      }
+
       class CollabVmMessageBuffer : public TSocket::MessageBuffer
       {
         capnp::FlatArrayMessageReader reader;
@@ -92,15 +113,28 @@ namespace CollabVm::Server
         CollabVmMessageBuffer() : reader(nullptr) {}
 	~CollabVmMessageBuffer() noexcept override { }
         virtual capnp::FlatArrayMessageReader& CreateReader() = 0;
+        // Prepares the buffer to be read into again
+        virtual void Clear() = 0;
+
+      protected:
+        // Each time a field is read its size counts towards the traversal
+        // limit, so a message can only make the server traverse a few
+        // times its own size instead of the default 64 MiB
+        constexpr static auto traversal_limit_factor = std::uint64_t(8);
+        constexpr static auto min_traversal_limit = std::uint64_t(64);
 
         template<typename TBuffer>
-        capnp::FlatArrayMessageReader& CreateReader(TBuffer& buffer) {
+        capnp::FlatArrayMessageReader& CreateReader(TBuffer& buffer,
+                                                    int nesting_limit) {
           const auto buffer_data = buffer.data();
           const auto array_ptr = kj::ArrayPtr<const capnp::word>(
             static_cast<const capnp::word*>(buffer_data.data()),
             buffer_data.size() / sizeof(capnp::word));
-          // TODO: Considering using capnp::ReaderOptions with lower limits
-          reader = capnp::FlatArrayMessageReader(array_ptr);
+          auto options = capnp::ReaderOptions();
+          options.traversalLimitInWords = std::max<std::uint64_t>(
+            array_ptr.size() * traversal_limit_factor, min_traversal_limit);
+          options.nestingLimit = nesting_limit;
+          reader = capnp::FlatArrayMessageReader(array_ptr, options);
           return reader;
         }
       };
@@ -124,7 +158,12 @@ namespace CollabVm::Server
         }
         capnp::FlatArrayMessageReader& CreateReader() override
         {
-          return CollabVmMessageBuffer::CreateReader(buffer);
+          // Messages from users are small and shallow
+          return CollabVmMessageBuffer::CreateReader(buffer, 16);
+        }
+        void Clear() override
+        {
+          buffer.clear();
         }
       };
 
@@ -148,16 +187,58 @@ namespace CollabVm::Server
         }
         capnp::FlatArrayMessageReader& CreateReader() override
         {
-          return CollabVmMessageBuffer::CreateReader(buffer);
+          return CollabVmMessageBuffer::CreateReader(buffer, 32);
         }
+        void Clear() override
+        {
+          buffer.clear();
+          // Don't hold on to the memory used by a large message
+          if (buffer.capacity() > max_retained_capacity)
+          {
+            buffer.shrink_to_fit();
+          }
+        }
+      private:
+        constexpr static auto max_retained_capacity = std::size_t(64 * 1024);
+      };
+
+      // Reuses buffers once nothing else refers to them, so reading a
+      // message doesn't allocate. Only used from the socket's strand.
+      template<typename TBuffer>
+      class MessageBufferPool
+      {
+      public:
+        std::shared_ptr<TBuffer> Get()
+        {
+          for (auto& buffer : buffers_)
+          {
+            if (buffer.use_count() == 1)
+            {
+              // Handlers on other strands may have just released it
+              std::atomic_thread_fence(std::memory_order_acquire);
+              buffer->Clear();
+              return buffer;
+            }
+          }
+          auto buffer = std::make_shared<TBuffer>();
+          if (buffers_.size() < max_pooled)
+          {
+            buffers_.push_back(buffer);
+          }
+          return buffer;
+        }
+      private:
+        // The buffer being read into and a few that are still being handled
+        constexpr static auto max_pooled = std::size_t(3);
+        std::vector<std::shared_ptr<TBuffer>> buffers_;
       };
 
       std::shared_ptr<typename TSocket::MessageBuffer> CreateMessageBuffer() override {
         return is_admin_
                  ? std::static_pointer_cast<typename TSocket::MessageBuffer>(
-                   std::make_shared<CollabVmDynamicMessageBuffer>())
+                   dynamic_buffers_.Get())
                  : std::static_pointer_cast<typename TSocket::MessageBuffer>(
-                   std::make_shared<CollabVmStaticMessageBuffer>());
+                   static_buffers_.Get());
       }
 
       void OnPreConnect() override
@@ -195,6 +276,67 @@ namespace CollabVm::Server
         });
       }
 
+      // Uploads are sent to /upload?vm=<id>&filename=<name> and saved
+      // to uploads/<id>/<name> if the VM has uploads enabled
+      void OnUploadRequest(std::string&& target,
+                           std::uint64_t content_length,
+                           typename TSocket::UploadCallback&& callback) override
+      {
+        const auto vm_id = GetQueryParameter(target, "vm");
+        const auto filename = std::filesystem::path(
+          GetQueryParameter(target, "filename")).filename();
+        auto id = std::uint32_t();
+        const auto [end, parse_error] =
+          std::from_chars(vm_id.data(), vm_id.data() + vm_id.size(), id);
+        if (parse_error != std::errc() || end != vm_id.data() + vm_id.size()
+            || filename.empty() || filename == "." || filename == "..")
+        {
+          callback(nullptr, UploadErrorCode::kInvalidPath);
+          return;
+        }
+        server_.virtual_machines_.dispatch(
+          [id, filename, content_length, callback = std::move(callback)]
+          (auto& virtual_machines) mutable
+          {
+            const auto virtual_machine =
+              virtual_machines.GetAdminVirtualMachine(id);
+            if (!virtual_machine)
+            {
+              callback(nullptr, UploadErrorCode::kInvalidPath);
+              return;
+            }
+            virtual_machine->GetSettings(
+              [id, filename, content_length, callback = std::move(callback)]
+              (auto& settings) mutable
+              {
+                if (!settings.GetSetting(VmSetting::Setting::UPLOADS_ENABLED)
+                             .getUploadsEnabled())
+                {
+                  callback(nullptr, UploadErrorCode::kUploadsDisabled);
+                  return;
+                }
+                callback(std::make_shared<FileUploadReader>(
+                  std::filesystem::path("uploads") / std::to_string(id) / filename,
+                  content_length), {});
+              });
+          });
+      }
+
+      void OnUploadProgress(
+        std::size_t bytes,
+        std::function<void(std::chrono::steady_clock::duration)>&& callback) override
+      {
+        server_.GetIPData(TSocket::GetIpAddress(),
+          [self = shared_from_this(), bytes, callback = std::move(callback)]
+          (auto& ip_data) mutable {
+            ip_data->dispatch([bytes, callback = std::move(callback)]
+              (auto& ip_data) {
+                callback(ip_data.upload_quota.Consume(
+                  bytes, std::chrono::steady_clock::now()));
+              });
+          });
+      }
+
       void OnMessage(
         std::shared_ptr<typename TSocket::MessageBuffer>&& buffer) override
       {
@@ -218,6 +360,12 @@ namespace CollabVm::Server
         case CollabVmClientMessage::Message::CONNECT_TO_CHANNEL:
         {
           const auto channel_id = message.getConnectToChannel();
+          if (server_.channel_affinity_ && channel_id != global_channel_id)
+          {
+            // Broadcasts from the VM's strand are then written to the
+            // socket from the same thread
+            TSocket::MoveTo(server_.io_context_);
+          }
           username_.dispatch([
             this, self = shared_from_this(), channel_id]
             (auto& username) {
@@ -227,24 +375,17 @@ namespace CollabVm::Server
               (auto& channel) mutable
               {
                 LeaveVmList();
-                if (connected_vm_id_)
+                if (const auto virtual_machine = GetConnectedVm())
                 {
-                  server_.virtual_machines_.dispatch(
-                    [channel_id = connected_vm_id_, self = shared_from_this()]
-                    (auto& virtual_machines) mutable
-                    {
-                      const auto virtual_machine = virtual_machines.
-                        GetAdminVirtualMachine(channel_id);
-                      if (!virtual_machine) {
-                        return;
-                      }
-                      virtual_machine->GetUserChannel([self = std::move(self)]
-                        (auto& channel) {
-                          channel.RemoveUser(std::move(self));
-                        });
+                  virtual_machine->GetUserChannel([self = shared_from_this()]
+                    (auto& channel) mutable {
+                      channel.RemoveUser(std::move(self));
                     });
                 }
                 connected_vm_id_ = channel.GetId();
+                queued_vm_id_ = connected_vm_id_;
+                std::atomic_store(&connected_vm_,
+                  server_.admin_vm_registry_.Find(connected_vm_id_));
                 auto socket_message = SocketMessage::CreateShared();
                 auto& message_builder = socket_message->GetMessageBuilder();
                 auto connect_result =
@@ -341,68 +482,33 @@ namespace CollabVm::Server
         }
         case CollabVmClientMessage::Message::TURN_REQUEST:
         {
-          if (!connected_vm_id_ || is_captcha_required_)
+          const auto virtual_machine = GetConnectedVm();
+          if (!virtual_machine || is_captcha_required_)
           {
             break;
           }
-          server_.virtual_machines_.dispatch([
-            this, self = shared_from_this()]
-            (auto& virtual_machines) mutable
-            {
-              const auto virtual_machine = virtual_machines.
-                GetAdminVirtualMachine(connected_vm_id_);
-              if (!virtual_machine)
-              {
-                return;
-              }
-              virtual_machine->RequestTurn(std::move(self));
-            });
+          virtual_machine->RequestTurn(shared_from_this());
           break;
         }
         case CollabVmClientMessage::Message::VOTE:
         {
-          if (!connected_vm_id_ || is_captcha_required_)
+          const auto virtual_machine = GetConnectedVm();
+          if (!virtual_machine || is_captcha_required_)
           {
             break;
           }
-          const auto voted_yes = message.getVote();
-          server_.virtual_machines_.dispatch([
-            this, self = shared_from_this(), voted_yes]
-            (auto& virtual_machines) mutable
-            {
-              const auto virtual_machine = virtual_machines.
-                GetAdminVirtualMachine(connected_vm_id_);
-              if (!virtual_machine)
-              {
-                return;
-              }
-              virtual_machine->Vote(std::move(self), voted_yes);
-            });
+          virtual_machine->Vote(shared_from_this(), message.getVote());
           break;
         }
         case CollabVmClientMessage::Message::GUAC_INSTR:
         {
-          if (!connected_vm_id_ || is_captcha_required_)
+          const auto virtual_machine = GetConnectedVm();
+          if (!virtual_machine || is_captcha_required_)
           {
             break;
           }
-          server_.virtual_machines_.dispatch([
-            this, self = shared_from_this(),
-            channel_id = connected_vm_id_, message, buffer = std::move(buffer)]
-            (auto& virtual_machines) mutable
-            {
-              const auto virtual_machine = virtual_machines.
-                GetAdminVirtualMachine(channel_id);
-              if (!virtual_machine)
-              {
-                return;
-              }
-              virtual_machine->ReadInstruction(
-                std::move(self),
-                [this, self, buffer = std::move(buffer), message]() {
-                  return message.getGuacInstr();
-                });
-            });
+          virtual_machine->ReadInstruction(
+            shared_from_this(), std::move(buffer), message.getGuacInstr());
           break;
         }
         case CollabVmClientMessage::Message::CHANGE_USERNAME:
@@ -442,7 +548,8 @@ namespace CollabVm::Server
                     !std::get<bool>(guests.insert({ new_username, shared_from_this() }));
                   if (is_username_taken)
                   {
-                    auto socket_message = SocketMessage::CreateShared();
+                    auto socket_message = SocketMessage::CreateShared(
+                      CollabVmServerMessage::Message::USERNAME_TAKEN);
                     auto message = socket_message->GetMessageBuilder()
                       .initRoot<CollabVmServerMessage>()
                       .initMessage();
@@ -474,7 +581,8 @@ namespace CollabVm::Server
                   username,
                   change_password_request.getOldPassword(),
                   change_password_request.getNewPassword());
-                auto socket_message = SocketMessage::CreateShared();
+                auto socket_message = SocketMessage::CreateShared(
+                  CollabVmServerMessage::Message::CHANGE_PASSWORD_RESPONSE);
                 socket_message->GetMessageBuilder()
                   .initRoot<CollabVmServerMessage>()
                   .initMessage().setChangePasswordResponse(success);
@@ -684,7 +792,8 @@ namespace CollabVm::Server
                   ](auto& channel)
                 {
                   auto& chat_room = channel.GetChatRoom();
-                  auto new_chat_message = SocketMessage::CreateShared();
+                  auto new_chat_message = SocketMessage::CreateShared(
+                    CollabVmServerMessage::Message::CHAT_MESSAGE);
                   auto chat_room_message =
                     new_chat_message->GetMessageBuilder()
                                     .initRoot<CollabVmServerMessage>()
@@ -701,19 +810,11 @@ namespace CollabVm::Server
                   server_.global_chat_room_.dispatch(std::move(send_message));
                   break;
                 }
-              server_.virtual_machines_.dispatch([
-                  id, send_message = std::move(send_message)
-              ](auto& virtual_machines)
-                {
-                  const auto virtual_machine = virtual_machines.
-                    GetAdminVirtualMachine(id);
-                  if (!virtual_machine)
-                  {
-                    return;
-                  }
-                  virtual_machine->GetUserChannel(
-                    std::move(send_message));
-                });
+              if (const auto virtual_machine =
+                    server_.admin_vm_registry_.Find(id))
+              {
+                virtual_machine->GetUserChannel(std::move(send_message));
+              }
               break;
             }
             default:
@@ -1047,7 +1148,8 @@ namespace CollabVm::Server
                   server_.db_.CreateVm(vm_id, settings.settings_);
                 });
 
-              auto socket_message = SocketMessage::CreateShared();
+              auto socket_message = SocketMessage::CreateShared(
+                CollabVmServerMessage::Message::CREATE_VM_RESPONSE);
               socket_message->GetMessageBuilder()
                 .initRoot<CollabVmServerMessage>().initMessage()
                 .setCreateVmResponse(vm_id);
@@ -1380,7 +1482,8 @@ namespace CollabVm::Server
             [buffer = std::move(buffer)](auto& user) {
               auto& [socket, user_data] = user;
               socket->is_captcha_required_ = true;
-              auto socket_message = SocketMessage::CreateShared();
+              auto socket_message = SocketMessage::CreateShared(
+                CollabVmServerMessage::Message::CAPTCHA_REQUIRED);
               auto& message_builder = socket_message->GetMessageBuilder();
               message_builder.initRoot<CollabVmServerMessage>()
                              .initMessage()
@@ -1408,53 +1511,27 @@ namespace CollabVm::Server
         }
         case CollabVmClientMessage::Message::PAUSE_TURN_TIMER:
         {
-          if (is_admin_ && connected_vm_id_)
+          if (const auto virtual_machine = GetConnectedVm();
+              is_admin_ && virtual_machine)
           {
-            server_.virtual_machines_.dispatch(
-              [vm_id = connected_vm_id_](auto& virtual_machines)
-              {
-                if (const auto virtual_machine =
-                      virtual_machines.GetAdminVirtualMachine(vm_id);
-                    virtual_machine)
-                {
-                  virtual_machine->PauseTurnTimer();
-                }
-              });
+            virtual_machine->PauseTurnTimer();
           }
           break;
         }
         case CollabVmClientMessage::Message::RESUME_TURN_TIMER:
         {
-          if (is_admin_ && connected_vm_id_)
+          if (const auto virtual_machine = GetConnectedVm();
+              is_admin_ && virtual_machine)
           {
-            server_.virtual_machines_.dispatch(
-              [vm_id = connected_vm_id_](auto& virtual_machines)
-              {
-                if (const auto virtual_machine =
-                      virtual_machines.GetAdminVirtualMachine(vm_id);
-                    virtual_machine)
-                {
-                  virtual_machine->ResumeTurnTimer();
-                }
-              });
+            virtual_machine->ResumeTurnTimer();
           }
           break;
         }
         case CollabVmClientMessage::Message::END_TURN:
         {
-          if (connected_vm_id_)
+          if (const auto virtual_machine = GetConnectedVm())
           {
-            server_.virtual_machines_.dispatch(
-              [this, self = shared_from_this(),
-                vm_id = connected_vm_id_](auto& virtual_machines) mutable
-              {
-                if (const auto virtual_machine =
-                      virtual_machines.GetAdminVirtualMachine(vm_id);
-                    virtual_machine)
-                {
-                  virtual_machine->EndCurrentTurn(std::move(self));
-                }
-              });
+            virtual_machine->EndCurrentTurn(shared_from_this());
           }
           break;
         }
@@ -1477,7 +1554,8 @@ namespace CollabVm::Server
 
       void SendChatChannelId(const std::uint32_t id)
       {
-        auto socket_message = SocketMessage::CreateShared();
+        auto socket_message = SocketMessage::CreateShared(
+          CollabVmServerMessage::Message::CHAT_MESSAGE);
         auto& message_builder = socket_message->GetMessageBuilder();
         auto message = message_builder.initRoot<CollabVmServerMessage>()
                                       .initMessage()
@@ -1489,7 +1567,8 @@ namespace CollabVm::Server
       void SendChatMessageResponse(
         CollabVmServerMessage::ChatMessageResponse result)
       {
-        auto socket_message = SocketMessage::CreateShared();
+        auto socket_message = SocketMessage::CreateShared(
+          CollabVmServerMessage::Message::CHAT_MESSAGE_RESPONSE);
         socket_message->GetMessageBuilder()
                       .initRoot<CollabVmServerMessage>()
                       .initMessage()
@@ -1527,39 +1606,48 @@ namespace CollabVm::Server
       }
 
       void SendMessage(std::shared_ptr<CollabVmSocket>&& self,
-                       std::shared_ptr<SocketMessage>&& socket_message)
+                       MessageQueue& queue)
       {
-        const auto& segment_buffers = socket_message->
-          GetBuffers();
-        TSocket::WriteMessage(
-          segment_buffers,
-          send_queue_.wrap([ this, self = std::move(self), socket_message ](
+        auto socket_message = queue.Pop();
+        auto handler = send_queue_.wrap([ this, self = std::move(self), socket_message ](
             auto& send_queue, const auto error_code,
             std::size_t bytes_transferred) mutable
             {
               SendMessageCallback(
                 std::move(self), send_queue, error_code, bytes_transferred);
-            }));
+            });
+        if (TSocket::IsCompressionEnabled()
+            && server_.compression_policy_.ShouldCompress(*socket_message))
+        {
+          TSocket::WriteMessage(SocketMessageBuffers(socket_message->GetBuffers()),
+                                true, std::move(handler));
+          return;
+        }
+        // The frame header was created once for every recipient, and the
+        // handler keeps the message alive until the write completes
+        TSocket::WriteFrame(
+          socket_message->GetWebSocketFrame(), std::move(handler));
       }
 
       void SendMessageBatch(std::shared_ptr<CollabVmSocket>&& self,
-                       std::queue<std::shared_ptr<SocketMessage>>& queue)
+                            MessageQueue& queue)
       {
         auto socket_messages = std::vector<std::shared_ptr<SocketMessage>>();
         socket_messages.reserve(queue.size());
         auto segment_buffers = std::vector<boost::asio::const_buffer>();
-        segment_buffers.reserve(queue.size());
+        // Leave room for a frame header
+        segment_buffers.reserve(queue.size() + 1);
+        segment_buffers.emplace_back();
         do
         {
-          auto& socket_message = *socket_messages.emplace_back(std::move(queue.front()));
+          auto& socket_message = *socket_messages.emplace_back(queue.Pop());
           const auto& buffers = socket_message.GetBuffers();
           std::copy(buffers.begin(), buffers.end(), std::back_inserter(segment_buffers));
-          queue.pop();
         } while (!queue.empty());
 
-        TSocket::WriteMessage(
-          std::move(segment_buffers),
-          send_queue_.wrap(
+        const auto compress = TSocket::IsCompressionEnabled()
+          && server_.compression_policy_.ShouldCompressBatch(socket_messages);
+        auto handler = send_queue_.wrap(
             [ this, self = std::move(self),
             socket_messages = std::move(socket_messages) ](
             auto& send_queue, const auto error_code,
@@ -1567,33 +1655,128 @@ namespace CollabVm::Server
             {
               SendMessageCallback(
                 std::move(self), send_queue, error_code, bytes_transferred);
-            }));
+            });
+        if (compress)
+        {
+          segment_buffers.erase(segment_buffers.begin());
+          TSocket::WriteMessage(
+            std::move(segment_buffers), true, std::move(handler));
+          return;
+        }
+        // Only one batch is sent at a time, so the header can be reused
+        batch_frame_header_ = WebSocketFrameHeader(
+          boost::asio::buffer_size(segment_buffers));
+        segment_buffers.front() = batch_frame_header_.GetBuffer();
+        TSocket::WriteFrame(std::move(segment_buffers), std::move(handler));
       }
 
       void SendMessageCallback(
         std::shared_ptr<CollabVmSocket>&& self,
-        std::queue<std::shared_ptr<SocketMessage>>& send_queue,
+        MessageQueue& send_queue,
         const boost::system::error_code error_code,
         std::size_t bytes_transferred)
       {
         if (error_code)
         {
+          pause_writes_callback_ = nullptr;
           TSocket::Close();
           return;
         }
-        switch (send_queue.size())
+        send_queue.FinishSend();
+        if (pause_writes_callback_)
         {
-        case 0:
-          sending_ = false;
+          std::exchange(pause_writes_callback_, nullptr)();
           return;
-        case 1:
-          SendMessage(std::move(self), std::move(send_queue.front()));
-          send_queue.pop();
+        }
+        sending_ = false;
+        SendQueuedMessages(std::move(self), send_queue);
+      }
+
+      void SendQueuedMessages(std::shared_ptr<CollabVmSocket>&& self,
+                              MessageQueue& send_queue)
+      {
+        queued_bytes_ = send_queue.GetBytes();
+        if (send_queue.TakeResyncRequest())
+        {
+          RequestDisplayResync();
+        }
+        if (sending_ || send_queue.empty())
+        {
           return;
-        default:
+        }
+        sending_ = true;
+        if (send_queue.size() == 1)
+        {
+          SendMessage(std::move(self), send_queue);
+        }
+        else
+        {
           SendMessageBatch(std::move(self), send_queue);
         }
       }
+
+      // Messages stay queued while the socket is being moved
+      void PauseWrites(std::function<void()>&& callback) override
+      {
+        send_queue_.dispatch([this, callback = std::move(callback)](
+          auto& send_queue) mutable
+          {
+            if (sending_)
+            {
+              pause_writes_callback_ = std::move(callback);
+              return;
+            }
+            sending_ = true;
+            callback();
+          });
+      }
+
+      void ResumeWrites() override
+      {
+        send_queue_.dispatch([this, self = shared_from_this()](
+          auto& send_queue) mutable
+          {
+            sending_ = false;
+            SendQueuedMessages(std::move(self), send_queue);
+          });
+      }
+
+      void PushMessage(MessageQueue& send_queue,
+                       std::shared_ptr<SocketMessage>&& socket_message)
+      {
+        const auto type = GetSendMessageType(*socket_message);
+        const auto size = socket_message->GetSize();
+        if (send_queue.Push(std::move(socket_message), type, size)
+            == MessageQueue::PushResult::kDisconnect)
+        {
+          TSocket::Close();
+        }
+      }
+
+      static SendMessageType GetSendMessageType(const SocketMessage& message)
+      {
+        switch (message.GetMessageKind())
+        {
+        case CollabVmServerMessage::Message::GUAC_INSTR:
+          return SendMessageType::kDisplay;
+        case CollabVmServerMessage::Message::VM_THUMBNAIL:
+          return SendMessageType::kDroppable;
+        default:
+          return SendMessageType::kRequired;
+        }
+      }
+
+      // Asks the VM for the display that was discarded from the queue
+      void RequestDisplayResync()
+      {
+        const auto virtual_machine = GetConnectedVm();
+        if (!virtual_machine)
+        {
+          QueueDisplayResync(nullptr);
+          return;
+        }
+        virtual_machine->ResyncDisplay(shared_from_this());
+      }
     public:
       template<typename TMessage>
       void QueueMessage(TMessage&& socket_message)
@@ -1603,18 +1786,12 @@ namespace CollabVm::Server
         send_queue_.dispatch([
             this, self = shared_from_this(),
             socket_message =
-              std::forward<TMessage>(socket_message)
+              std::shared_ptr<SocketMessage>(
+                std::forward<TMessage>(socket_message))
           ](auto& send_queue) mutable
           {
-            if (sending_)
-            {
-              send_queue.push(std::move(socket_message));
-            }
-            else
-            {
-              sending_ = true;
-              SendMessage(std::move(self), std::move(socket_message));
-            }
+            PushMessage(send_queue, std::move(socket_message));
+            SendQueuedMessages(std::move(self), send_queue);
           });
       }
       template<typename TCallback>
@@ -1625,18 +1802,54 @@ namespace CollabVm::Server
             callback = std::forward<TCallback>(callback)
           ](auto& send_queue) mutable
           {
-            callback([&send_queue](auto&& socket_message)
+            callback([this, &send_queue](auto&& socket_message)
             {
               socket_message->CreateFrame();
-              send_queue.push(std::forward<decltype(socket_message)>(socket_message));
+              PushMessage(send_queue,
+                std::shared_ptr<SocketMessage>(
+                  std::forward<decltype(socket_message)>(socket_message)));
             });
-            if (!send_queue.empty() && !sending_)
+            SendQueuedMessages(std::move(self), send_queue);
+          });
+      }
+      // Replaces the display instructions that were discarded because the
+      // client fell behind, null if the display couldn't be created
+      void QueueDisplayResync(std::shared_ptr<SocketMessage>&& socket_message)
+      {
+        auto size = std::size_t(0);
+        if (socket_message)
+        {
+          socket_message->CreateFrame();
+          size = socket_message->GetSize();
+        }
+        send_queue_.dispatch([
+            this, self = shared_from_this(),
+            socket_message = std::move(socket_message), size
+          ](auto& send_queue) mutable
+          {
+            if (send_queue.PushResync(std::move(socket_message), size)
+                == MessageQueue::PushResult::kDisconnect)
             {
-              sending_ = true;
-              SendMessageBatch(std::move(self), send_queue);
+              TSocket::Close();
+              return;
             }
+            SendQueuedMessages(std::move(self), send_queue);
           });
       }
+      // The bytes of messages waiting to be sent or being written
+      std::size_t GetQueuedBytes() const
+      {
+        return queued_bytes_;
+      }
+      std::uint32_t GetQueuedVmId() const
+      {
+        return queued_vm_id_;
+      }
+      // The VM the socket is connected to, which can be used from any thread
+      auto GetConnectedVm() const
+      {
+        return std::atomic_load(&connected_vm_);
+      }
     private:
       void OnDisconnect() override {
         LeaveServerConfig();
@@ -1657,19 +1870,8 @@ namespace CollabVm::Server
           (auto& channel) {
             channel.RemoveUser(std::move(self));
           };
-        if (connected_vm_id_) {
-          server_.virtual_machines_.dispatch([
-            id = connected_vm_id_, leave_channel]
-            (auto& virtual_machines)
-            {
-              const auto virtual_machine = virtual_machines.
-                GetAdminVirtualMachine(id);
-              if (!virtual_machine)
-              {
-                return;
-              }
-              virtual_machine->GetUserChannel(std::move(leave_channel));
-            });
+        if (const auto virtual_machine = GetConnectedVm()) {
+          virtual_machine->GetUserChannel(leave_channel);
         }
         if (is_in_global_chat_) {
           server_.global_chat_room_.dispatch(std::move(leave_channel));
@@ -1726,7 +1928,8 @@ namespace CollabVm::Server
           std::chrono::duration_cast<std::chrono::seconds>(
             std::chrono::steady_clock::now().time_since_epoch())
           .count();
-        auto socket_message = SocketMessage::CreateShared();
+        auto socket_message = SocketMessage::CreateShared(
+          CollabVmServerMessage::Message::CHAT_MESSAGE);
         auto& message_builder = socket_message->GetMessageBuilder();
         auto channel_chat_message =
           message_builder.initRoot<CollabVmServerMessage>()
@@ -1776,40 +1979,13 @@ namespace CollabVm::Server
             if (!username.empty() && (connected_vm_id_ || is_in_global_chat_))
             {
               auto update_username = 
-                [this, self = shared_from_this(), new_username=current_username, user_type]
+                [self = shared_from_this(), new_username=current_username, user_type]
                 (auto& channel) mutable {
-                  auto user_data = channel.GetUserData(self);
-                  if (!user_data.has_value()) {
-                    return;
-                  }
-                  user_data->get().user_type = user_type;
-                  auto& current_username = user_data.value().get().username;
-                  auto message = SocketMessage::CreateShared();
-                  auto username_change = message->GetMessageBuilder()
-                                                .initRoot<
-                                                  CollabVmServerMessage>()
-                                                .initMessage()
-                                                .initChangeUsername();
-                  username_change.setOldUsername(current_username);
-                  username_change.setNewUsername(new_username);
-
-                  current_username = std::move(new_username);
-
-                  channel.BroadcastMessage(std::move(message));
+                  channel.ChangeUsername(
+                    self, std::move(new_username), user_type);
                 };
-              if (connected_vm_id_) {
-                server_.virtual_machines_.dispatch([
-                  id = connected_vm_id_, update_username]
-                  (auto& virtual_machines)
-                  {
-                    const auto virtual_machine = virtual_machines.
-                      GetAdminVirtualMachine(id);
-                    if (!virtual_machine)
-                    {
-                      return;
-                    }
-                    virtual_machine->GetUserChannel(std::move(update_username));
-                  });
+              if (const auto virtual_machine = GetConnectedVm()) {
+                virtual_machine->GetUserChannel(update_username);
               }
               if (is_in_global_chat_) {
                 server_.global_chat_room_.dispatch(std::move(update_username));
@@ -1819,9 +1995,22 @@ namespace CollabVm::Server
       }
 
       CollabVmServer& server_;
-      StrandGuard<std::queue<std::shared_ptr<SocketMessage>>> send_queue_;
+      MessageBufferPool<CollabVmStaticMessageBuffer> static_buffers_;
+      MessageBufferPool<CollabVmDynamicMessageBuffer> dynamic_buffers_;
+      template <typename T>
+      using ConnectionGuard = ::StrandGuard<ConnectionStrand, T>;
+      ConnectionGuard<MessageQueue> send_queue_;
       bool sending_ = false;
-      StrandGuard<std::unordered_map<
+      // Called instead of sending the next message once the current one
+      // has been written
+      std::function<void()> pause_writes_callback_;
+      // Copies of the send queue's size and the VM that is being viewed,
+      // read by the memory report from other threads
+      std::atomic<std::size_t> queued_bytes_ = 0;
+      std::atomic<std::uint32_t> queued_vm_id_ = 0;
+      // Used by SendMessageBatch() from the send_queue_ strand
+      WebSocketFrameHeader batch_frame_header_;
+      ConnectionGuard<std::unordered_map<
         std::uint32_t,
         std::pair<std::shared_ptr<CollabVmSocket>, std::uint32_t>>>
         chat_rooms_;
@@ -1837,7 +2026,10 @@ namespace CollabVm::Server
       std::chrono::time_point<std::chrono::steady_clock> last_chat_message_;
       std::chrono::time_point<std::chrono::steady_clock> last_username_change_;
       std::uint32_t connected_vm_id_ = 0;
-      StrandGuard<std::string> username_;
+      // Only accessed with std::atomic_load() and std::atomic_store()
+      std::shared_ptr<AdminVirtualMachine<CollabVmServer, CollabVmSocket>>
+        connected_vm_;
+      ConnectionGuard<std::string> username_;
       std::shared_ptr<StrandGuard<IPData>> ip_data_;
       friend class CollabVmServer;
     };
@@ -1858,6 +2050,7 @@ namespace CollabVm::Server
         login_strand_(io_context_),
         global_chat_room_(
           io_context_,
+          decltype(global_chat_room_)::ConstructWithStrand,
           global_channel_id),
         guest_rng_(1'000, 99'999),
         vm_info_timer_(io_context_)
@@ -1884,7 +2077,8 @@ namespace CollabVm::Server
     void Start(const std::uint8_t threads,
                const std::string& host,
                const std::uint16_t port,
-               bool auto_start_vms) {
+               bool auto_start_vms,
+               const ServerOptions& server_options = ServerOptions()) {
       if (auto_start_vms)
       {
         virtual_machines_.dispatch([](auto& virtual_machines)
@@ -1901,7 +2095,22 @@ namespace CollabVm::Server
           });
         });
       }
-      TServer::Start(threads, host, port);
+      send_queue_options_ = server_options.send_queue;
+      input_coalesce_window_ = server_options.input_coalesce_window;
+      user_list_batching_ = server_options.user_list_batching;
+      channel_affinity_ = server_options.channel_affinity;
+      global_chat_room_.dispatch([this](auto& global_chat_room)
+      {
+        global_chat_room.SetUserListBatching(user_list_batching_);
+      });
+      virtual_machines_.dispatch([this](auto& virtual_machines)
+      {
+        virtual_machines.ForEachAdminVm([this](auto& vm)
+        {
+          vm.SetUserListBatching(user_list_batching_);
+        });
+      });
+      TServer::Start(threads, host, port, server_options);
     }
 
     void Stop() override {
@@ -1917,6 +2126,55 @@ namespace CollabVm::Server
       TServer::Stop();
     }
 
+    void ReportMemoryUsage() override {
+      TServer::ReportMemoryUsage();
+      const auto stats = SocketMessage::GetStats();
+      std::cout << "Messages: " << stats.messages << ", "
+                << stats.allocations << " allocated, "
+                << stats.extra_segments << " outgrew their first segment"
+                << std::endl;
+
+      auto queued_bytes = std::size_t(0);
+      auto max_queued_bytes = std::size_t(0);
+      auto vm_queued_bytes = std::map<std::uint32_t, std::size_t>();
+      TServer::ForEachConnection([&](auto& socket) {
+        const auto& collab_vm_socket =
+          static_cast<const CollabVmSocket<typename TServer::TSocket>&>(*socket);
+        const auto bytes = collab_vm_socket.GetQueuedBytes();
+        queued_bytes += bytes;
+        max_queued_bytes = std::max(max_queued_bytes, bytes);
+        if (const auto vm_id = collab_vm_socket.GetQueuedVmId()) {
+          vm_queued_bytes[vm_id] += bytes;
+        }
+      });
+      const auto queue_stats =
+        CollabVmSocket<typename TServer::TSocket>::MessageQueue::GetStats();
+      std::cout << "Send queues: " << queued_bytes / 1024 << " KiB, "
+                << max_queued_bytes / 1024 << " KiB for the largest client, "
+                << queue_stats.dropped_messages << " messages ("
+                << queue_stats.dropped_bytes / 1024 << " KiB) dropped, "
+                << queue_stats.resyncs << " resyncs, "
+                << queue_stats.disconnects << " disconnects" << std::endl;
+      for (const auto [vm_id, bytes] : vm_queued_bytes) {
+        std::cout << "  VM " << vm_id << ": " << bytes / 1024
+                  << " KiB queued" << std::endl;
+      }
+
+      const auto fan_out_stats =
+        FanOut<CollabVmSocket<typename TServer::TSocket>>::GetStats();
+      std::cout << "Broadcasts: " << fan_out_stats.local_recipients
+                << " recipients on the sending thread, "
+                << fan_out_stats.remote_recipients
+                << " on other threads in " << fan_out_stats.handoffs
+                << " handoffs, " << fan_out_stats.GetAvoidedHandoffs()
+                << " handoffs avoided" << std::endl;
+      if (channel_affinity_) {
+        std::cout << "Channel affinity: "
+                  << TServer::TSocket::GetMovedConnections()
+                  << " connections moved to their VM's threads" << std::endl;
+      }
+    }
+
     static void ExecuteCommandAsync(const std::string_view command) {
       // system() is used for simplicity but it is actually synchronous,
       // so the command is manipulated to make the shell return immediately
@@ -1932,10 +2190,10 @@ namespace CollabVm::Server
   protected:
     std::shared_ptr<typename TServer::TSocket> CreateSocket(
       boost::asio::io_context& io_context,
-      const std::filesystem::path& doc_root) override
+      StaticFileCache& file_cache) override
     {
       return std::make_shared<CollabVmSocket<typename TServer::TSocket>>(
-        io_context, doc_root, *this);
+        io_context, file_cache, *this);
     }
 
   private:
@@ -1991,13 +2249,9 @@ namespace CollabVm::Server
         global_chat_room_.dispatch(std::forward<TCallback>(callback));
         return;
       }
-      virtual_machines_.dispatch(
-        [id, callback = std::forward<TCallback>(callback)](auto& virtual_machines) {
-          if (const auto virtual_machine = virtual_machines.GetAdminVirtualMachine(id);
-              virtual_machine) {
-            virtual_machine->GetUserChannel(std::move(callback));
-          }
-        });
+      if (const auto virtual_machine = admin_vm_registry_.Find(id)) {
+        virtual_machine->GetUserChannel(std::forward<TCallback>(callback));
+      }
     }
 
     template<typename TCallback>
@@ -2006,12 +2260,7 @@ namespace CollabVm::Server
                  TCallback&& callback) {
       GetChannel(channel_id,
         [username, callback = std::forward<TCallback>(callback)](auto& channel) {
-          const auto& users = channel.GetUsers();
-          const auto user = std::find_if(users.cbegin(), users.cend(), [username](auto& user) {
-            auto& [socket, user_data] = user;
-            return user_data.username == username;
-          });
-          if (user != users.cend()) {
+          if (const auto user = channel.GetUsers().FindByUsername(username)) {
             callback(*user);
           }
         });
@@ -2133,6 +2382,13 @@ namespace CollabVm::Server
           ResizableList<InitAdminVmInfo>(
             std::move(admin_vm_list_message_builder));
 			  admin_virtual_machines_ = std::move(admin_virtual_machines);
+        server_.admin_vm_registry_.Update([this](auto& registry)
+        {
+          for (auto& [id, admin_vm] : admin_virtual_machines_)
+          {
+            registry.emplace(id, GetHandle(admin_vm));
+          }
+        });
       }
 
       AdminVirtualMachine<CollabVmServer, TClient>* GetAdminVirtualMachine(
@@ -2146,6 +2402,14 @@ namespace CollabVm::Server
         return &vm->second->vm;
       }
 
+      // Shares ownership of the AdminVm so the VM outlives the registry
+      // entries and sockets that refer to it
+      static std::shared_ptr<AdminVirtualMachine<CollabVmServer, TClient>>
+        GetHandle(const std::shared_ptr<AdminVm>& admin_vm)
+      {
+        return {admin_vm, &admin_vm->vm};
+      }
+
       bool RemoveAdminVirtualMachine(
         const std::uint32_t id)
       {
@@ -2158,6 +2422,10 @@ namespace CollabVm::Server
         vm->second->vm.GetUserChannel([](auto& channel) {
           channel.Clear();
         });
+        server_.admin_vm_registry_.Update([id](auto& registry)
+        {
+          registry.erase(id);
+        });
         // FIXME: memory leak
         vm->second.reset();
         admin_virtual_machines_.erase(vm);
@@ -2208,6 +2476,12 @@ namespace CollabVm::Server
         auto [it, inserted_new] =
           admin_virtual_machines_.emplace(id, std::move(vm));
         assert(inserted_new);
+        server_.admin_vm_registry_.Update(
+          [id, handle = GetHandle(it->second)](auto& registry)
+          {
+            registry.emplace(id, handle);
+          });
+        it->second->vm.SetUserListBatching(server_.user_list_batching_);
         return it->second->vm;
       }
 
@@ -2698,9 +2972,23 @@ namespace CollabVm::Server
     > ip_data_;
     boost::asio::ssl::context ssl_ctx_;
     CaptchaVerifier captcha_verifier_;
+    MessageCompressionPolicy compression_policy_;
+    SendQueueOptions send_queue_options_;
   public:
+    // Handles to the VMs in virtual_machines_, for messages that only need
+    // to be passed on to a VM's own strand
+    CopyOnWriteMap<
+      std::uint32_t,
+      std::shared_ptr<AdminVirtualMachine<
+        CollabVmServer, CollabVmSocket<typename TServer::TSocket>>>>
+    admin_vm_registry_;
     StrandGuard<VirtualMachinesList<CollabVmSocket<typename TServer::TSocket>>>
     virtual_machines_;
+    // The same default as ServerOptions
+    std::chrono::milliseconds input_coalesce_window_ =
+      std::chrono::milliseconds(10);
+    UserListBatchOptions user_list_batching_;
+    bool channel_affinity_ = false;
     boost::asio::io_context::strand login_strand_;
     StrandGuard<UserChannel<Socket, typename CollabVmSocket<typename TServer::TSocket>::UserData>> global_chat_room_;
     std::uniform_int_distribution<std::uint32_t> guest_rng_;
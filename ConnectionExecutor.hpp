@@ -0,0 +1,123 @@
+#pragma once
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/strand.hpp>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include "FanOut.hpp"
+
+namespace CollabVm::Server {
+/**
+ * The io_context that a connection's strands run on. It can be changed
+ * while the connection is open, for example to move the connection to the
+ * event loop of the VM it's viewing. Handlers that were already handed to
+ * the old io_context still run there, and each strand keeps running one
+ * handler at a time.
+ * Outstanding work is counted as one unit of work on the current
+ * io_context, which is started on the new io_context before it's finished
+ * on the old one, so neither can run out of work while the connection
+ * is being moved.
+ */
+class ConnectionContext {
+ public:
+  explicit ConnectionContext(boost::asio::io_context& io_context)
+      : io_context_(&io_context) {}
+
+  boost::asio::io_context& Get() const noexcept {
+    return *io_context_.load(std::memory_order_acquire);
+  }
+
+  void MoveTo(boost::asio::io_context& io_context) noexcept {
+    auto lock = std::lock_guard(work_mutex_);
+    auto& old_io_context = Get();
+    if (work_) {
+      io_context.get_executor().on_work_started();
+    }
+    io_context_.store(&io_context, std::memory_order_release);
+    if (work_) {
+      old_io_context.get_executor().on_work_finished();
+    }
+  }
+
+  void OnWorkStarted() noexcept {
+    auto lock = std::lock_guard(work_mutex_);
+    if (!work_++) {
+      Get().get_executor().on_work_started();
+    }
+  }
+
+  void OnWorkFinished() noexcept {
+    auto lock = std::lock_guard(work_mutex_);
+    if (!--work_) {
+      Get().get_executor().on_work_finished();
+    }
+  }
+
+ private:
+  std::atomic<boost::asio::io_context*> io_context_;
+  std::mutex work_mutex_;
+  std::size_t work_ = 0;
+};
+
+/**
+ * An executor for whichever io_context a ConnectionContext is on, used
+ * by the strands of a connection. Strands that are woken up from another
+ * thread are batched with HandoffBatch.
+ */
+class ConnectionExecutor {
+ public:
+  explicit ConnectionExecutor(std::shared_ptr<ConnectionContext> context) noexcept
+      : context_(std::move(context)) {}
+
+  boost::asio::io_context& context() const noexcept {
+    return context_->Get();
+  }
+
+  void on_work_started() const noexcept {
+    context_->OnWorkStarted();
+  }
+
+  void on_work_finished() const noexcept {
+    context_->OnWorkFinished();
+  }
+
+  template<typename Function, typename Allocator>
+  void dispatch(Function&& function, const Allocator&) const {
+    auto& io_context = context();
+    if (!io_context.get_executor().running_in_this_thread()) {
+      HandoffBatch::Post(io_context, std::forward<Function>(function));
+      return;
+    }
+    auto handler = std::decay_t<Function>(std::forward<Function>(function));
+    handler();
+  }
+
+  template<typename Function, typename Allocator>
+  void post(Function&& function, const Allocator&) const {
+    HandoffBatch::Post(context(), std::forward<Function>(function));
+  }
+
+  template<typename Function, typename Allocator>
+  void defer(Function&& function, const Allocator&) const {
+    HandoffBatch::Post(context(), std::forward<Function>(function));
+  }
+
+  friend bool operator==(const ConnectionExecutor& first,
+                         const ConnectionExecutor& second) noexcept {
+    return first.context_ == second.context_;
+  }
+
+  friend bool operator!=(const ConnectionExecutor& first,
+                         const ConnectionExecutor& second) noexcept {
+    return first.context_ != second.context_;
+  }
+
+ private:
+  std::shared_ptr<ConnectionContext> context_;
+};
+
+using ConnectionStrand = boost::asio::strand<ConnectionExecutor>;
+}  // namespace CollabVm::Server
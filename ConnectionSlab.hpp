@@ -0,0 +1,135 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace CollabVm::Server {
+/**
+ * A table of connections with constant time insertion and removal.
+ * Slots are reused, so each one has a generation that is incremented when
+ * it's freed to prevent stale handles from removing a newer connection.
+ * The table is split into partitions with their own locks, and each thread
+ * inserts into the same partition, so accepting and closing connections
+ * doesn't serialize the whole server.
+ */
+template<typename T>
+class ConnectionSlab {
+ public:
+  struct Handle {
+    std::uint32_t partition;
+    std::uint32_t index;
+    std::uint32_t generation;
+  };
+
+  explicit ConnectionSlab(
+    std::size_t partitions = std::thread::hardware_concurrency())
+      : partitions_(std::max<std::size_t>(partitions, 1)) {}
+
+  ConnectionSlab(const ConnectionSlab&) = delete;
+
+  Handle Insert(T value) {
+    const auto partition_index = GetThreadPartition();
+    auto& partition = partitions_[partition_index];
+    auto lock = std::lock_guard(partition.mutex);
+    auto index = partition.free_head;
+    if (index == no_slot) {
+      index = static_cast<std::uint32_t>(partition.slots.size());
+      partition.slots.emplace_back();
+    } else {
+      partition.free_head = partition.slots[index].next_free;
+    }
+    auto& slot = partition.slots[index];
+    slot.value = std::move(value);
+    slot.occupied = true;
+    partition.size++;
+    return {partition_index, index, slot.generation};
+  }
+
+  /**
+   * Removes the value and returns it, or returns an empty value if
+   * the handle is stale.
+   */
+  T Remove(const Handle& handle) {
+    auto& partition = partitions_[handle.partition];
+    auto lock = std::lock_guard(partition.mutex);
+    auto& slot = partition.slots[handle.index];
+    if (slot.generation != handle.generation || !slot.occupied) {
+      return T();
+    }
+    slot.generation++;
+    slot.occupied = false;
+    slot.next_free = partition.free_head;
+    partition.free_head = handle.index;
+    partition.size--;
+    // Returned so it's destroyed outside of the lock
+    return std::exchange(slot.value, T());
+  }
+
+  std::size_t GetPartitionCount() const {
+    return partitions_.size();
+  }
+
+  /**
+   * Calls the function for every value in a partition. The partition is
+   * locked while this runs, so the function must not insert or remove.
+   */
+  template<typename TFunction>
+  void ForEach(std::size_t partition_index, TFunction&& function) {
+    auto& partition = partitions_[partition_index];
+    auto lock = std::lock_guard(partition.mutex);
+    for (auto& slot : partition.slots) {
+      if (slot.occupied) {
+        function(slot.value);
+      }
+    }
+  }
+
+  template<typename TFunction>
+  void ForEach(TFunction&& function) {
+    for (auto i = std::size_t(0); i < partitions_.size(); i++) {
+      ForEach(i, function);
+    }
+  }
+
+  std::size_t GetSize() {
+    auto size = std::size_t(0);
+    for (auto& partition : partitions_) {
+      auto lock = std::lock_guard(partition.mutex);
+      size += partition.size;
+    }
+    return size;
+  }
+
+ private:
+  constexpr static auto no_slot = std::uint32_t(-1);
+
+  struct Slot {
+    T value;
+    std::uint32_t generation = 0;
+    bool occupied = false;
+    // The next slot in the free list
+    std::uint32_t next_free = no_slot;
+  };
+
+  // Aligned to keep each lock on its own cache line
+  struct alignas(64) Partition {
+    std::mutex mutex;
+    std::vector<Slot> slots;
+    std::uint32_t free_head = no_slot;
+    std::size_t size = 0;
+  };
+
+  std::uint32_t GetThreadPartition() const {
+    static std::atomic<std::uint32_t> next_thread = 0;
+    thread_local const auto thread_index = next_thread++;
+    return thread_index % partitions_.size();
+  }
+
+  std::vector<Partition> partitions_;
+};
+}  // namespace CollabVm::Server
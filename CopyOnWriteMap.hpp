@@ -0,0 +1,42 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+namespace CollabVm::Server {
+/**
+ * A map that can be read from any thread without locking. Each update
+ * copies the map and publishes the copy, and readers keep using the
+ * snapshot they loaded, so it suits maps that are rarely changed.
+ * Updates must not be made concurrently, for example by only making them
+ * from one strand.
+ */
+template<typename TKey, typename TValue>
+class CopyOnWriteMap {
+ public:
+  using Map = std::unordered_map<TKey, TValue>;
+
+  std::shared_ptr<const Map> Load() const {
+    return std::atomic_load(&map_);
+  }
+
+  // Returns a copy of the value, or a default-constructed one if the key
+  // isn't in the map
+  TValue Find(const TKey& key) const {
+    const auto map = Load();
+    const auto it = map->find(key);
+    return it == map->end() ? TValue() : it->second;
+  }
+
+  template<typename TCallback>
+  void Update(TCallback&& callback) {
+    auto map = std::make_shared<Map>(*Load());
+    callback(*map);
+    std::atomic_store(&map_, std::shared_ptr<const Map>(std::move(map)));
+  }
+
+ private:
+  std::shared_ptr<const Map> map_ = std::make_shared<const Map>();
+};
+}  // namespace CollabVm::Server
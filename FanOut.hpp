@@ -0,0 +1,168 @@
+#pragma once
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace CollabVm::Server {
+// Counters for every FanOut, printed with the memory report
+struct FanOutStats {
+  // Recipients on the broadcasting event loop, which are handled inline
+  std::uint64_t local_recipients = 0;
+  std::uint64_t remote_recipients = 0;
+  // Handlers posted to other event loops, at most one for each loop
+  // per broadcast
+  std::uint64_t handoffs = 0;
+
+  // How many posts were saved compared to one for each recipient
+  std::uint64_t GetAvoidedHandoffs() const {
+    return local_recipients + remote_recipients - handoffs;
+  }
+};
+
+/**
+ * Collects the handlers that are posted to io_contexts while it exists on
+ * the current thread so each io_context is sent one handler that runs all
+ * of them, instead of being woken up once for each handler. Executors opt
+ * in by posting with HandoffBatch::Post().
+ */
+class HandoffBatch {
+ public:
+  HandoffBatch() : previous_(current_) {
+    current_ = this;
+  }
+
+  HandoffBatch(const HandoffBatch&) = delete;
+
+  ~HandoffBatch() {
+    Flush();
+    current_ = previous_;
+  }
+
+  // Adds the handler to the current thread's batch, or posts it if there
+  // isn't one
+  template<typename THandler>
+  static void Post(boost::asio::io_context& io_context, THandler&& handler) {
+    if (!current_) {
+      boost::asio::post(io_context, std::forward<THandler>(handler));
+      return;
+    }
+    auto& groups = current_->groups_;
+    auto group = std::find_if(groups.begin(), groups.end(),
+      [&io_context](const auto& group) {
+        return group.io_context == &io_context;
+      });
+    if (group == groups.end()) {
+      group = groups.insert(groups.end(), {&io_context, {}});
+    }
+    group->handlers.push_back(
+      std::make_unique<Handler<std::decay_t<THandler>>>(
+        std::forward<THandler>(handler)));
+  }
+
+  // Posts the handlers collected so far and returns how many
+  // io_contexts they were posted to
+  std::size_t Flush() {
+    const auto handoffs = groups_.size();
+    for (auto& group : groups_) {
+      boost::asio::post(*group.io_context,
+        [handlers = std::move(group.handlers)]() {
+          for (auto& handler : handlers) {
+            handler->Invoke();
+          }
+        });
+    }
+    groups_.clear();
+    return handoffs;
+  }
+
+ private:
+  struct HandlerBase {
+    virtual ~HandlerBase() = default;
+    virtual void Invoke() = 0;
+  };
+
+  template<typename THandler>
+  struct Handler final : HandlerBase {
+    explicit Handler(THandler&& handler) : handler(std::move(handler)) {}
+    explicit Handler(const THandler& handler) : handler(handler) {}
+    void Invoke() override {
+      handler();
+    }
+    THandler handler;
+  };
+
+  struct Group {
+    boost::asio::io_context* io_context;
+    std::vector<std::unique_ptr<HandlerBase>> handlers;
+  };
+
+  std::vector<Group> groups_;
+  HandoffBatch* previous_;
+  inline static thread_local HandoffBatch* current_ = nullptr;
+};
+
+/**
+ * Delivers a broadcast with at most one handler for each event loop
+ * instead of one for each recipient. The callback is called with every
+ * recipient from the caller's thread and should queue the work on the
+ * recipient's strands. Strands that use HandoffBatch::Post() to schedule
+ * themselves on another io_context, like ConnectionStrand, are then woken
+ * up together, and idle strands on the caller's own io_context run inline.
+ * Because the work is queued on each strand before Post() returns, it is
+ * in order with anything else the caller queues on the same strands.
+ * Recipients return the io_context their strands run on from
+ * GetIoContext(), which is only used for the stats.
+ */
+template<typename TRecipient>
+class FanOut {
+ public:
+  void Add(std::shared_ptr<TRecipient> recipient) {
+    recipients_.push_back(std::move(recipient));
+  }
+
+  template<typename TCallback>
+  void Post(const TCallback& callback) {
+    auto local_recipients = std::uint64_t(0);
+    auto batch = HandoffBatch();
+    for (auto& recipient : recipients_) {
+      if (recipient->GetIoContext().get_executor().running_in_this_thread()) {
+        local_recipients++;
+      }
+      callback(*recipient);
+    }
+    auto& counters = GetStatsCounters();
+    counters.local_recipients += local_recipients;
+    counters.remote_recipients += recipients_.size() - local_recipients;
+    counters.handoffs += batch.Flush();
+    recipients_.clear();
+  }
+
+  static FanOutStats GetStats() {
+    const auto& counters = GetStatsCounters();
+    auto stats = FanOutStats();
+    stats.local_recipients = counters.local_recipients;
+    stats.remote_recipients = counters.remote_recipients;
+    stats.handoffs = counters.handoffs;
+    return stats;
+  }
+
+ private:
+  struct StatsCounters {
+    std::atomic<std::uint64_t> local_recipients = 0;
+    std::atomic<std::uint64_t> remote_recipients = 0;
+    std::atomic<std::uint64_t> handoffs = 0;
+  };
+
+  static StatsCounters& GetStatsCounters() {
+    static auto counters = StatsCounters();
+    return counters;
+  }
+
+  std::vector<std::shared_ptr<TRecipient>> recipients_;
+};
+}  // namespace CollabVm::Server
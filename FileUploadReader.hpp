@@ -1,18 +1,21 @@
 #pragma once
+#include <boost/beast/core/file.hpp>
 #include <boost/system/error_code.hpp>
-#include <beast/http/basic_parser_v1.hpp>
+#include <cstdint>
+#include <filesystem>
 #include <string>
-#include <cstdlib>
 
-namespace WebSocketServer
+namespace CollabVm::Server
 {
 	enum class UploadErrorCode
 	{
 		kNoError,
 		kInvalidPath,
 		kInvalidContentType,
-		kNoContentLen
-
+		kNoContentLen,
+		kUploadsDisabled,
+		kFileExists,
+		kWriteFailed
 	};
 
 	class UploadErrorCategory : public boost::system::error_category
@@ -36,6 +39,12 @@ namespace WebSocketServer
 				return "Invalid content type";
 			case UploadErrorCode::kNoContentLen:
 				return "No content length";
+			case UploadErrorCode::kUploadsDisabled:
+				return "Uploads are disabled";
+			case UploadErrorCode::kFileExists:
+				return "A file with the same name already exists";
+			case UploadErrorCode::kWriteFailed:
+				return "The file could not be written";
 			}
 		}
 	};
@@ -46,69 +55,113 @@ namespace WebSocketServer
 		return category;
 	}
 
-	struct FileUploadReader
+	inline boost::system::error_code make_error_code(UploadErrorCode error_code)
+	{
+		return boost::system::error_code(static_cast<int>(error_code), GetUploadErrorCategory());
+	}
+
+	/**
+	 * Writes the body of an upload request to a file as it's received.
+	 * The file is deleted if the upload doesn't finish.
+	 */
+	class FileUploadReader
 	{
-		using value_type = std::string;
+	public:
+		FileUploadReader(std::filesystem::path path, std::uint64_t size)
+			: path_(std::move(path)), size_(size)
+		{
+		}
+
+		FileUploadReader(const FileUploadReader&) = delete;
 
-		class reader
+		~FileUploadReader()
 		{
-			std::string& body_;
-			UploadErrorCode error_code_;
-		public:
-			template<bool isRequest, typename Fields>
-			reader(beast::http::message<isRequest, FileUploadReader, Fields>& msg) noexcept :
-				body_(msg.body)
+			if (!file_.is_open() || finished_)
 			{
-				if (msg.url != "/upload")
-				{
-					error_code_ = UploadErrorCode::kInvalidPath;
-					return;
-				}
+				return;
+			}
+			auto ec = boost::system::error_code();
+			file_.close(ec);
+			auto remove_error = std::error_code();
+			std::filesystem::remove(path_, remove_error);
+		}
 
-				const auto content_type = msg.fields.find("Content-Type");
-				if (content_type == msg.fields.end() ||
-					!beast::detail::ci_equal(content_type->second, "application/octet-stream"))
-				{
-					error_code_ = UploadErrorCode::kInvalidContentType;
-					return;
-				}
+		void Open(boost::system::error_code& ec)
+		{
+			auto directory_error = std::error_code();
+			std::filesystem::create_directories(path_.parent_path(), directory_error);
+			if (directory_error)
+			{
+				ec = make_error_code(UploadErrorCode::kInvalidPath);
+				return;
+			}
+			if (std::filesystem::exists(path_, directory_error))
+			{
+				ec = make_error_code(UploadErrorCode::kFileExists);
+				return;
+			}
+			file_.open(path_.string().c_str(), boost::beast::file_mode::write_new, ec);
+			if (ec)
+			{
+				ec = make_error_code(UploadErrorCode::kWriteFailed);
+			}
+		}
 
-				// NOTE: The content length should have already been parsed by the parser
-				// but it can't be accessed so it needs to be done again
-				const auto content_length = msg.fields.find("Content-Length");
-				if (content_length != msg.fields.end())
+		void Write(const void* data, std::size_t size, boost::system::error_code& ec)
+		{
+			if (bytes_written_ + size > size_)
+			{
+				ec = make_error_code(UploadErrorCode::kWriteFailed);
+				return;
+			}
+			while (size)
+			{
+				const auto written = file_.write(data, size, ec);
+				if (ec)
 				{
-					unsigned long len = std::strtoul(content_length->second.c_str(), nullptr, 10);
-					
+					ec = make_error_code(UploadErrorCode::kWriteFailed);
+					return;
 				}
-
-				// TODO: Respond to Expect headers
-				//const auto expect_header = m.fields.find("expect");
-				//if (expect_header != m.fields.cend())
-				//{
-				//	if (beast::detail::ci_equal(expect_header->second, "100-continue"))
-				//	{
-				//		// Respond with 100 (Continue) to accept upload
-				//	}
-				//	else
-				//	{
-				//		// Respond to unrecognized expectation with 417 (Expectation Failed)
-				//	}
-				//}
-
-
+				bytes_written_ += written;
+				data = static_cast<const char*>(data) + written;
+				size -= written;
 			}
+		}
 
-			void init(boost::system::error_code& ec) noexcept
+		void Finish(boost::system::error_code& ec)
+		{
+			if (bytes_written_ != size_)
 			{
-				if (error_code_ != UploadErrorCode::kNoError)
-					ec = boost::system::error_code(static_cast<int>(error_code_), GetUploadErrorCategory());
+				ec = make_error_code(UploadErrorCode::kWriteFailed);
+				return;
 			}
+			file_.close(ec);
+			finished_ = !ec;
+		}
 
-			void write(const void* data, std::size_t size, boost::system::error_code&) noexcept
-			{
+		const std::filesystem::path& GetPath() const
+		{
+			return path_;
+		}
 
-			}
-		};
+		std::uint64_t GetSize() const
+		{
+			return size_;
+		}
+
+	private:
+		std::filesystem::path path_;
+		std::uint64_t size_;
+		std::uint64_t bytes_written_ = 0;
+		boost::beast::file file_;
+		bool finished_ = false;
+	};
+}
+
+namespace boost::system
+{
+	template<>
+	struct is_error_code_enum<CollabVm::Server::UploadErrorCode> : std::true_type
+	{
 	};
 }
@@ -1,10 +1,46 @@
 #pragma once
 
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 
 namespace CollabVm::Server
 {
+/**
+ * A token bucket that limits the rate an IP can upload files at.
+ */
+struct UploadQuota
+{
+  constexpr static double bytes_per_second = 1024 * 1024;
+  /**
+   * The number of bytes that can be uploaded without being throttled.
+   */
+  constexpr static double max_burst = 8 * 1024 * 1024;
+
+  /**
+   * Takes bytes from the bucket and returns how long the uploader should
+   * wait before sending more.
+   */
+  std::chrono::steady_clock::duration Consume(
+    std::uint64_t bytes, std::chrono::steady_clock::time_point now)
+  {
+    const auto elapsed =
+      std::chrono::duration<double>(now - last_refill).count();
+    tokens = std::min(max_burst, tokens + elapsed * bytes_per_second);
+    last_refill = now;
+    tokens -= bytes;
+    if (tokens >= 0)
+    {
+      return {};
+    }
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(-tokens / bytes_per_second));
+  }
+
+  double tokens = max_burst;
+  std::chrono::steady_clock::time_point last_refill;
+};
+
 /**
  * Data associated with a user's IP address to be used for spam prevention.
  */
@@ -14,5 +50,7 @@ struct IPData
    * The number of active connections from the IP.
    */
   std::uint8_t connections = 0;
+
+  UploadQuota upload_quota;
 };
 } // namespace CollabVm::Server
@@ -0,0 +1,67 @@
+#pragma once
+#include <chrono>
+#include <optional>
+#include <utility>
+
+namespace CollabVm::Server {
+/**
+ * Limits how often mouse movements are sent to a VM. A move is sent right
+ * away unless another one was sent less than a window ago, in which case it
+ * is held until the window ends and replaced by any later move it can be
+ * merged with. Moves that can't be merged, such as ones that press or
+ * release buttons, are sent in order with the held move, and other input
+ * should be sent after calling Flush() so it stays in order too.
+ * Must only be used from one strand.
+ */
+template<typename TMove>
+class InputCoalescer {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // Returns true if the move was held, and Flush() should be called at
+  // GetFlushTime()
+  template<typename TCanMerge, typename TSend>
+  bool AddMove(TMove&& move, Clock::duration window, Clock::time_point now,
+               TCanMerge&& can_merge, TSend&& send) {
+    if (pending_) {
+      if (can_merge(*pending_, move)) {
+        *pending_ = std::move(move);
+        return false;
+      }
+      Flush(send, now);
+      send(std::move(move));
+      return false;
+    }
+    if (now - last_sent_ >= window) {
+      last_sent_ = now;
+      send(std::move(move));
+      return false;
+    }
+    pending_ = std::move(move);
+    return true;
+  }
+
+  template<typename TSend>
+  void Flush(TSend&& send, Clock::time_point now = Clock::now()) {
+    if (!pending_) {
+      return;
+    }
+    last_sent_ = now;
+    auto move = std::move(*pending_);
+    pending_.reset();
+    send(std::move(move));
+  }
+
+  void Clear() {
+    pending_.reset();
+  }
+
+  Clock::time_point GetFlushTime(Clock::duration window) const {
+    return last_sent_ + window;
+  }
+
+ private:
+  std::optional<TMove> pending_;
+  Clock::time_point last_sent_;
+};
+}  // namespace CollabVm::Server
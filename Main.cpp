@@ -10,6 +10,7 @@
 #include <argon2.h>
 #include <openssl/opensslv.h>
 #include <sqlite3.h>
+#include <chrono>
 #include <cstdint>
 #include <clipp.h>
 #include <iostream>
@@ -36,6 +37,23 @@ int main(int argc, char* argv[]) {
   auto port = 0u;
   auto root = "./web-app/"s;
   auto auto_start_vms = true;
+  auto server_options = CollabVm::Server::ServerOptions();
+  auto& admission = server_options.admission;
+  auto shed_lag_ms = 0u;
+  auto& send_queue = server_options.send_queue;
+  auto send_queue_high_kib = send_queue.high_watermark / 1024;
+  auto send_queue_low_kib = send_queue.low_watermark / 1024;
+  auto send_queue_max_kib = send_queue.max_bytes / 1024;
+  auto slow_client_policy = "resync"s;
+  auto max_display_lag_ms =
+    static_cast<unsigned>(send_queue.max_display_lag.count());
+  auto input_coalesce_ms =
+    static_cast<unsigned>(server_options.input_coalesce_window.count());
+  auto& user_list_batching = server_options.user_list_batching;
+  auto user_list_batch_ms =
+    static_cast<unsigned>(user_list_batching.window.count());
+  auto user_list_batch_min_users =
+    static_cast<unsigned>(user_list_batching.min_users);
   auto invalid_arguments = std::vector<std::string>();
   enum {
     start,
@@ -44,7 +62,8 @@ int main(int argc, char* argv[]) {
   } mode = start;
   const auto cli_arguments = (
       (option("--host", "-l") & value("address", host))
-        .doc("ip or host to listen on (default: localhost)"),
+        .doc("ip or host to listen on, or unix:path for a Unix domain socket "
+          "(default: localhost)"),
       (option("--threads", "-t") & integer("number", threads))
         .doc("the number of threads the server will use (default: "
           + std::to_string(threads) + " - half the number of cores)"),
@@ -52,8 +71,78 @@ int main(int argc, char* argv[]) {
         .doc("the port to listen on (default: random)"),
       (option("--root", "-r") & value("path", root))
         .doc("the root directory to serve files from (default: '" + root + "')"),
-      option("--cert", "-c") // TODO: use this argument
+      option("--reuse-port", "-s").set(server_options.reuse_port)
+        .doc("give each thread its own SO_REUSEPORT listener, VMs and "
+          "shared server state are run by --shared-threads more threads"),
+      (option("--shared-threads") & integer("number", server_options.shared_threads))
+        .doc("with --reuse-port, the number of threads that run the VMs "
+          "and shared server state (default: the same as --threads)"),
+      option("--channel-affinity").set(server_options.channel_affinity)
+        .doc("with --reuse-port, move connections to the threads that run "
+          "the VM they join so broadcasts don't have to be handed off"),
+      option("--deflate", "-d").set(server_options.compression.enabled)
+        .doc("compress messages with permessage-deflate, the server won't "
+          "start if the version of Beast it was built with can't"),
+      (option("--deflate-window-bits") & integer("9-15", server_options.compression.window_bits))
+        .doc("the deflate window size (default: "
+          + std::to_string(server_options.compression.window_bits) + ")"),
+      (option("--deflate-mem-level") & integer("1-9", server_options.compression.mem_level))
+        .doc("the deflate memory level (default: "
+          + std::to_string(server_options.compression.mem_level) + ")"),
+      (option("--cert", "-c") & value("path", server_options.tls_certificate))
         .doc("path to PEM certificate to use for SSL/TLS"),
+      (option("--key") & value("path", server_options.tls_private_key))
+        .doc("path to the certificate's PEM private key "
+          "(default: read from the certificate file)"),
+      (option("--max-connections") & integer("number", admission.max_connections))
+        .doc("close new connections when there are this many open (default: unlimited)"),
+      (option("--max-listener-connections") & integer("number", admission.max_listener_connections))
+        .doc("the same as --max-connections, but for each address being listened on"),
+      (option("--backlog") & integer("number", admission.backlog))
+        .doc("the number of pending connections the OS will queue (default: "
+          + std::to_string(admission.backlog) + ")"),
+      (option("--shed-connections") & integer("number", admission.shed_connections))
+        .doc("reject new WebSocket connections with 503 when there are more "
+          "than this many open (default: disabled)"),
+      (option("--shed-lag") & integer("milliseconds", shed_lag_ms))
+        .doc("reject new WebSocket connections with 503 when the event "
+          "loops fall this far behind (default: disabled)"),
+      option("--proxy-protocol").set(server_options.proxy_protocol)
+        .doc("read the client's address from a PROXY protocol v2 header "
+          "sent by a reverse proxy"),
+      (option("--send-queue-high") & integer("KiB", send_queue_high_kib))
+        .doc("apply --slow-client-policy when this much is queued for a "
+          "client (default: " + std::to_string(send_queue_high_kib) + ")"),
+      (option("--send-queue-low") & integer("KiB", send_queue_low_kib))
+        .doc("stop dropping a client's messages when its queue falls to "
+          "this size (default: " + std::to_string(send_queue_low_kib) + ")"),
+      (option("--send-queue-max") & integer("KiB", send_queue_max_kib))
+        .doc("disconnect clients when this much is queued, 0 for unlimited "
+          "(default: " + std::to_string(send_queue_max_kib) + ")"),
+      (option("--slow-client-policy")
+        & value("drop|resync|disconnect", slow_client_policy))
+        .doc("what happens to clients that reach --send-queue-high: drop "
+          "thumbnails, also replace queued display updates with the current "
+          "display, or disconnect them (default: resync)"),
+      (option("--max-display-lag") & integer("milliseconds", max_display_lag_ms))
+        .doc("with the resync policy, send the current display to clients "
+          "whose messages have been queued this long, 0 to disable (default: "
+          + std::to_string(max_display_lag_ms) + ")"),
+      (option("--input-coalesce-window")
+        & integer("milliseconds", input_coalesce_ms))
+        .doc("send at most one mouse movement per window to a VM, 0 to "
+          "send every movement (default: "
+          + std::to_string(input_coalesce_ms) + ")"),
+      (option("--user-list-batch-window")
+        & integer("milliseconds", user_list_batch_ms))
+        .doc("send the joins, leaves and username changes in a channel "
+          "together once per window, 0 to send each right away (default: "
+          + std::to_string(user_list_batch_ms) + ")"),
+      (option("--user-list-batch-min-users")
+        & integer("users", user_list_batch_min_users))
+        .doc("only batch user list changes in channels with at least this "
+          "many users (default: "
+          + std::to_string(user_list_batch_min_users) + ")"),
       option("--no-autostart", "-n").set(auto_start_vms, false)
         .doc("don't automatically start any VMs"),
       option("--version", "-v").set(mode, version)
@@ -63,7 +152,15 @@ int main(int argc, char* argv[]) {
       any_other(invalid_arguments)
     );
 
-  if (!parse(argc, argv, cli_arguments)
+  const auto parsed = parse(argc, argv, cli_arguments);
+  if (!threads) {
+    invalid_arguments.push_back("--threads 0");
+  }
+  if (slow_client_policy != "drop" && slow_client_policy != "resync"
+      && slow_client_policy != "disconnect") {
+    invalid_arguments.push_back(slow_client_policy);
+  }
+  if (!parsed
       || !invalid_arguments.empty()
       || mode == help) {
     std::for_each(
@@ -77,6 +174,26 @@ int main(int argc, char* argv[]) {
       << documentation(cli_arguments) << std::endl;
     return 0;
   }
+  server_options.compression.window_bits =
+    std::clamp(server_options.compression.window_bits, 9, 15);
+  server_options.compression.mem_level =
+    std::clamp(server_options.compression.mem_level, 1, 9);
+  admission.shed_lag = std::chrono::milliseconds(shed_lag_ms);
+  send_queue.high_watermark = send_queue_high_kib * 1024;
+  send_queue.low_watermark =
+    std::min(send_queue_low_kib, send_queue_high_kib) * 1024;
+  send_queue.max_bytes = send_queue_max_kib * 1024;
+  send_queue.max_display_lag = std::chrono::milliseconds(max_display_lag_ms);
+  server_options.input_coalesce_window =
+    std::chrono::milliseconds(input_coalesce_ms);
+  user_list_batching.window = std::chrono::milliseconds(user_list_batch_ms);
+  user_list_batching.min_users = user_list_batch_min_users;
+  using CollabVm::Server::SlowConsumerPolicy;
+  send_queue.policy = slow_client_policy == "drop"
+    ? SlowConsumerPolicy::kDropDroppable
+    : slow_client_policy == "disconnect"
+      ? SlowConsumerPolicy::kDisconnect
+      : SlowConsumerPolicy::kResync;
   if (mode == version) {
     std::cout << "collab-vm-server " BOOST_STRINGIZE(PROJECT_VERSION) "\n\n"
       "Third-Party Libraries:\n"
@@ -93,10 +210,16 @@ int main(int argc, char* argv[]) {
         << MODERN_SQLITE_VERSION / 1000 % 1000 << '.'
         << MODERN_SQLITE_VERSION / 1000 % 1000 << "\n"
       "OpenSSL " OPENSSL_VERSION_TEXT "\n"
-      "SQLite3 " SQLITE_VERSION "\n" << std::endl;
+      "SQLite3 " SQLITE_VERSION "\n"
+#ifdef BOOST_ASIO_HAS_IO_URING_AS_DEFAULT
+      "\nSocket I/O: io_uring\n"
+#else
+      "\nSocket I/O: default reactor\n"
+#endif
+      << std::endl;
     return 0;
   }
 
   using Server = CollabVm::Server::CollabVmServer<CollabVm::Server::WebServer>;
-  Server(root).Start(threads, host, port, auto_start_vms);
+  Server(root).Start(threads, host, port, auto_start_vms, server_options);
 }
@@ -0,0 +1,75 @@
+#pragma once
+#include <boost/asio/ip/address.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <optional>
+
+namespace CollabVm::Server {
+/**
+ * The header a reverse proxy sends before the client's data when it uses
+ * version 2 of the PROXY protocol.
+ * https://www.haproxy.org/download/2.0/doc/proxy-protocol.txt
+ */
+struct ProxyHeader {
+  // The signature, version, command, address family, and length
+  constexpr static auto prefix_size = std::size_t(16);
+
+  // The total number of bytes in the header
+  std::size_t size = prefix_size;
+  // Not set for LOCAL connections, such as the proxy's health checks,
+  // or for address families without an IP address
+  std::optional<boost::asio::ip::address> source_address;
+};
+
+enum class ProxyParseResult {
+  kOk,
+  // ProxyHeader::size is set to the number of bytes needed
+  kNeedMore,
+  kInvalid
+};
+
+inline ProxyParseResult ParseProxyHeader(const void* data,
+                                         std::size_t size,
+                                         ProxyHeader& header) {
+  constexpr static unsigned char signature[] = {
+    0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A
+  };
+  const auto bytes = static_cast<const unsigned char*>(data);
+  header = ProxyHeader();
+  // Reject connections without a header as soon as possible
+  if (size && std::memcmp(bytes, signature,
+                          std::min(size, sizeof(signature)))) {
+    return ProxyParseResult::kInvalid;
+  }
+  if (size < ProxyHeader::prefix_size) {
+    return ProxyParseResult::kNeedMore;
+  }
+  const auto version = bytes[12] >> 4;
+  const auto command = bytes[12] & 0x0F;
+  if (version != 2 || command > 1) {
+    return ProxyParseResult::kInvalid;
+  }
+  const auto address_length = std::size_t(bytes[14] << 8 | bytes[15]);
+  header.size = ProxyHeader::prefix_size + address_length;
+  if (size < header.size) {
+    return ProxyParseResult::kNeedMore;
+  }
+  if (command == 0) {
+    return ProxyParseResult::kOk;
+  }
+
+  const auto address_family = bytes[13] >> 4;
+  const auto addresses = bytes + ProxyHeader::prefix_size;
+  if (address_family == 1 && address_length >= 12) {
+    auto address = boost::asio::ip::address_v4::bytes_type();
+    std::copy_n(addresses, address.size(), address.begin());
+    header.source_address = boost::asio::ip::address_v4(address);
+  } else if (address_family == 2 && address_length >= 36) {
+    auto address = boost::asio::ip::address_v6::bytes_type();
+    std::copy_n(addresses, address.size(), address.begin());
+    header.source_address = boost::asio::ip::address_v6(address);
+  }
+  return ProxyParseResult::kOk;
+}
+}  // namespace CollabVm::Server
@@ -0,0 +1,194 @@
+#pragma once
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/execution_context.hpp>
+#include <boost/asio/version.hpp>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Asio added registered buffers in 1.22 (Boost 1.78), and only the io_uring
+// backend does anything with them
+#if defined(BOOST_ASIO_HAS_IO_URING) && BOOST_ASIO_VERSION >= 102200
+#include <boost/asio/buffer_registration.hpp>
+#include <boost/asio/registered_buffer.hpp>
+#include <boost/system/system_error.hpp>
+#define COLLAB_VM_HAS_REGISTERED_BUFFERS
+#endif
+
+namespace CollabVm::Server {
+/**
+ * Blocks of memory that sockets can write from with io_uring's fixed-buffer
+ * operations, so the kernel doesn't have to map the pages for every write.
+ * A ring can only hold one registration, so there is one arena for the
+ * whole process and every io_context registers all of it the first time
+ * one of its sockets looks up a buffer. Without io_uring nothing is
+ * allocated and Allocate() always returns nullptr.
+ */
+class RegisteredBuffers {
+ public:
+  // Blocks are between 256 bytes and 8 KiB, plus room for framing
+  constexpr static auto min_block_size = std::size_t(256);
+  constexpr static auto block_classes = std::size_t(6);
+  constexpr static auto block_padding = std::size_t(64);
+  constexpr static auto blocks_per_class = std::size_t(64);
+
+  // Returns the smallest free block that fits the size, or nullptr
+  static void* Allocate([[maybe_unused]] std::size_t size) {
+#ifdef COLLAB_VM_HAS_REGISTERED_BUFFERS
+    auto& arena = GetArena();
+    auto lock = std::lock_guard(arena.mutex);
+    for (auto block_class = std::size_t(0); block_class < block_classes;
+         block_class++) {
+      auto& free_blocks = arena.free_blocks[block_class];
+      if (GetBlockSize(block_class) >= size && !free_blocks.empty()) {
+        const auto block = free_blocks.back();
+        free_blocks.pop_back();
+        return block;
+      }
+    }
+#endif
+    return nullptr;
+  }
+
+  // Returns false if the memory wasn't allocated by Allocate()
+  static bool Deallocate([[maybe_unused]] void* block) {
+#ifdef COLLAB_VM_HAS_REGISTERED_BUFFERS
+    const auto offset = GetOffset(block);
+    if (!offset) {
+      return false;
+    }
+    auto& arena = GetArena();
+    auto lock = std::lock_guard(arena.mutex);
+    arena.free_blocks[GetBlockClass(*offset)].push_back(block);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+#ifdef COLLAB_VM_HAS_REGISTERED_BUFFERS
+  /**
+   * Returns the registered buffer for a sequence of one buffer that lies in
+   * the arena, so it can be given to a socket on the execution context.
+   */
+  template<typename ConstBufferSequence>
+  static std::optional<boost::asio::const_registered_buffer> Find(
+      boost::asio::execution_context& context,
+      const ConstBufferSequence& buffers) {
+    auto begin = boost::asio::buffer_sequence_begin(buffers);
+    const auto end = boost::asio::buffer_sequence_end(buffers);
+    if (begin == end || std::next(begin) != end) {
+      return {};
+    }
+    const auto buffer = boost::asio::const_buffer(*begin);
+    const auto offset = GetOffset(buffer.data());
+    if (!offset || *offset + buffer.size() > arena_size) {
+      return {};
+    }
+    auto& registration =
+      boost::asio::use_service<Registration>(context).registration;
+    if (!registration) {
+      return {};
+    }
+    return boost::asio::const_registered_buffer(
+      boost::asio::buffer((*registration)[0] + *offset, buffer.size()));
+  }
+#endif
+
+ private:
+  constexpr static std::size_t GetBlockSize(std::size_t block_class) {
+    return (min_block_size << block_class) + block_padding;
+  }
+
+  // The offset of the first block of a class
+  constexpr static std::size_t GetClassOffset(std::size_t block_class) {
+    return block_class == 0
+             ? 0
+             : GetClassOffset(block_class - 1)
+                 + GetBlockSize(block_class - 1) * blocks_per_class;
+  }
+
+  constexpr static auto arena_size =
+    blocks_per_class * (min_block_size * ((1 << block_classes) - 1)
+                        + block_padding * block_classes);
+
+  // The position of the memory in the arena, if it's in the arena
+  static std::optional<std::size_t> GetOffset(const void* data) {
+    const auto address = reinterpret_cast<std::uintptr_t>(data);
+    const auto begin =
+      reinterpret_cast<std::uintptr_t>(GetArena().memory.get());
+    if (address < begin || address >= begin + arena_size) {
+      return {};
+    }
+    return address - begin;
+  }
+
+  static std::size_t GetBlockClass(std::size_t offset) {
+    auto block_class = std::size_t(0);
+    while (block_class + 1 < block_classes
+           && GetClassOffset(block_class + 1) <= offset) {
+      block_class++;
+    }
+    return block_class;
+  }
+
+  struct Arena {
+    Arena() : memory(std::make_unique<std::byte[]>(arena_size)) {
+      for (auto block_class = std::size_t(0); block_class < block_classes;
+           block_class++) {
+        auto& free_blocks = this->free_blocks[block_class];
+        free_blocks.reserve(blocks_per_class);
+        for (auto i = blocks_per_class; i--;) {
+          free_blocks.push_back(memory.get() + GetClassOffset(block_class)
+                                + GetBlockSize(block_class) * i);
+        }
+      }
+    }
+    std::unique_ptr<std::byte[]> memory;
+    std::mutex mutex;
+    std::array<std::vector<void*>, block_classes> free_blocks;
+  };
+
+  static Arena& GetArena() {
+    static auto arena = Arena();
+    return arena;
+  }
+
+#ifdef COLLAB_VM_HAS_REGISTERED_BUFFERS
+  // Registers the arena with an execution context's ring, and unregisters
+  // it when the context shuts down
+  class Registration final
+      : public boost::asio::execution_context::service {
+   public:
+    using key_type = Registration;
+    inline static boost::asio::execution_context::id id;
+
+    explicit Registration(boost::asio::execution_context& context)
+        : boost::asio::execution_context::service(context) {
+      try {
+        registration.emplace(boost::asio::register_buffers(
+          context, std::array<boost::asio::mutable_buffer, 1>{
+                     boost::asio::buffer(GetArena().memory.get(),
+                                         arena_size)}));
+      } catch (const boost::system::system_error&) {
+        // The ring may refuse it, such as when RLIMIT_MEMLOCK is too low,
+        // and then the sockets use ordinary writes
+      }
+    }
+
+    std::optional<boost::asio::buffer_registration<
+      std::array<boost::asio::mutable_buffer, 1>>> registration;
+
+   private:
+    void shutdown() override {
+      registration.reset();
+    }
+  };
+#endif
+};
+}  // namespace CollabVm::Server
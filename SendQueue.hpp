@@ -0,0 +1,225 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+
+namespace CollabVm::Server {
+// What happens to a client whose queue reaches the high watermark
+enum class SlowConsumerPolicy {
+  // Messages that can be dropped are discarded, others are still queued
+  kDropDroppable,
+  // Display instructions are discarded as well, and the client is sent
+  // the whole display once its queue falls below the low watermark.
+  // This also happens when messages wait longer than max_display_lag.
+  kResync,
+  kDisconnect
+};
+
+struct SendQueueOptions {
+  // A client's queue is over its limit from when its unsent bytes reach
+  // the high watermark until they fall to the low watermark
+  std::size_t high_watermark = 4 * 1024 * 1024;
+  std::size_t low_watermark = 1024 * 1024;
+  SlowConsumerPolicy policy = SlowConsumerPolicy::kResync;
+  // Clients are disconnected under any policy when this many bytes are
+  // queued, zero means unlimited
+  std::size_t max_bytes = 32 * 1024 * 1024;
+  // With the resync policy, a client whose oldest unsent message has been
+  // waiting this long is sent the current display instead of the display
+  // instructions it hasn't received yet, zero disables
+  std::chrono::milliseconds max_display_lag = std::chrono::seconds(2);
+};
+
+// Counters for every SendQueue, printed with the memory report
+struct SendQueueStats {
+  std::uint64_t dropped_messages = 0;
+  std::uint64_t dropped_bytes = 0;
+  std::uint64_t resyncs = 0;
+  std::uint64_t disconnects = 0;
+};
+
+enum class SendMessageType {
+  kRequired,
+  // Messages that are superseded by later ones, such as thumbnails
+  kDroppable,
+  // Instructions that change the display, which can be replaced by a resync
+  kDisplay
+};
+
+/**
+ * A client's outgoing messages and the number of bytes they take up,
+ * including the messages that are being written. Must only be used from
+ * one strand.
+ */
+template<typename TMessage>
+class SendQueue {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  enum class PushResult { kQueued, kDropped, kDisconnect };
+
+  explicit SendQueue(const SendQueueOptions& options) : options_(options) {}
+
+  PushResult Push(TMessage message, SendMessageType type, std::size_t size,
+                  Clock::time_point now = Clock::now()) {
+    if (!over_limit_ && GetBytes() + size >= options_.high_watermark) {
+      over_limit_ = true;
+      if (options_.policy == SlowConsumerPolicy::kDisconnect) {
+        return Disconnect();
+      }
+      ApplyPolicy();
+    } else if (type == SendMessageType::kDisplay && IsLagging(now)) {
+      // Most of the queued instructions would be drawn over by newer ones
+      // by the time they arrived
+      DiscardMessages(true);
+      resync_pending_ = true;
+    }
+    if ((type == SendMessageType::kDisplay && resync_pending_)
+        || (type == SendMessageType::kDroppable && over_limit_)) {
+      CountDropped(size);
+      return PushResult::kDropped;
+    }
+    if (options_.max_bytes && GetBytes() + size > options_.max_bytes) {
+      return Disconnect();
+    }
+    messages_.push_back({std::move(message), type, size, now});
+    queued_bytes_ += size;
+    return PushResult::kQueued;
+  }
+
+  // Queues the display that was requested with TakeResyncRequest()
+  PushResult PushResync(TMessage message, std::size_t size) {
+    resync_pending_ = false;
+    resync_requested_ = false;
+    if (!message) {
+      return PushResult::kDropped;
+    }
+    return Push(std::move(message), SendMessageType::kRequired, size);
+  }
+
+  // The message is counted until FinishSend() is called
+  TMessage Pop() {
+    auto& entry = messages_.front();
+    auto message = std::move(entry.message);
+    queued_bytes_ -= entry.size;
+    sending_bytes_ += entry.size;
+    messages_.pop_front();
+    return message;
+  }
+
+  void FinishSend() {
+    sending_bytes_ = 0;
+    UpdateLimit();
+  }
+
+  // Returns true once when the client's display should be sent again
+  bool TakeResyncRequest() {
+    if (!resync_pending_ || resync_requested_ || over_limit_) {
+      return false;
+    }
+    resync_requested_ = true;
+    GetStatsCounters().resyncs++;
+    return true;
+  }
+
+  bool empty() const {
+    return messages_.empty();
+  }
+
+  std::size_t size() const {
+    return messages_.size();
+  }
+
+  std::size_t GetBytes() const {
+    return queued_bytes_ + sending_bytes_;
+  }
+
+  static SendQueueStats GetStats() {
+    const auto& counters = GetStatsCounters();
+    auto stats = SendQueueStats();
+    stats.dropped_messages = counters.dropped_messages;
+    stats.dropped_bytes = counters.dropped_bytes;
+    stats.resyncs = counters.resyncs;
+    stats.disconnects = counters.disconnects;
+    return stats;
+  }
+
+ private:
+  struct Entry {
+    TMessage message;
+    SendMessageType type;
+    std::size_t size;
+    Clock::time_point queued_at;
+  };
+
+  struct StatsCounters {
+    std::atomic<std::uint64_t> dropped_messages = 0;
+    std::atomic<std::uint64_t> dropped_bytes = 0;
+    std::atomic<std::uint64_t> resyncs = 0;
+    std::atomic<std::uint64_t> disconnects = 0;
+  };
+
+  static StatsCounters& GetStatsCounters() {
+    static auto counters = StatsCounters();
+    return counters;
+  }
+
+  void CountDropped(std::size_t size) {
+    auto& counters = GetStatsCounters();
+    counters.dropped_messages++;
+    counters.dropped_bytes += size;
+  }
+
+  PushResult Disconnect() {
+    GetStatsCounters().disconnects++;
+    return PushResult::kDisconnect;
+  }
+
+  // Discards the queued messages that the policy allows
+  void ApplyPolicy() {
+    const auto resync = options_.policy == SlowConsumerPolicy::kResync;
+    DiscardMessages(resync);
+    resync_pending_ = resync_pending_ || resync;
+    UpdateLimit();
+  }
+
+  void DiscardMessages(bool display) {
+    const auto end = std::remove_if(messages_.begin(), messages_.end(),
+      [this, display](const Entry& entry) {
+        if (entry.type == SendMessageType::kDroppable
+            || (display && entry.type == SendMessageType::kDisplay)) {
+          queued_bytes_ -= entry.size;
+          CountDropped(entry.size);
+          return true;
+        }
+        return false;
+      });
+    messages_.erase(end, messages_.end());
+  }
+
+  bool IsLagging(Clock::time_point now) const {
+    return options_.policy == SlowConsumerPolicy::kResync
+           && options_.max_display_lag.count() && !resync_pending_
+           && !messages_.empty()
+           && now - messages_.front().queued_at > options_.max_display_lag;
+  }
+
+  void UpdateLimit() {
+    if (over_limit_ && GetBytes() <= options_.low_watermark) {
+      over_limit_ = false;
+    }
+  }
+
+  const SendQueueOptions& options_;
+  std::deque<Entry> messages_;
+  std::size_t queued_bytes_ = 0;
+  std::size_t sending_bytes_ = 0;
+  bool over_limit_ = false;
+  bool resync_pending_ = false;
+  bool resync_requested_ = false;
+};
+}  // namespace CollabVm::Server
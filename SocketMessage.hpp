@@ -1,13 +1,60 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <memory>
+#include <optional>
+#include <vector>
+#include <capnp/schema.h>
 #include <capnp/serialize.h>
+#include "CollabVm.capnp.h"
+#include "RegisteredBuffers.hpp"
+#include "WebSocketFrameHeader.hpp"
 
 namespace CollabVm::Server {
 
 struct CopiedSocketMessage;
+struct GuacInstructionMessage;
 struct SharedSocketMessage;
 
+// A ConstBufferSequence that refers to buffers owned by a SocketMessage, so
+// writing a message to many connections doesn't copy its buffer list for
+// each of them. The message must outlive the view.
+class SocketMessageBuffers {
+public:
+  using value_type = boost::asio::const_buffer;
+  using const_iterator = const boost::asio::const_buffer*;
+
+  explicit SocketMessageBuffers(
+      const std::vector<boost::asio::const_buffer>& buffers)
+      : begin_(buffers.data()), end_(buffers.data() + buffers.size()) {
+  }
+
+  const_iterator begin() const {
+    return begin_;
+  }
+
+  const_iterator end() const {
+    return end_;
+  }
+
+private:
+  const_iterator begin_;
+  const_iterator end_;
+};
+
+// Counters for SocketMessage::CreateShared(), printed with the memory report
+struct SocketMessageStats {
+  std::uint64_t messages = 0;
+  // Messages that couldn't be recycled from a pool
+  std::uint64_t allocations = 0;
+  // Messages that outgrew their first segment
+  std::uint64_t extra_segments = 0;
+};
+
 struct SocketMessage : std::enable_shared_from_this<SocketMessage>
 {
   virtual ~SocketMessage() noexcept = default;
@@ -15,18 +62,69 @@ struct SocketMessage : std::enable_shared_from_this<SocketMessage>
   virtual std::vector<boost::asio::const_buffer>& GetBuffers() = 0;
   virtual void CreateFrame() = 0;
 
-  static std::shared_ptr<SharedSocketMessage> CreateShared() {
-    return std::make_shared<SharedSocketMessage>();
+  // Only valid after CreateFrame() has been called
+  CollabVmServerMessage::Message::Which GetMessageKind() const {
+    return message_kind_;
+  }
+
+  std::size_t GetSize() {
+    return boost::asio::buffer_size(GetBuffers());
+  }
+
+  // The buffers from GetBuffers() after a WebSocket frame header, so the
+  // message is only framed once no matter how many connections it's
+  // written to. Only valid after CreateFrame() has been called.
+  SocketMessageBuffers GetWebSocketFrame() const {
+    return SocketMessageBuffers(websocket_frame_);
   }
 
+  static std::shared_ptr<SharedSocketMessage> CreateShared();
+
+  // The first segment is sized to fit previous messages of the same kind,
+  // so small messages don't each need 8 KiB
+  static std::shared_ptr<SharedSocketMessage> CreateShared(
+    CollabVmServerMessage::Message::Which kind);
+
+  static SocketMessageStats GetStats();
+
+  // Wraps an instruction built by libguac in a GUAC_INSTR message
+  static std::shared_ptr<GuacInstructionMessage> CreateGuacInstruction(
+    capnp::MallocMessageBuilder& instruction_builder);
+
   static std::shared_ptr<CopiedSocketMessage> CopyFromMessageBuilder(
     capnp::MallocMessageBuilder& message_builder) {
     return std::make_shared<CopiedSocketMessage>(message_builder);
   }
+
+protected:
+  void CreateWebSocketFrame(
+      const std::vector<boost::asio::const_buffer>& buffers) {
+    frame_header_ = WebSocketFrameHeader(boost::asio::buffer_size(buffers));
+    websocket_frame_.clear();
+    websocket_frame_.reserve(buffers.size() + 1);
+    websocket_frame_.push_back(frame_header_.GetBuffer());
+    websocket_frame_.insert(websocket_frame_.end(),
+                            buffers.begin(), buffers.end());
+  }
+
+  CollabVmServerMessage::Message::Which message_kind_ = {};
+  WebSocketFrameHeader frame_header_;
+  std::vector<boost::asio::const_buffer> websocket_frame_;
 };
 
 struct SharedSocketMessage final : SocketMessage
 {
+  // The same as MallocMessageBuilder's default
+  constexpr static auto default_first_segment_words = std::size_t(1024);
+
+  explicit SharedSocketMessage(
+    std::size_t first_segment_words = default_first_segment_words)
+    : first_segment_(
+        AllocateFirstSegment(frame_headroom_words + first_segment_words)),
+      first_segment_words_(first_segment_words) {
+    shared_message_builder.emplace(GetFirstSegment());
+  }
+
   std::vector<boost::asio::const_buffer>& GetBuffers() override {
     assert(!framed_buffers_.empty());
     return framed_buffers_;
@@ -37,7 +135,14 @@ struct SharedSocketMessage final : SocketMessage
     if (!framed_buffers_.empty()) {
       return;
     }
-    auto segments = shared_message_builder.getSegmentsForOutput();
+    message_kind_ = shared_message_builder->getRoot<CollabVmServerMessage>()
+                      .asReader().getMessage().which();
+    auto segments = shared_message_builder->getSegmentsForOutput();
+    if (segments.size() == 1
+        && segments[0].begin() == GetFirstSegment().begin()) {
+      CreateContiguousFrame(segments[0].size());
+      return;
+    }
     const auto segment_count = segments.size();
     const auto frame_size = (segment_count + 2) & ~size_t(1);
     frame_.reserve(frame_size);
@@ -56,27 +161,325 @@ struct SharedSocketMessage final : SocketMessage
       // Set padding byte
       frame_.push_back(0);
     }
+    CreateWebSocketFrame(framed_buffers_);
   }
 
   ~SharedSocketMessage() noexcept override { }
 
   capnp::MallocMessageBuilder& GetMessageBuilder() {
     assert(frame_.empty() && framed_buffers_.empty());
-    return shared_message_builder;
+    return *shared_message_builder;
+  }
+
+  std::size_t GetFirstSegmentWords() const {
+    return first_segment_words_;
+  }
+
+  // The size of the message and whether it fit in the first segment
+  std::pair<std::size_t, bool> GetWordCount() {
+    const auto segments = shared_message_builder->getSegmentsForOutput();
+    auto words = std::size_t(0);
+    for (auto segment : segments) {
+      words += segment.size();
+    }
+    return {words, segments.size() <= 1};
+  }
+
+  // Clears the message so it can be built again without allocating
+  void Reset() {
+    // The first segment must be zeroed before it's given to a new builder
+    const auto segments = shared_message_builder->getSegmentsForOutput();
+    const auto first_segment = GetFirstSegment();
+    if (segments.size() != 0 && segments[0].begin() == first_segment.begin()) {
+      std::memset(first_segment.begin(), 0,
+                  segments[0].size() * sizeof(capnp::word));
+    }
+    shared_message_builder.emplace(first_segment);
+    frame_.clear();
+    framed_buffers_.clear();
+    websocket_frame_.clear();
+    message_kind_ = {};
   }
 
 private:
+  friend class SocketMessagePool;
+
+  // Room in front of the first segment for the segment table and the
+  // WebSocket frame header, so a message with one segment is one buffer
+  constexpr static auto frame_headroom_words = std::size_t(3);
+  static_assert(frame_headroom_words * sizeof(capnp::word)
+                  >= 2 * sizeof(std::uint32_t) + WebSocketFrameHeader::max_size);
+
+  struct SegmentDeleter {
+    void operator()(capnp::word* segment) const {
+      if (!RegisteredBuffers::Deallocate(segment)) {
+        delete[] segment;
+      }
+    }
+  };
+
+  using FirstSegment = std::unique_ptr<capnp::word[], SegmentDeleter>;
+
+  // The first segment is registered for io_uring's fixed-buffer writes
+  // when there is a free registered block
+  static FirstSegment AllocateFirstSegment(std::size_t words) {
+    const auto size = words * sizeof(capnp::word);
+    if (const auto block = RegisteredBuffers::Allocate(size)) {
+      std::memset(block, 0, size);
+      return FirstSegment(static_cast<capnp::word*>(block));
+    }
+    return FirstSegment(new capnp::word[words]());
+  }
+
+  kj::ArrayPtr<capnp::word> GetFirstSegment() const {
+    return kj::arrayPtr(first_segment_.get() + frame_headroom_words,
+                        first_segment_words_);
+  }
+
+  // Writes the segment table and the frame header into the headroom
+  void CreateContiguousFrame(std::size_t segment_words) {
+    const auto table = std::array<std::uint32_t, 2>{
+      0, static_cast<std::uint32_t>(segment_words)};
+    const auto message =
+      reinterpret_cast<std::uint8_t*>(GetFirstSegment().begin())
+      - sizeof(table);
+    std::memcpy(message, table.data(), sizeof(table));
+    const auto message_size =
+      sizeof(table) + segment_words * sizeof(capnp::word);
+    framed_buffers_.emplace_back(message, message_size);
+    frame_header_ = WebSocketFrameHeader(message_size);
+    const auto header = frame_header_.GetBuffer();
+    const auto frame = message - header.size();
+    std::memcpy(frame, header.data(), header.size());
+    websocket_frame_.clear();
+    websocket_frame_.emplace_back(frame, header.size() + message_size);
+  }
+
+  FirstSegment first_segment_;
+  std::size_t first_segment_words_;
   std::vector<std::uint32_t> frame_;
-  capnp::MallocMessageBuilder shared_message_builder;
+  std::optional<capnp::MallocMessageBuilder> shared_message_builder;
   std::vector<boost::asio::const_buffer> framed_buffers_;
+  // The kind that was given to CreateShared()
+  std::optional<CollabVmServerMessage::Message::Which> pool_kind_;
+};
+
+/**
+ * Recycles SharedSocketMessages so their first segments and buffers can be
+ * reused. Each thread has its own pool, so messages return to the pool of
+ * the thread that releases the last reference to them.
+ */
+class SocketMessagePool {
+public:
+  static std::shared_ptr<SharedSocketMessage> Create(
+    std::optional<CollabVmServerMessage::Message::Which> kind) {
+    auto first_segment_words = SharedSocketMessage::default_first_segment_words;
+    if (kind) {
+      first_segment_words = GetEstimate(*kind);
+    }
+    const auto size_class = GetSizeClass(first_segment_words);
+    GetStatsCounters().messages.fetch_add(1, std::memory_order_relaxed);
+    auto message = static_cast<SharedSocketMessage*>(nullptr);
+    auto& pool = GetThreadPool();
+    if (!pool.destroyed && !pool.messages[size_class].empty()) {
+      message = pool.messages[size_class].back().release();
+      pool.messages[size_class].pop_back();
+    } else {
+      GetStatsCounters().allocations.fetch_add(1, std::memory_order_relaxed);
+      message = new SharedSocketMessage(min_words << size_class);
+    }
+    message->pool_kind_ = kind;
+    return std::shared_ptr<SharedSocketMessage>(
+      message, Recycler(), ControlBlockAllocator<SharedSocketMessage>());
+  }
+
+  static SocketMessageStats GetStats() {
+    auto& stats = GetStatsCounters();
+    return {
+      stats.messages.load(std::memory_order_relaxed),
+      stats.allocations.load(std::memory_order_relaxed),
+      stats.extra_segments.load(std::memory_order_relaxed)
+    };
+  }
+
+private:
+  // First segments are between 256 bytes and 8 KiB
+  constexpr static auto min_words = std::size_t(32);
+  constexpr static auto size_classes = std::size_t(6);
+  // The most messages of each size kept by a thread
+  constexpr static auto max_pooled = std::size_t(64);
+
+  struct Recycler {
+    void operator()(SharedSocketMessage* message) const {
+      Recycle(message);
+    }
+  };
+
+  // Keeps freed shared_ptr control blocks so they can be reused
+  template<typename T>
+  struct ControlBlockAllocator {
+    using value_type = T;
+
+    ControlBlockAllocator() = default;
+    template<typename U>
+    ControlBlockAllocator(const ControlBlockAllocator<U>&) {}
+
+    T* allocate(std::size_t n) {
+      auto& free_list = GetFreeList();
+      if (n == 1 && !free_list.destroyed && !free_list.blocks.empty()) {
+        const auto block = free_list.blocks.back();
+        free_list.blocks.pop_back();
+        return block;
+      }
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* block, std::size_t n) {
+      auto& free_list = GetFreeList();
+      if (n == 1 && !free_list.destroyed
+          && free_list.blocks.size() < max_pooled * size_classes) {
+        free_list.blocks.push_back(block);
+        return;
+      }
+      ::operator delete(block);
+    }
+
+    template<typename U>
+    bool operator==(const ControlBlockAllocator<U>&) const { return true; }
+    template<typename U>
+    bool operator!=(const ControlBlockAllocator<U>&) const { return false; }
+
+  private:
+    struct FreeList {
+      ~FreeList() {
+        destroyed = true;
+        for (auto block : blocks) {
+          ::operator delete(block);
+        }
+      }
+      std::vector<T*> blocks;
+      // Messages can still be released while thread locals are destroyed
+      bool destroyed = false;
+    };
+
+    static FreeList& GetFreeList() {
+      thread_local auto free_list = FreeList();
+      return free_list;
+    }
+  };
+
+  struct ThreadPool {
+    ~ThreadPool() {
+      destroyed = true;
+    }
+    std::array<std::vector<std::unique_ptr<SharedSocketMessage>>,
+               size_classes> messages;
+    bool destroyed = false;
+  };
+
+  struct Stats {
+    std::atomic<std::uint64_t> messages = 0;
+    std::atomic<std::uint64_t> allocations = 0;
+    std::atomic<std::uint64_t> extra_segments = 0;
+  };
+
+  static std::size_t GetSizeClass(std::size_t words) {
+    auto size_class = std::size_t(0);
+    while (size_class + 1 < size_classes && (min_words << size_class) < words) {
+      size_class++;
+    }
+    return size_class;
+  }
+
+  static void Recycle(SharedSocketMessage* message) {
+    if (message->pool_kind_) {
+      const auto [words, fits] = message->GetWordCount();
+      if (!fits) {
+        GetStatsCounters().extra_segments.fetch_add(1, std::memory_order_relaxed);
+      }
+      UpdateEstimate(*message->pool_kind_, words);
+    }
+    auto& pool = GetThreadPool();
+    const auto size_class = GetSizeClass(message->GetFirstSegmentWords());
+    if (pool.destroyed || pool.messages[size_class].size() >= max_pooled) {
+      delete message;
+      return;
+    }
+    message->Reset();
+    pool.messages[size_class].emplace_back(message);
+  }
+
+  // The estimates follow the largest recent message of each kind and
+  // slowly shrink so a single large message doesn't stick
+  static std::size_t GetEstimate(CollabVmServerMessage::Message::Which kind) {
+    auto& estimates = GetEstimates();
+    return kind < estimates.size()
+             ? std::max<std::size_t>(
+                 estimates[kind].load(std::memory_order_relaxed), min_words)
+             : SharedSocketMessage::default_first_segment_words;
+  }
+
+  static void UpdateEstimate(CollabVmServerMessage::Message::Which kind,
+                             std::size_t words) {
+    auto& estimates = GetEstimates();
+    if (kind >= estimates.size()) {
+      return;
+    }
+    auto& estimate = estimates[kind];
+    const auto current = estimate.load(std::memory_order_relaxed);
+    estimate.store(std::max<std::uint32_t>(
+                     current - current / 32,
+                     std::min(words, SharedSocketMessage::default_first_segment_words)),
+                   std::memory_order_relaxed);
+  }
+
+  static std::vector<std::atomic<std::uint32_t>>& GetEstimates() {
+    static auto estimates = std::vector<std::atomic<std::uint32_t>>(
+      capnp::Schema::from<CollabVmServerMessage::Message>()
+        .getUnionFields().size());
+    return estimates;
+  }
+
+  static ThreadPool& GetThreadPool() {
+    thread_local auto pool = ThreadPool();
+    return pool;
+  }
+
+  static Stats& GetStatsCounters() {
+    static auto stats = Stats();
+    return stats;
+  }
 };
 
+inline std::shared_ptr<SharedSocketMessage> SocketMessage::CreateShared() {
+  return SocketMessagePool::Create({});
+}
+
+inline std::shared_ptr<SharedSocketMessage> SocketMessage::CreateShared(
+    CollabVmServerMessage::Message::Which kind) {
+  return SocketMessagePool::Create(kind);
+}
+
+inline SocketMessageStats SocketMessage::GetStats() {
+  return SocketMessagePool::GetStats();
+}
+
+inline std::shared_ptr<GuacInstructionMessage>
+SocketMessage::CreateGuacInstruction(
+    capnp::MallocMessageBuilder& instruction_builder) {
+  return std::make_shared<GuacInstructionMessage>(instruction_builder);
+}
+
 struct CopiedSocketMessage final : SocketMessage {
   CopiedSocketMessage(capnp::MallocMessageBuilder& message_builder)
     : buffer_(capnp::messageToFlatArray(message_builder)),
     framed_buffers_(
       { boost::asio::const_buffer(buffer_.asBytes().begin(),
-                                 buffer_.asBytes().size()) }) {}
+                                 buffer_.asBytes().size()) }) {
+    message_kind_ = message_builder.getRoot<CollabVmServerMessage>()
+                      .asReader().getMessage().which();
+    CreateWebSocketFrame(framed_buffers_);
+  }
 
   ~CopiedSocketMessage() noexcept override { }
 
@@ -90,4 +493,226 @@ private:
   std::vector<boost::asio::const_buffer> framed_buffers_;
 };
 
+// Leaves elements uninitialized when a vector grows because they're
+// about to be overwritten
+template<typename T>
+struct UninitializedAllocator : std::allocator<T> {
+  template<typename U>
+  struct rebind {
+    using other = UninitializedAllocator<U>;
+  };
+
+  UninitializedAllocator() = default;
+  template<typename U>
+  UninitializedAllocator(const UninitializedAllocator<U>&) {}
+
+  template<typename U>
+  void construct(U* pointer) noexcept {
+    ::new (static_cast<void*>(pointer)) U;
+  }
+  template<typename U, typename... TArgs>
+  void construct(U* pointer, TArgs&&... args) {
+    ::new (static_cast<void*>(pointer)) U(std::forward<TArgs>(args)...);
+  }
+};
+
+/**
+ * One or more GUAC_INSTR messages that reuse the segments of instructions
+ * built by libguac. setGuacInstr() would traverse an instruction and copy
+ * every field and image into a second builder. Instead, the segments are
+ * copied into the frame as they are, and one more segment is appended that
+ * holds the CollabVmServerMessage. That segment refers to the instruction
+ * with far pointers, so the instruction is only encoded once.
+ */
+struct GuacInstructionMessage final : SocketMessage {
+  using Buffer = std::vector<std::uint64_t, UninitializedAllocator<std::uint64_t>>;
+
+  explicit GuacInstructionMessage(
+      capnp::MallocMessageBuilder& instruction_builder) {
+    Append(buffer_, instruction_builder);
+    Init();
+  }
+
+  // Takes instructions that were added to the buffer with Append()
+  explicit GuacInstructionMessage(Buffer&& buffer)
+    : buffer_(std::move(buffer)) {
+    Init();
+  }
+
+  // Adds a framed message to the end of the buffer. Clients read every
+  // message in a WebSocket frame, so a buffer can hold many instructions.
+  static void Append(Buffer& buffer,
+                     capnp::MallocMessageBuilder& instruction_builder) {
+    const auto& wrapper = GetWrapper();
+    const auto segments = instruction_builder.getSegmentsForOutput();
+    assert(segments.size() != 0);
+    const auto wrapper_segment = segments.size();
+    const auto segment_count = segments.size() + 1;
+    const auto frame_words = ((segment_count + 2) & ~std::size_t(1)) / 2;
+    const auto wrapper_words = wrapper.root_struct.size() + 3;
+    auto words = frame_words + wrapper_words;
+    for (auto segment : segments) {
+      words += segment.size();
+    }
+    const auto start = buffer.size();
+    // Every word is written below
+    buffer.resize(start + words);
+
+    const auto frame = reinterpret_cast<std::uint32_t*>(&buffer[start]);
+    frame[0] = segment_count - 1;
+    if (segment_count % 2 == 0) {
+      frame[segment_count + 1] = 0;
+    }
+    auto position = &buffer[start + frame_words];
+    for (auto i = std::size_t(0); i < segments.size(); i++) {
+      frame[i + 1] = segments[i].size();
+      std::memcpy(position, segments[i].begin(),
+                  segments[i].size() * sizeof(capnp::word));
+      position += segments[i].size();
+    }
+    frame[segment_count] = wrapper_words;
+
+    // The root pointer now leads to the wrapper
+    const auto instruction_segment = &buffer[start + frame_words];
+    const auto instruction_pointer = instruction_segment[0];
+    instruction_segment[0] = FarPointer(wrapper_segment, 0, false);
+
+    // The wrapper's root pointer, the root struct, and a landing pad
+    const auto landing_pad = wrapper.root_struct.size() + 1;
+    position[0] = wrapper.root_pointer;
+    std::copy(wrapper.root_struct.begin(), wrapper.root_struct.end(),
+              position + 1);
+    auto& instruction_slot = position[1 + wrapper.instruction_slot];
+    if ((instruction_pointer & 3) == far_pointer_kind) {
+      // The root was allocated in another segment, the far pointer is
+      // still valid because segment IDs haven't changed
+      instruction_slot = instruction_pointer;
+      position[landing_pad] = 0;
+      position[landing_pad + 1] = 0;
+    } else {
+      const auto offset = static_cast<std::int32_t>(instruction_pointer) >> 2;
+      position[landing_pad] = FarPointer(0, 1 + offset, false);
+      // The tag has the struct's size and no offset
+      position[landing_pad + 1] = instruction_pointer & ~std::uint64_t(0xFFFFFFFF);
+      instruction_slot = FarPointer(wrapper_segment, landing_pad, true);
+    }
+  }
+
+  ~GuacInstructionMessage() noexcept override { }
+
+  std::vector<boost::asio::const_buffer>& GetBuffers() override {
+    return framed_buffers_;
+  }
+  void CreateFrame() override {
+  }
+private:
+  constexpr static auto far_pointer_kind = std::uint64_t(2);
+
+  struct Wrapper {
+    // A struct pointer to the word following it
+    std::uint64_t root_pointer;
+    // The data and pointer sections of a CollabVmServerMessage with
+    // guacInstr set, the pointer to the instruction is left null
+    std::vector<std::uint64_t> root_struct;
+    std::size_t instruction_slot;
+  };
+
+  static std::uint64_t FarPointer(std::size_t segment, std::size_t offset,
+                                  bool double_far) {
+    return std::uint64_t(segment) << 32 | std::uint64_t(offset) << 3
+           | (double_far ? 4 : 0) | far_pointer_kind;
+  }
+
+  // Lets capnp decide the layout of the root struct, so this doesn't
+  // depend on the order of fields in the schema
+  static const Wrapper& GetWrapper() {
+    static const auto wrapper = [] {
+      auto message_builder = capnp::MallocMessageBuilder();
+      message_builder.initRoot<CollabVmServerMessage>()
+                     .initMessage().initGuacInstr();
+      const auto segment = message_builder.getSegmentsForOutput()[0];
+      auto words = std::vector<std::uint64_t>(segment.size());
+      std::memcpy(words.data(), segment.begin(),
+                  segment.size() * sizeof(capnp::word));
+      const auto root_pointer = words[0];
+      const auto start =
+        1 + (static_cast<std::int32_t>(root_pointer) >> 2);
+      const auto data_words = (root_pointer >> 32) & 0xFFFF;
+      const auto pointer_count = root_pointer >> 48;
+      auto wrapper = Wrapper();
+      wrapper.root_pointer = root_pointer & ~std::uint64_t(0xFFFFFFFF);
+      wrapper.root_struct.assign(
+        words.begin() + start,
+        words.begin() + start + data_words + pointer_count);
+      // guacInstr is the only pointer that was set
+      const auto slot = std::find_if(
+        wrapper.root_struct.begin() + data_words, wrapper.root_struct.end(),
+        [](auto word) { return word != 0; });
+      assert(slot != wrapper.root_struct.end());
+      wrapper.instruction_slot = slot - wrapper.root_struct.begin();
+      *slot = 0;
+      return wrapper;
+    }();
+    return wrapper;
+  }
+
+  void Init() {
+    message_kind_ = CollabVmServerMessage::Message::GUAC_INSTR;
+    framed_buffers_.emplace_back(buffer_.data(),
+                                 buffer_.size() * sizeof(capnp::word));
+    CreateWebSocketFrame(framed_buffers_);
+  }
+
+  Buffer buffer_;
+  std::vector<boost::asio::const_buffer> framed_buffers_;
+};
+
+// Decides which kinds of messages are worth compressing when
+// permessage-deflate has been negotiated
+class MessageCompressionPolicy
+{
+public:
+  MessageCompressionPolicy()
+    : compressed_kinds_(capnp::Schema::from<CollabVmServerMessage::Message>()
+                          .getUnionFields().size(), true) {
+    // Images are already compressed
+    SetCompressed(CollabVmServerMessage::Message::GUAC_INSTR, false);
+    SetCompressed(CollabVmServerMessage::Message::VM_THUMBNAIL, false);
+  }
+
+  void SetCompressed(CollabVmServerMessage::Message::Which kind, bool compressed) {
+    compressed_kinds_.at(kind) = compressed;
+  }
+
+  bool ShouldCompress(SocketMessage& message) const {
+    return IsCompressible(message) && message.GetSize() >= min_size;
+  }
+
+  // Batches are compressed when most of their bytes are compressible
+  template<typename TMessages>
+  bool ShouldCompressBatch(const TMessages& messages) const {
+    auto compressible_bytes = std::size_t(0);
+    auto total_bytes = std::size_t(0);
+    for (auto& message : messages) {
+      const auto size = message->GetSize();
+      total_bytes += size;
+      if (IsCompressible(*message)) {
+        compressible_bytes += size;
+      }
+    }
+    return total_bytes >= min_size && compressible_bytes * 2 >= total_bytes;
+  }
+
+  // Messages smaller than this aren't worth compressing
+  std::size_t min_size = 128;
+
+private:
+  bool IsCompressible(const SocketMessage& message) const {
+    const auto kind = message.GetMessageKind();
+    return kind < compressed_kinds_.size() && compressed_kinds_[kind];
+  }
+
+  std::vector<bool> compressed_kinds_;
+};
+
 }
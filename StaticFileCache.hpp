@@ -0,0 +1,426 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <boost/beast/core/string.hpp>
+#include <zlib.h>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace CollabVm::Server {
+
+// Caches the files served from the doc root along with everything needed
+// to send them, so answering a request for a cached file doesn't touch the
+// filesystem. On Linux the cache is cleared by inotify whenever something
+// in the doc root changes.
+class StaticFileCache {
+ public:
+  // Files larger than this are streamed from disk instead of being cached
+  constexpr static auto max_file_size = 8 * 1024 * 1024;
+  // Limits the number of request targets that are remembered so random
+  // URLs can't grow the cache without bound
+  constexpr static auto max_targets = 4096;
+
+  struct File {
+    std::filesystem::path path;
+    std::string_view content_type;
+    std::string etag;
+    std::string last_modified;
+    // Empty when the file is too large to be cached
+    std::string content;
+    std::string gzip_content;
+    std::string brotli_content;
+    bool cached = false;
+  };
+
+  enum class Encoding { kIdentity, kGzip, kBrotli };
+
+  explicit StaticFileCache(boost::asio::io_context& io_context)
+#ifdef __linux__
+      : inotify_(io_context)
+#endif
+  {
+  }
+
+  void SetDocRoot(const std::filesystem::path& doc_root) {
+    doc_root_ = doc_root;
+#ifdef __linux__
+    const auto inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+      std::cout << "inotify is unavailable, changes to the doc root "
+                   "will require a restart" << std::endl;
+      return;
+    }
+    inotify_.assign(inotify_fd);
+    WatchDirectories();
+    ReadEvents();
+#endif
+  }
+
+  void Close() {
+#ifdef __linux__
+    auto ec = boost::system::error_code();
+    inotify_.close(ec);
+#endif
+  }
+
+  const std::filesystem::path& GetDocRoot() const {
+    return doc_root_;
+  }
+
+  // Blocking file I/O for files that aren't cached is done by this pool
+  // instead of the threads that run the sockets
+  boost::asio::thread_pool& GetFilePool() {
+    return file_pool_;
+  }
+
+  // Finds the file that should be served for a request target. The target
+  // is tried as-is, then with .html appended to its first part, and
+  // finally index.html is used. Returns null if none of them exist.
+  std::shared_ptr<const File> Find(std::string_view target) {
+    const auto key = std::string(target);
+    {
+      const auto lock = std::shared_lock(mutex_);
+      if (const auto it = targets_.find(key); it != targets_.end()) {
+        return it->second;
+      }
+    }
+
+    auto file = std::shared_ptr<const File>();
+    auto path = std::filesystem::path(key);
+    // Disallow relative paths
+    if (std::none_of(path.begin(), path.end(), [](const auto& e) {
+          return e == ".." || e == ".";
+        })) {
+      // First try the path without modifying it
+      if (!path.empty()) {
+        file = Load(path);
+      }
+      // Then try appending .html to the first part
+      if (!file && !path.empty()) {
+        path = *path.begin();
+        path += ".html";
+        file = Load(path);
+      }
+    }
+    // Default to index.html if the previous attempts failed
+    if (!file) {
+      file = Load("index.html");
+    }
+
+    const auto lock = std::unique_lock(mutex_);
+    if (targets_.size() >= max_targets) {
+      targets_.clear();
+    }
+    targets_.emplace(key, file);
+    return file;
+  }
+
+  // Picks the smallest variant of a file that the client accepts
+  static std::pair<Encoding, const std::string*> SelectContent(
+      const File& file, std::string_view accept_encoding) {
+    if (!file.brotli_content.empty() && Accepts(accept_encoding, "br")) {
+      return {Encoding::kBrotli, &file.brotli_content};
+    }
+    if (!file.gzip_content.empty() && Accepts(accept_encoding, "gzip")) {
+      return {Encoding::kGzip, &file.gzip_content};
+    }
+    return {Encoding::kIdentity, &file.content};
+  }
+
+  static bool IsNotModified(const File& file, std::string_view if_none_match) {
+    return !if_none_match.empty() &&
+           (if_none_match == "*" ||
+            if_none_match.find(file.etag) != std::string_view::npos);
+  }
+
+  // Return a reasonable mime type based on the extension of a file.
+  static std::string_view GetMimeType(const std::string_view path) {
+    using boost::beast::iequals;
+    const auto ext = [&path] {
+      const auto pos = path.rfind(".");
+      if (pos == std::string_view::npos)
+        return std::string_view{};
+      return path.substr(pos);
+    }();
+    if (iequals(ext, ".htm"))
+      return "text/html";
+    if (iequals(ext, ".html"))
+      return "text/html";
+    if (iequals(ext, ".php"))
+      return "text/html";
+    if (iequals(ext, ".css"))
+      return "text/css";
+    if (iequals(ext, ".txt"))
+      return "text/plain";
+    if (iequals(ext, ".js"))
+      return "application/javascript";
+    if (iequals(ext, ".json"))
+      return "application/json";
+    if (iequals(ext, ".xml"))
+      return "application/xml";
+    if (iequals(ext, ".swf"))
+      return "application/x-shockwave-flash";
+    if (iequals(ext, ".flv"))
+      return "video/x-flv";
+    if (iequals(ext, ".png"))
+      return "image/png";
+    if (iequals(ext, ".jpe"))
+      return "image/jpeg";
+    if (iequals(ext, ".jpeg"))
+      return "image/jpeg";
+    if (iequals(ext, ".jpg"))
+      return "image/jpeg";
+    if (iequals(ext, ".gif"))
+      return "image/gif";
+    if (iequals(ext, ".bmp"))
+      return "image/bmp";
+    if (iequals(ext, ".ico"))
+      return "image/vnd.microsoft.icon";
+    if (iequals(ext, ".tiff"))
+      return "image/tiff";
+    if (iequals(ext, ".tif"))
+      return "image/tiff";
+    if (iequals(ext, ".svg"))
+      return "image/svg+xml";
+    if (iequals(ext, ".svgz"))
+      return "image/svg+xml";
+    if (iequals(ext, ".wasm"))
+      return "application/wasm";
+    return "application/text";
+  }
+
+ private:
+  std::shared_ptr<const File> Load(const std::filesystem::path& relative_path) {
+    // Verify that the path exists within the doc root and is not a directory
+    auto err = std::error_code();
+    auto path = std::filesystem::canonical(doc_root_ / relative_path, err);
+    if (err || path.compare(doc_root_) < 0 ||
+          !std::equal(doc_root_.begin(), doc_root_.end(), path.begin())) {
+      return {};
+    }
+    {
+      const auto lock = std::shared_lock(mutex_);
+      if (const auto it = files_.find(path.string()); it != files_.end()) {
+        return it->second;
+      }
+    }
+    const auto status = std::filesystem::status(path, err);
+    if (err || status.type() == std::filesystem::file_type::directory) {
+      return {};
+    }
+    const auto size = std::filesystem::file_size(path, err);
+    if (err) {
+      return {};
+    }
+
+    auto file = std::make_shared<File>();
+    file->path = path;
+    const auto path_string = path.string();
+    file->content_type = GetMimeType(path_string);
+    file->last_modified =
+      FormatHttpDate(std::filesystem::last_write_time(path, err));
+    if (size <= max_file_size) {
+      if (!ReadFile(path, file->content)) {
+        return {};
+      }
+      file->cached = true;
+      file->etag = CreateEtag(file->content);
+      // Prefer compressed files that are already next to the original
+      ReadFile(path_string + ".br", file->brotli_content);
+      if (!ReadFile(path_string + ".gz", file->gzip_content)
+          && IsCompressible(file->content_type)) {
+        file->gzip_content = Gzip(file->content);
+      }
+      if (file->gzip_content.size() >= file->content.size()) {
+        file->gzip_content.clear();
+      }
+      if (file->brotli_content.size() >= file->content.size()) {
+        file->brotli_content.clear();
+      }
+    } else {
+      file->etag = '"' + std::to_string(size) + '-'
+                   + std::to_string(std::hash<std::string>()(file->last_modified))
+                   + '"';
+    }
+
+    const auto lock = std::unique_lock(mutex_);
+    return files_.emplace(path_string, std::move(file)).first->second;
+  }
+
+  static bool ReadFile(const std::filesystem::path& path, std::string& content) {
+    auto stream = std::ifstream(path, std::ios::binary);
+    if (!stream) {
+      return false;
+    }
+    content.assign(std::istreambuf_iterator<char>(stream),
+                   std::istreambuf_iterator<char>());
+    return !stream.bad();
+  }
+
+  static bool IsCompressible(std::string_view content_type) {
+    return content_type.substr(0, 5) == "text/"
+           || content_type == "application/javascript"
+           || content_type == "application/json"
+           || content_type == "application/xml"
+           || content_type == "application/wasm"
+           || content_type == "image/svg+xml";
+  }
+
+  static std::string Gzip(const std::string& content) {
+    auto stream = z_stream();
+    // Adding 16 to the window bits produces a gzip header
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      return {};
+    }
+    auto compressed = std::string(deflateBound(&stream, content.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(content.data()));
+    stream.avail_in = static_cast<uInt>(content.size());
+    stream.next_out = reinterpret_cast<Bytef*>(compressed.data());
+    stream.avail_out = static_cast<uInt>(compressed.size());
+    const auto result = deflate(&stream, Z_FINISH);
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END ? compressed : std::string();
+  }
+
+  // FNV-1a is good enough to tell versions of the same file apart
+  static std::string CreateEtag(const std::string& content) {
+    auto hash = std::uint64_t(0xcbf29ce484222325);
+    for (const auto c : content) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+    }
+    constexpr auto hex_digits = "0123456789abcdef";
+    auto etag = std::string(18, '"');
+    for (auto i = 16; i > 0; i--, hash >>= 4) {
+      etag[i] = hex_digits[hash & 0xF];
+    }
+    return etag;
+  }
+
+  static std::string FormatHttpDate(std::filesystem::file_time_type file_time) {
+    const auto system_time = std::chrono::time_point_cast<
+      std::chrono::system_clock::duration>(
+        file_time - std::filesystem::file_time_type::clock::now()
+        + std::chrono::system_clock::now());
+    const auto time = std::chrono::system_clock::to_time_t(system_time);
+    auto tm = std::tm();
+#ifdef _WIN32
+    gmtime_s(&tm, &time);
+#else
+    gmtime_r(&time, &tm);
+#endif
+    auto buffer = std::array<char, 32>();
+    const auto length = std::strftime(buffer.data(), buffer.size(),
+                                      "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buffer.data(), length);
+  }
+
+  // Checks if a coding is listed in an Accept-Encoding header without
+  // being disabled by a q-value of zero
+  static bool Accepts(std::string_view accept_encoding,
+                      std::string_view encoding) {
+    while (!accept_encoding.empty()) {
+      const auto comma = accept_encoding.find(',');
+      auto element = accept_encoding.substr(0, comma);
+      accept_encoding = comma == std::string_view::npos
+                          ? std::string_view()
+                          : accept_encoding.substr(comma + 1);
+      const auto semicolon = element.find(';');
+      auto coding = element.substr(0, semicolon);
+      while (!coding.empty() && coding.front() == ' ') {
+        coding.remove_prefix(1);
+      }
+      while (!coding.empty() && coding.back() == ' ') {
+        coding.remove_suffix(1);
+      }
+      if (!boost::beast::iequals(coding, encoding)) {
+        continue;
+      }
+      if (semicolon == std::string_view::npos) {
+        return true;
+      }
+      const auto params = element.substr(semicolon + 1);
+      const auto q = params.find("q=");
+      return q == std::string_view::npos
+             || std::strtod(std::string(params.substr(q + 2)).c_str(),
+                            nullptr) > 0;
+    }
+    return false;
+  }
+
+#ifdef __linux__
+  void WatchDirectory(const std::filesystem::path& path) {
+    inotify_add_watch(inotify_.native_handle(), path.c_str(),
+                      IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                      | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF
+                      | IN_MOVE_SELF | IN_ONLYDIR);
+  }
+
+  void ReadEvents() {
+    inotify_.async_read_some(
+      boost::asio::buffer(inotify_buffer_),
+      [this](const boost::system::error_code ec, std::size_t bytes_transferred) {
+        if (ec) {
+          return;
+        }
+        // Start watching new directories so files added to them
+        // also invalidate the cache
+        for (auto offset = std::size_t(0); offset < bytes_transferred;) {
+          const auto& event = *reinterpret_cast<const inotify_event*>(
+            inotify_buffer_.data() + offset);
+          if ((event.mask & (IN_CREATE | IN_MOVED_TO))
+              && (event.mask & IN_ISDIR)) {
+            WatchDirectories();
+          }
+          offset += sizeof(inotify_event) + event.len;
+        }
+        {
+          const auto lock = std::unique_lock(mutex_);
+          targets_.clear();
+          files_.clear();
+        }
+        ReadEvents();
+      });
+  }
+
+  // Watches the doc root and every directory below it. Adding a watch
+  // for a directory that is already watched has no effect.
+  void WatchDirectories() {
+    WatchDirectory(doc_root_);
+    auto ec = std::error_code();
+    for (auto it = std::filesystem::recursive_directory_iterator(doc_root_, ec);
+         !ec && it != std::filesystem::recursive_directory_iterator();
+         it.increment(ec)) {
+      if (it->is_directory(ec)) {
+        WatchDirectory(it->path());
+      }
+    }
+  }
+
+  boost::asio::posix::stream_descriptor inotify_;
+  alignas(inotify_event) std::array<char, 4096> inotify_buffer_;
+#endif
+
+  std::filesystem::path doc_root_;
+  boost::asio::thread_pool file_pool_{2};
+  std::shared_mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<const File>> targets_;
+  std::unordered_map<std::string, std::shared_ptr<const File>> files_;
+};
+
+}  // namespace CollabVm::Server
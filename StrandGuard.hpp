@@ -12,6 +12,11 @@ struct StrandGuard {
   explicit StrandGuard(boost::asio::io_context& io_context, decltype(ConstructWithStrand), TArgs&&... args)
       : strand_(io_context), obj_(strand_, std::forward<TArgs>(args)...) {}
 
+  // For strands that can't be created from an io_context
+  template <typename... TArgs>
+  explicit StrandGuard(const TStrand& strand, TArgs&&... args)
+      : strand_(strand), obj_(std::forward<TArgs>(args)...) {}
+
   template <typename TCompletionHandler>
   void dispatch(TCompletionHandler&& handler) {
     boost::asio::dispatch(strand_,
@@ -35,6 +40,10 @@ struct StrandGuard {
   bool running_in_this_thread() const {
     return strand_.running_in_this_thread();
   }
+
+  boost::asio::io_context& context() const {
+    return static_cast<boost::asio::io_context&>(strand_.context());
+  }
  private:
   TStrand strand_;
   T obj_;
@@ -0,0 +1,824 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <array>
+#include <cerrno>
+#include <climits>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "RegisteredBuffers.hpp"
+#ifndef _WIN32
+#include <csignal>
+#include <unistd.h>
+#endif
+
+namespace CollabVm::Server {
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+
+// Either a TCP or a Unix domain socket
+using StreamSocket = asio::generic::stream_protocol::socket;
+
+// Sets up the context shared by every TLS connection. The private key may
+// be in the same PEM file as the certificate chain.
+inline void ConfigureTlsContext(asio::ssl::context& context,
+                                const std::string& certificate_path,
+                                const std::string& private_key_path,
+                                boost::system::error_code& ec) {
+  context.set_options(asio::ssl::context::default_workarounds
+                      | asio::ssl::context::no_sslv2
+                      | asio::ssl::context::no_sslv3
+                      | asio::ssl::context::no_tlsv1
+                      | asio::ssl::context::no_tlsv1_1
+                      | asio::ssl::context::single_dh_use, ec);
+  if (ec) {
+    return;
+  }
+  context.use_certificate_chain_file(certificate_path, ec);
+  if (ec) {
+    return;
+  }
+  context.use_private_key_file(
+    private_key_path.empty() ? certificate_path : private_key_path,
+    asio::ssl::context::pem, ec);
+  if (ec) {
+    return;
+  }
+  const auto ssl_ctx = context.native_handle();
+  // Idle connections give their read and write buffers back
+  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+                            | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                            | SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // Report a missing close_notify as a normal EOF like a TCP socket would
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+  // Resumed handshakes skip the certificate and key exchange, which keeps
+  // reconnect storms after a restart or network blip cheap. TLS 1.2 clients
+  // can use either the session cache or tickets, TLS 1.3 clients use tickets.
+  // The ticket keys are generated randomly for the lifetime of the process
+  // and shared by every listener.
+  constexpr static unsigned char session_id_context[] = "collab-vm-server";
+  SSL_CTX_set_session_id_context(ssl_ctx, session_id_context,
+                                 sizeof(session_id_context) - 1);
+  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ssl_ctx, 20'000);
+  SSL_CTX_set_timeout(ssl_ctx, 60 * 60);
+  SSL_CTX_clear_options(ssl_ctx, SSL_OP_NO_TICKET);
+#ifdef TLS1_3_VERSION
+  // A single ticket is enough to resume the next connection
+  SSL_CTX_set_num_tickets(ssl_ctx, 1);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+  // Let the kernel encrypt records when it supports the negotiated cipher
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+#ifndef _WIN32
+  // OpenSSL writes to the socket with write() instead of send() with
+  // MSG_NOSIGNAL, which would kill the process if the peer reset the
+  // connection
+  std::signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+// A stream socket that is optionally encrypted with TLS.
+// Unlike asio::ssl::stream, OpenSSL reads and writes the socket directly
+// instead of going through memory BIOs. This lets OpenSSL hand encryption
+// off to the kernel (kTLS) after the handshake, so writes skip a copy
+// through a userspace encryption buffer and files can still be sent with
+// sendfile().
+class TlsStream {
+ public:
+  using executor_type = StreamSocket::executor_type;
+  using lowest_layer_type = StreamSocket::lowest_layer_type;
+
+  explicit TlsStream(StreamSocket& socket) : socket_(socket), ungated_{*this} {}
+  TlsStream(const TlsStream&) = delete;
+
+  executor_type get_executor() noexcept {
+    return socket_.get_executor();
+  }
+
+  lowest_layer_type& lowest_layer() {
+    return socket_.lowest_layer();
+  }
+
+  // Encrypts the connection, must be called after the socket is accepted
+  // and before anything is read or written
+  void EnableTls(SSL_CTX* context, boost::system::error_code& ec) {
+    ssl_.reset(SSL_new(context));
+    if (!ssl_ || !SSL_set_fd(ssl_.get(),
+                             static_cast<int>(socket_.native_handle()))) {
+      ec = boost::system::error_code(static_cast<int>(ERR_get_error()),
+                                     asio::error::get_ssl_category());
+      ssl_.reset();
+      return;
+    }
+    SSL_set_accept_state(ssl_.get());
+    // Readiness is waited for with the socket's reactor
+    socket_.non_blocking(true, ec);
+  }
+
+  bool IsTls() const {
+    return !!ssl_;
+  }
+
+  bool IsKernelTlsSendEnabled() const {
+#ifdef BIO_get_ktls_send
+    return ssl_ && BIO_get_ktls_send(SSL_get_wbio(ssl_.get()));
+#else
+    return false;
+#endif
+  }
+
+  // Whether the socket's descriptor can be written to directly, for
+  // example with sendfile()
+  bool CanWriteDirectly() const {
+    return !ssl_ || IsKernelTlsSendEnabled();
+  }
+
+  // Must be held while the descriptor is written to directly. With kernel
+  // TLS, SSL_read() can still write records of its own, such as alerts and
+  // KeyUpdate responses, which would otherwise be interleaved with the
+  // write.
+  std::unique_lock<std::mutex> LockDescriptor() {
+    return std::unique_lock(mutex_);
+  }
+
+  // Moves the socket's descriptor to a socket on another io_context. The
+  // SSL object keeps using the same descriptor. Nothing can be reading or
+  // writing the stream while it's moved.
+  void MoveTo(asio::io_context& io_context, boost::system::error_code& ec) {
+    auto lock = std::lock_guard(mutex_);
+    const auto protocol = socket_.local_endpoint(ec).protocol();
+    if (ec) {
+      return;
+    }
+    const auto descriptor = socket_.release(ec);
+    if (ec) {
+      return;
+    }
+    socket_ = StreamSocket(io_context);
+    socket_.assign(protocol, descriptor, ec);
+    if (ec) {
+#ifdef _WIN32
+      ::closesocket(descriptor);
+#else
+      ::close(descriptor);
+#endif
+      return;
+    }
+    if (ssl_) {
+      socket_.non_blocking(true, ec);
+    }
+  }
+
+  void Close(boost::system::error_code& ec,
+             StreamSocket::shutdown_type what = StreamSocket::shutdown_both) {
+    // Waits for any SSL call or direct write that is using the descriptor
+    auto lock = std::unique_lock(mutex_);
+    socket_.shutdown(what, ec);
+    socket_.close(ec);
+    // A read that was waiting for a write fails now that the socket is closed
+    auto resume_read = std::move(waiting_read_);
+    waiting_read_ = nullptr;
+    lock.unlock();
+    if (resume_read) {
+      resume_read();
+    }
+  }
+
+  template<typename HandshakeHandler>
+  BOOST_ASIO_INITFN_RESULT_TYPE(HandshakeHandler,
+                                void(boost::system::error_code))
+  async_handshake(HandshakeHandler&& handler) {
+    return Initiate<void(boost::system::error_code), false>(
+      [](SSL* ssl, std::size_t&) { return SSL_do_handshake(ssl); },
+      std::forward<HandshakeHandler>(handler));
+  }
+
+  // Sends a close_notify alert without waiting for the peer's
+  template<typename ShutdownHandler>
+  BOOST_ASIO_INITFN_RESULT_TYPE(ShutdownHandler,
+                                void(boost::system::error_code))
+  async_shutdown(ShutdownHandler&& handler) {
+    return Initiate<void(boost::system::error_code), false>(
+      &TlsStream::Shutdown, std::forward<ShutdownHandler>(handler));
+  }
+
+  void shutdown(boost::system::error_code& ec) {
+    auto bytes_transferred = std::size_t();
+    Run(&TlsStream::Shutdown, bytes_transferred, ec);
+  }
+
+  template<typename MutableBufferSequence, typename ReadHandler>
+  BOOST_ASIO_INITFN_RESULT_TYPE(ReadHandler,
+                                void(boost::system::error_code, std::size_t))
+  async_read_some(const MutableBufferSequence& buffers,
+                  ReadHandler&& handler) {
+    if (!ssl_) {
+      return socket_.async_read_some(buffers,
+                                     std::forward<ReadHandler>(handler));
+    }
+    return Initiate<void(boost::system::error_code, std::size_t), true>(
+      ReadOperation<MutableBufferSequence>{buffers},
+      std::forward<ReadHandler>(handler));
+  }
+
+  // Waits for the frame being written by async_write_frame(), if any
+  template<typename ConstBufferSequence, typename WriteHandler>
+  BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler,
+                                void(boost::system::error_code, std::size_t))
+  async_write_some(const ConstBufferSequence& buffers,
+                   WriteHandler&& handler) {
+    asio::async_completion<WriteHandler,
+                           void(boost::system::error_code, std::size_t)>
+      init(handler);
+    StartWrite(buffers, std::move(init.completion_handler));
+    return init.result.get();
+  }
+
+  // Writes a WebSocket frame that was built without the websocket::stream,
+  // such as one that is shared by every connection a message is sent to.
+  // The frame waits for the websocket::stream's writes (pongs and close
+  // frames) to finish, and they wait for the frame, so frames are never
+  // interleaved. can_write is called right before the frame is started,
+  // and the write fails with websocket::error::closed if it returns false.
+  // Must be called from the strand that the websocket::stream is used from,
+  // one frame at a time.
+  template<typename ConstBufferSequence, typename WriteHandler,
+           typename Predicate>
+  void async_write_frame(const ConstBufferSequence& buffers,
+                         WriteHandler&& handler,
+                         Predicate can_write) {
+    if (pending_writes_ || writing_frame_) {
+      auto shared_handler = std::make_shared<std::decay_t<WriteHandler>>(
+        std::forward<WriteHandler>(handler));
+      waiting_writes_.emplace_back([this, buffers, shared_handler, can_write] {
+        async_write_frame(buffers, std::move(*shared_handler), can_write);
+      });
+      return;
+    }
+    if (!can_write()) {
+      auto executor =
+        asio::get_associated_executor(handler, get_executor());
+      asio::post(executor, beast::bind_handler(
+        std::forward<WriteHandler>(handler),
+        boost::system::error_code(beast::websocket::error::closed),
+        std::size_t(0)));
+      return;
+    }
+    writing_frame_ = true;
+#ifdef COLLAB_VM_HAS_REGISTERED_BUFFERS
+    // A frame in registered memory is written with a fixed-buffer write
+    if (!ssl_) {
+      if (const auto registered = RegisteredBuffers::Find(
+            asio::query(get_executor(), asio::execution::context), buffers)) {
+        asio::async_write(ungated_, *registered,
+          GatedHandler<std::decay_t<WriteHandler>>(
+            *this, std::forward<WriteHandler>(handler), true));
+        return;
+      }
+    }
+#endif
+    asio::async_write(ungated_, buffers,
+      GatedHandler<std::decay_t<WriteHandler>>(
+        *this, std::forward<WriteHandler>(handler), true));
+  }
+
+  template<typename MutableBufferSequence>
+  std::size_t read_some(const MutableBufferSequence& buffers,
+                        boost::system::error_code& ec) {
+    if (!ssl_) {
+      return socket_.read_some(buffers, ec);
+    }
+    auto bytes_transferred = std::size_t();
+    Run(ReadOperation<MutableBufferSequence>{buffers}, bytes_transferred, ec);
+    return bytes_transferred;
+  }
+
+  template<typename MutableBufferSequence>
+  std::size_t read_some(const MutableBufferSequence& buffers) {
+    auto ec = boost::system::error_code();
+    const auto bytes_transferred = read_some(buffers, ec);
+    if (ec) {
+      throw boost::system::system_error(ec);
+    }
+    return bytes_transferred;
+  }
+
+  template<typename ConstBufferSequence>
+  std::size_t write_some(const ConstBufferSequence& buffers,
+                         boost::system::error_code& ec) {
+    if (!ssl_) {
+      return socket_.write_some(buffers, ec);
+    }
+    auto bytes_transferred = std::size_t();
+    if (IsKernelTlsSendEnabled()) {
+      Run(DirectWriteOperation<ConstBufferSequence>{buffers},
+          bytes_transferred, ec);
+      return bytes_transferred;
+    }
+    Run(WriteOperation<ConstBufferSequence>{buffers}, bytes_transferred, ec);
+    return bytes_transferred;
+  }
+
+  template<typename ConstBufferSequence>
+  std::size_t write_some(const ConstBufferSequence& buffers) {
+    auto ec = boost::system::error_code();
+    const auto bytes_transferred = write_some(buffers, ec);
+    if (ec) {
+      throw boost::system::system_error(ec);
+    }
+    return bytes_transferred;
+  }
+
+ private:
+  // kPendingWrite means SSL_write() is waiting to finish a record
+  enum class Want { kNothing, kRead, kWrite, kPendingWrite };
+
+  // The largest amount of plaintext that fits in a single TLS record
+  constexpr static auto max_record_size = std::size_t(16 * 1024);
+
+  template<typename TBuffer, typename TBufferSequence>
+  static TBuffer FirstBuffer(const TBufferSequence& buffers) {
+    const auto end = asio::buffer_sequence_end(buffers);
+    for (auto it = asio::buffer_sequence_begin(buffers); it != end; ++it) {
+      if (const auto buffer = TBuffer(*it); buffer.size()) {
+        return buffer;
+      }
+    }
+    return TBuffer();
+  }
+
+  template<typename MutableBufferSequence>
+  struct ReadOperation {
+    int operator()(SSL* ssl, std::size_t& bytes_transferred) const {
+      const auto buffer = FirstBuffer<asio::mutable_buffer>(buffers);
+      if (!buffer.size()) {
+        return 1;
+      }
+      const auto result = SSL_read(
+        ssl, buffer.data(),
+        static_cast<int>(std::min<std::size_t>(buffer.size(), INT_MAX)));
+      bytes_transferred = result > 0 ? result : 0;
+      return result;
+    }
+
+    MutableBufferSequence buffers;
+  };
+
+  template<typename ConstBufferSequence>
+  struct WriteOperation {
+    int operator()(SSL* ssl, std::size_t& bytes_transferred) const {
+      auto buffer = FirstBuffer<asio::const_buffer>(buffers);
+      if (!buffer.size()) {
+        return 1;
+      }
+      // Small buffers such as WebSocket frame headers are combined with
+      // the ones after them so they don't get a record of their own.
+      // This is only used for userspace TLS, see AsyncWriteSome().
+      // A retried write copies the same bytes again, which OpenSSL allows
+      // because of SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER.
+      thread_local auto record = std::array<char, max_record_size>();
+      if (buffer.size() < record.size()
+          && asio::buffer_size(buffers) > buffer.size()) {
+        buffer = asio::const_buffer(
+          record.data(), asio::buffer_copy(asio::buffer(record), buffers));
+      }
+      const auto result = SSL_write(
+        ssl, buffer.data(),
+        static_cast<int>(std::min<std::size_t>(buffer.size(), INT_MAX)));
+      bytes_transferred = result > 0 ? result : 0;
+      return result;
+    }
+
+    ConstBufferSequence buffers;
+  };
+
+  template<typename TOperation>
+  struct IsReadOperation : std::false_type {};
+
+  template<typename MutableBufferSequence>
+  struct IsReadOperation<ReadOperation<MutableBufferSequence>>
+    : std::true_type {};
+
+  template<typename TOperation>
+  struct IsWriteOperation : std::false_type {};
+
+  template<typename ConstBufferSequence>
+  struct IsWriteOperation<WriteOperation<ConstBufferSequence>>
+    : std::true_type {};
+
+  // Writes to the descriptor without OpenSSL, used with kernel TLS
+  template<typename ConstBufferSequence>
+  struct DirectWriteOperation {
+    ConstBufferSequence buffers;
+  };
+
+  template<typename ConstBufferSequence, typename WriteHandler>
+  auto AsyncWriteSome(const ConstBufferSequence& buffers,
+                      WriteHandler&& handler) {
+    if (!ssl_) {
+      return socket_.async_write_some(buffers,
+                                      std::forward<WriteHandler>(handler));
+    }
+    // With kernel TLS the kernel builds the records, so the buffers are
+    // written with one writev() instead of being copied into a record
+    if (IsKernelTlsSendEnabled()) {
+      return Initiate<void(boost::system::error_code, std::size_t), true>(
+        DirectWriteOperation<ConstBufferSequence>{buffers},
+        std::forward<WriteHandler>(handler));
+    }
+    return Initiate<void(boost::system::error_code, std::size_t), true>(
+      WriteOperation<ConstBufferSequence>{buffers},
+      std::forward<WriteHandler>(handler));
+  }
+
+  // Lets asio::async_write() write a frame without going through the
+  // gate in async_write_some()
+  struct UngatedStream {
+    using executor_type = TlsStream::executor_type;
+    executor_type get_executor() noexcept {
+      return stream.get_executor();
+    }
+
+    template<typename ConstBufferSequence, typename WriteHandler>
+    auto async_write_some(const ConstBufferSequence& buffers,
+                          WriteHandler&& handler) {
+      return stream.AsyncWriteSome(buffers,
+                                   std::forward<WriteHandler>(handler));
+    }
+
+    TlsStream& stream;
+  };
+
+  template<typename ConstBufferSequence, typename WriteHandler>
+  void StartWrite(const ConstBufferSequence& buffers,
+                  WriteHandler&& handler) {
+    if (writing_frame_) {
+      auto shared_handler = std::make_shared<std::decay_t<WriteHandler>>(
+        std::forward<WriteHandler>(handler));
+      waiting_writes_.emplace_back([this, buffers, shared_handler] {
+        StartWrite(buffers, std::move(*shared_handler));
+      });
+      return;
+    }
+    pending_writes_++;
+    AsyncWriteSome(buffers,
+      GatedHandler<std::decay_t<WriteHandler>>(
+        *this, std::forward<WriteHandler>(handler), false));
+  }
+
+  void ResumeWaitingWrites() {
+    auto waiting_writes = std::move(waiting_writes_);
+    waiting_writes_.clear();
+    for (auto& write : waiting_writes) {
+      write();
+    }
+  }
+
+  // Completes a write that other writes may be waiting for
+  template<typename THandler>
+  class GatedHandler {
+   public:
+    GatedHandler(TlsStream& stream, THandler&& handler, bool frame)
+        : stream_(stream), handler_(std::move(handler)), frame_(frame) {}
+
+    using executor_type =
+      asio::associated_executor_t<THandler, TlsStream::executor_type>;
+    executor_type get_executor() const noexcept {
+      return asio::get_associated_executor(handler_, stream_.get_executor());
+    }
+
+    using allocator_type = asio::associated_allocator_t<THandler>;
+    allocator_type get_allocator() const noexcept {
+      return asio::get_associated_allocator(handler_);
+    }
+
+    void operator()(boost::system::error_code ec,
+                    std::size_t bytes_transferred) {
+      auto& stream = stream_;
+      if (frame_) {
+        stream.writing_frame_ = false;
+        stream.ResumeWaitingWrites();
+        handler_(ec, bytes_transferred);
+        return;
+      }
+      stream.pending_writes_--;
+      // The handler continues a websocket::stream operation, which
+      // starts its next write before returning if it has one
+      handler_(ec, bytes_transferred);
+      if (!stream.pending_writes_) {
+        stream.ResumeWaitingWrites();
+      }
+    }
+
+    template<typename Function>
+    friend void asio_handler_invoke(Function&& function,
+                                    GatedHandler* handler) {
+      using boost::asio::asio_handler_invoke;
+      asio_handler_invoke(function, std::addressof(handler->handler_));
+    }
+
+    friend bool asio_handler_is_continuation(GatedHandler* handler) {
+      using boost::asio::asio_handler_is_continuation;
+      return asio_handler_is_continuation(std::addressof(handler->handler_));
+    }
+
+   private:
+    TlsStream& stream_;
+    THandler handler_;
+    bool frame_;
+  };
+
+  static int Shutdown(SSL* ssl, std::size_t&) {
+    const auto result = SSL_shutdown(ssl);
+    // Zero means the alert was sent but the peer's hasn't been received
+    return result == 0 ? 1 : result;
+  }
+
+  template<typename TOperation>
+  Want Perform(TOperation& operation,
+               std::size_t& bytes_transferred,
+               boost::system::error_code& ec) {
+    // Reads and writes may be started from different strands,
+    // but an SSL object can only be used by one thread at a time
+    auto lock = std::unique_lock(mutex_);
+    if (!socket_.is_open()) {
+      ec = asio::error::bad_descriptor;
+      return Want::kNothing;
+    }
+    if constexpr (IsReadOperation<std::decay_t<TOperation>>::value) {
+      // SSL_read() can write records of its own, such as KeyUpdate
+      // responses, and OpenSSL fails if it does while SSL_write() is
+      // waiting to finish a record
+      if (write_pending_) {
+        return Want::kPendingWrite;
+      }
+    }
+    ERR_clear_error();
+    errno = 0;
+    const auto result = operation(ssl_.get(), bytes_transferred);
+    const auto want = GetWant(result, errno, ec);
+    if constexpr (IsWriteOperation<std::decay_t<TOperation>>::value) {
+      write_pending_ = want != Want::kNothing;
+      if (!write_pending_ && waiting_read_) {
+        auto resume_read = std::move(waiting_read_);
+        waiting_read_ = nullptr;
+        lock.unlock();
+        resume_read();
+      }
+    }
+    return want;
+  }
+
+  Want GetWant(int result, int system_error, boost::system::error_code& ec) {
+    if (result > 0) {
+      return Want::kNothing;
+    }
+    switch (SSL_get_error(ssl_.get(), result)) {
+      case SSL_ERROR_WANT_READ:
+        return Want::kRead;
+      case SSL_ERROR_WANT_WRITE:
+        return Want::kWrite;
+      case SSL_ERROR_ZERO_RETURN:
+        ec = asio::error::eof;
+        break;
+      case SSL_ERROR_SYSCALL:
+        if (system_error) {
+          ec = boost::system::error_code(system_error,
+                                         asio::error::get_system_category());
+        } else {
+          ec = asio::error::eof;
+        }
+        break;
+      default:
+        ec = boost::system::error_code(static_cast<int>(ERR_get_error()),
+                                       asio::error::get_ssl_category());
+        break;
+    }
+    return Want::kNothing;
+  }
+
+  // Parks a read until the write that OpenSSL is waiting to finish is done
+  template<typename TOperation>
+  void WaitForPendingWrite(TOperation&& operation) {
+    auto shared_operation =
+      std::make_shared<std::decay_t<TOperation>>(std::move(operation));
+    auto resume_read = [shared_operation] {
+      auto executor = shared_operation->get_executor();
+      asio::post(executor, [shared_operation] { (*shared_operation)({}); });
+    };
+    auto lock = std::unique_lock(mutex_);
+    if (write_pending_ && socket_.is_open()) {
+      waiting_read_ = std::move(resume_read);
+      return;
+    }
+    lock.unlock();
+    resume_read();
+  }
+
+  // Still takes the lock because SSL_read() can write to the descriptor
+  template<typename ConstBufferSequence>
+  Want Perform(DirectWriteOperation<ConstBufferSequence>& operation,
+               std::size_t& bytes_transferred,
+               boost::system::error_code& ec) {
+    auto lock = std::lock_guard(mutex_);
+    if (!socket_.is_open()) {
+      ec = asio::error::bad_descriptor;
+      return Want::kNothing;
+    }
+    // The socket is non-blocking, so this never waits with the lock held
+    bytes_transferred = socket_.write_some(operation.buffers, ec);
+    if (ec == asio::error::would_block || ec == asio::error::try_again) {
+      ec = {};
+      return Want::kWrite;
+    }
+    return Want::kNothing;
+  }
+
+  template<typename TOperation>
+  void Run(TOperation&& operation,
+           std::size_t& bytes_transferred,
+           boost::system::error_code& ec) {
+    for (;;) {
+      const auto want = Perform(operation, bytes_transferred, ec);
+      if (want == Want::kNothing) {
+        return;
+      }
+      socket_.wait(want == Want::kRead
+                     ? StreamSocket::wait_read
+                     : StreamSocket::wait_write, ec);
+      if (ec) {
+        return;
+      }
+    }
+  }
+
+  // Retries an SSL call each time the socket becomes ready until it
+  // succeeds or fails. Intermediate waits use the handler's executor.
+  template<typename TOperation, typename THandler, bool TransfersBytes>
+  class Operation {
+   public:
+    Operation(TlsStream& stream, TOperation&& operation, THandler&& handler)
+        : stream_(stream),
+          operation_(std::move(operation)),
+          handler_(std::move(handler)) {}
+
+    using executor_type =
+      asio::associated_executor_t<THandler, TlsStream::executor_type>;
+    executor_type get_executor() const noexcept {
+      return asio::get_associated_executor(handler_, stream_.get_executor());
+    }
+
+    using allocator_type = asio::associated_allocator_t<THandler>;
+    allocator_type get_allocator() const noexcept {
+      return asio::get_associated_allocator(handler_);
+    }
+
+    void operator()(boost::system::error_code ec, bool continuation = true) {
+      auto bytes_transferred = std::size_t(0);
+      if (!ec) {
+        const auto want = stream_.Perform(operation_, bytes_transferred, ec);
+        if (want == Want::kPendingWrite) {
+          stream_.WaitForPendingWrite(std::move(*this));
+          return;
+        }
+        if (want != Want::kNothing) {
+          stream_.socket_.async_wait(
+            want == Want::kRead ? StreamSocket::wait_read
+                                : StreamSocket::wait_write,
+            std::move(*this));
+          return;
+        }
+      }
+      if (continuation) {
+        Complete(ec, bytes_transferred);
+        return;
+      }
+      // The handler must not be invoked from the initiating function
+      auto executor = stream_.get_executor();
+      asio::post(executor, beast::bind_handler(std::move(*this), ec,
+                                               bytes_transferred, true));
+    }
+
+    void operator()(boost::system::error_code ec,
+                    std::size_t bytes_transferred,
+                    bool) {
+      Complete(ec, bytes_transferred);
+    }
+
+    template<typename Function>
+    friend void asio_handler_invoke(Function&& function,
+                                    Operation* operation) {
+      using boost::asio::asio_handler_invoke;
+      asio_handler_invoke(function, std::addressof(operation->handler_));
+    }
+
+    friend bool asio_handler_is_continuation(Operation*) {
+      return true;
+    }
+
+   private:
+    void Complete(boost::system::error_code ec,
+                  std::size_t bytes_transferred) {
+      if constexpr (TransfersBytes) {
+        handler_(ec, bytes_transferred);
+      } else {
+        handler_(ec);
+      }
+    }
+
+    TlsStream& stream_;
+    TOperation operation_;
+    THandler handler_;
+  };
+
+  template<typename Signature, bool TransfersBytes,
+           typename TOperation, typename THandler>
+  auto Initiate(TOperation&& operation, THandler&& handler) {
+    asio::async_completion<THandler, Signature> init(handler);
+    Operation<std::decay_t<TOperation>,
+              typename decltype(init)::completion_handler_type,
+              TransfersBytes>(
+      *this, std::forward<TOperation>(operation),
+      std::move(init.completion_handler))({}, false);
+    return init.result.get();
+  }
+
+  struct SslDeleter {
+    void operator()(SSL* ssl) const {
+      SSL_free(ssl);
+    }
+  };
+
+  StreamSocket& socket_;
+  std::unique_ptr<SSL, SslDeleter> ssl_;
+  std::mutex mutex_;
+  // Guarded by mutex_
+  bool write_pending_ = false;
+  std::function<void()> waiting_read_;
+  UngatedStream ungated_;
+  // Only used from the websocket::stream's strand
+  std::size_t pending_writes_ = 0;
+  bool writing_frame_ = false;
+  std::vector<std::function<void()>> waiting_writes_;
+};
+
+// Used by newer versions of Beast to close the connection after a timeout
+inline void beast_close_socket(TlsStream& stream) {
+  auto ec = boost::system::error_code();
+  stream.Close(ec);
+}
+
+namespace TlsStreamDetail {
+// Newer versions of Beast moved role_type out of the websocket namespace
+using namespace boost::beast;
+using namespace boost::beast::websocket;
+using RoleType = role_type;
+}  // namespace TlsStreamDetail
+
+// Called by websocket::stream when the connection is closed.
+// Beast only knows how to tear down TCP sockets, so the generic socket is
+// shut down here instead of waiting for the peer to close it too.
+inline void teardown(TlsStreamDetail::RoleType,
+                     TlsStream& stream,
+                     boost::system::error_code& ec) {
+  if (stream.IsTls()) {
+    stream.shutdown(ec);
+  }
+  stream.Close(ec, StreamSocket::shutdown_send);
+}
+
+template<typename TeardownHandler>
+void async_teardown(TlsStreamDetail::RoleType role,
+                    TlsStream& stream,
+                    TeardownHandler&& handler) {
+  auto executor = asio::get_associated_executor(handler,
+                                                stream.get_executor());
+  auto close_socket = [&stream, handler = std::forward<TeardownHandler>(handler)](
+      const boost::system::error_code) mutable {
+    auto ec = boost::system::error_code();
+    stream.Close(ec, StreamSocket::shutdown_send);
+    asio::post(stream.get_executor(),
+               beast::bind_handler(std::move(handler), ec));
+  };
+  if (!stream.IsTls()) {
+    close_socket({});
+    return;
+  }
+  // The connection is closed even if the alert couldn't be sent
+  stream.async_shutdown(asio::bind_executor(executor, std::move(close_socket)));
+}
+}  // namespace CollabVm::Server
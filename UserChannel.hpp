@@ -5,7 +5,9 @@ template<typename TClient,
          typename TBase = std::nullptr_t>
 struct UserChannel
 {
-  explicit UserChannel(const std::uint32_t id) :
+  template<typename TExecutionContext>
+  UserChannel(TExecutionContext& context, const std::uint32_t id) :
+    user_list_timer_(context),
     chat_room_(id)
   {
   }
@@ -13,6 +15,16 @@ struct UserChannel
   void Clear()
   {
     users_.clear();
+    user_list_ = {};
+    admin_user_list_ = {};
+    pending_user_list_changes_.Take();
+    user_list_timer_.cancel();
+    user_list_flush_scheduled_ = false;
+  }
+
+  void SetUserListBatching(const UserListBatchOptions& options)
+  {
+    user_list_batching_ = options;
   }
 
   const auto& GetChatRoom() const
@@ -32,30 +44,31 @@ struct UserChannel
 
   template<typename TCallback>
   void ForEachUser(TCallback&& callback) {
-    std::for_each(
-      users_.begin(),
-      users_.end(),
+    users_.ForEach(
       [callback=std::forward<TCallback>(callback)]
-      (auto& user) mutable {
-        callback(user.second, *user.first);
+      (auto& user_data, auto& user) mutable {
+        callback(user_data, *user);
       });
   }
 
   void AddUser(const TUserData& user_data, std::shared_ptr<TClient> user)
   {
     OnAddUser(user);
-    users_.emplace(user, user_data);
-    admins_count_ += !!(user_data.user_type == CollabVmServerMessage::UserType::ADMIN);
-    user->QueueMessage(
-      user_data.IsAdmin()
-      ? CreateAdminUserListMessage()
-      : CreateUserListMessage());
-
-    if (users_.size() <= 1) {
-      return;
+    auto& user_list = user_data.IsAdmin() ? admin_user_list_ : user_list_;
+    if (!user_list.message || pending_user_list_changes_.Contains(user)) {
+      // The new user's list has to match what the others have been sent
+      FlushUserListChanges();
     }
+    if (!user_list.message) {
+      user_list.message = user_data.IsAdmin()
+        ? CreateAdminUserListMessage()
+        : CreateUserListMessage();
+      user_list.message->CreateFrame();
+    }
+    users_.Insert(user, user_data);
 
-    auto user_message = SocketMessage::CreateShared();
+    auto user_message = SocketMessage::CreateShared(
+      CollabVmServerMessage::Message::USER_LIST_ADD);
     auto add_user = user_message->GetMessageBuilder()
       .initRoot<CollabVmServerMessage>()
       .initMessage()
@@ -63,24 +76,33 @@ struct UserChannel
     add_user.setChannel(GetId());
     AddUserToList(user_data, add_user);
 
-    auto admin_user_message = SocketMessage::CreateShared();
+    auto admin_user_message = SocketMessage::CreateShared(
+      CollabVmServerMessage::Message::ADMIN_USER_LIST_ADD);
     auto add_admin_user = admin_user_message->GetMessageBuilder()
       .initRoot<CollabVmServerMessage>()
       .initMessage()
       .initAdminUserListAdd();
     add_admin_user.setChannel(GetId());
     AddUserToList(user_data, add_admin_user.initUser());
+    user_message->CreateFrame();
+    admin_user_message->CreateFrame();
 
-    ForEachUser([excluded_user = user.get(), user_message=std::move(user_message),
-                 admin_user_message=std::move(admin_user_message)]
-      (const auto& user_data, auto& user)
+    // The list doesn't have the new user yet, so it's followed by the
+    // changes made since it was created and then the user's own join
+    user->QueueMessageBatch(
+      [message = user_list.message, changes = user_list.changes,
+       join_message = std::shared_ptr<SocketMessage>(
+         user_data.IsAdmin() ? admin_user_message : user_message)]
+      (auto queue_message) mutable
       {
-        if (&user == excluded_user) {
-          return;
-        }
-        user.QueueMessage(
-          user_data.IsAdmin() ? admin_user_message : user_message);
+        queue_message(std::move(message));
+        std::for_each(changes.begin(), changes.end(), queue_message);
+        queue_message(std::move(join_message));
       });
+
+    pending_user_list_changes_.Add(
+      std::move(user), std::move(user_message), std::move(admin_user_message));
+    ScheduleUserListFlush();
   }
 
   void OnAddUser(std::shared_ptr<TClient> user) {
@@ -104,10 +126,17 @@ struct UserChannel
   }
 
   void BroadcastMessage(std::shared_ptr<SocketMessage>&& message) {
-    ForEachUser(
+    // Framed here so other event loops don't all frame it at once
+    message->CreateFrame();
+    auto fan_out = FanOut<TClient>();
+    for (const auto& [user, user_data] : users_)
+    {
+      fan_out.Add(user);
+    }
+    fan_out.Post(
       [message =
         std::forward<std::shared_ptr<SocketMessage>>(message)]
-      (const auto&, auto& user)
+      (auto& user)
       {
         user.QueueMessage(message);
       });
@@ -125,12 +154,10 @@ struct UserChannel
 
   void RemoveUser(std::shared_ptr<TClient> user)
   {
-    auto user_it = users_.find(user);
-    if (user_it == users_.end()) {
+    const auto user_data = users_.Find(user);
+    if (!user_data) {
       return;
     }
-    const auto& user_data = user_it->second;
-    admins_count_ -= !!(user_data.user_type == CollabVmServerMessage::UserType::ADMIN);
 
     auto message = SocketMessage::CreateShared();
     auto user_list_remove = message->GetMessageBuilder()
@@ -138,12 +165,50 @@ struct UserChannel
       .initMessage()
       .initUserListRemove();
     user_list_remove.setChannel(GetId());
-    user_list_remove.setUsername(user_data.username);
+    user_list_remove.setUsername(user_data->username);
 
     OnRemoveUser(user);
-    users_.erase(user_it);
+    users_.Erase(user);
+
+    message->CreateFrame();
+    pending_user_list_changes_.Remove(user, std::move(message));
+    ScheduleUserListFlush();
+  }
 
-    BroadcastMessage(std::move(message));
+  void ChangeUsername(std::shared_ptr<TClient> user,
+                      std::string new_username,
+                      CollabVmServerMessage::UserType user_type)
+  {
+    auto old_username = std::string();
+    auto user_type_changed = false;
+    if (!users_.Update(user, [&](auto& user_data)
+        {
+          old_username = std::exchange(user_data.username, new_username);
+          user_type_changed =
+            std::exchange(user_data.user_type, user_type) != user_type;
+        }))
+    {
+      return;
+    }
+    auto message = SocketMessage::CreateShared(
+      CollabVmServerMessage::Message::CHANGE_USERNAME);
+    auto username_change = message->GetMessageBuilder()
+                                  .initRoot<CollabVmServerMessage>()
+                                  .initMessage()
+                                  .initChangeUsername();
+    username_change.setOldUsername(old_username);
+    username_change.setNewUsername(new_username);
+
+    if (user_type_changed) {
+      // The message doesn't include the user type, so the cached lists
+      // have to be recreated
+      user_list_ = {};
+      admin_user_list_ = {};
+    }
+
+    message->CreateFrame();
+    pending_user_list_changes_.Rename(user, std::move(message));
+    ScheduleUserListFlush();
   }
 
   void OnRemoveUser(std::shared_ptr<TClient> user) {
@@ -165,11 +230,10 @@ private:
       std::remove_const_t<TUserChannel>, UserChannel>);
     using UserData = std::conditional_t<
       std::is_const_v<TUserChannel>, const TUserData, TUserData>;
-    auto& users_ = user_channel.users_;
-    auto user = users_.find(user_ptr);
-    return user == users_.end()
-      ? std::optional<std::reference_wrapper<UserData>>()
-      : std::optional<std::reference_wrapper<UserData>>(user->second);
+    const auto user = user_channel.users_.Find(user_ptr);
+    return user
+      ? std::optional<std::reference_wrapper<UserData>>(*user)
+      : std::optional<std::reference_wrapper<UserData>>();
   }
 
   template<typename TInitFunction>
@@ -190,6 +254,106 @@ private:
     return message;
   }
 
+  /**
+   * A user list message that is shared by every user who joins, followed by
+   * the changes that have been made since it was created. It's only
+   * recreated once there are enough changes, so a lot of users joining at
+   * once don't each cost a new list.
+   */
+  struct CachedUserList
+  {
+    std::shared_ptr<SocketMessage> message;
+    std::vector<std::shared_ptr<SocketMessage>> changes;
+  };
+
+  void AddUserListChange(const std::shared_ptr<SocketMessage>& user_message,
+                         const std::shared_ptr<SocketMessage>& admin_message)
+  {
+    const auto max_changes = std::max<std::size_t>(16, users_.size() / 4);
+    const auto add_change = [max_changes](auto& user_list, const auto& message)
+    {
+      if (!user_list.message) {
+        return;
+      }
+      if (user_list.changes.size() >= max_changes) {
+        user_list = {};
+        return;
+      }
+      user_list.changes.push_back(message);
+    };
+    add_change(user_list_, user_message);
+    add_change(admin_user_list_, admin_message);
+  }
+
+  // Sends the changes right away in small channels, otherwise waits for
+  // the batching window to collect more of them
+  void ScheduleUserListFlush()
+  {
+    if (!user_list_batching_.window.count()
+        || users_.size() < user_list_batching_.min_users)
+    {
+      FlushUserListChanges();
+      return;
+    }
+    if (user_list_flush_scheduled_) {
+      return;
+    }
+    user_list_flush_scheduled_ = true;
+    user_list_timer_.expires_after(user_list_batching_.window);
+    user_list_timer_.async_wait([this](const auto error_code)
+    {
+      if (!error_code) {
+        FlushUserListChanges();
+      }
+    });
+  }
+
+  void FlushUserListChanges()
+  {
+    if (std::exchange(user_list_flush_scheduled_, false)) {
+      user_list_timer_.cancel();
+    }
+    if (pending_user_list_changes_.empty()) {
+      return;
+    }
+    const auto changes = std::make_shared<const std::vector<UserListChange>>(
+      pending_user_list_changes_.Take());
+    for (const auto& change : *changes) {
+      AddUserListChange(change.user_message, change.admin_message);
+    }
+    // Admins and regular users are sent different messages, so each
+    // group gets its own broadcast
+    const auto post_changes = [&changes](const auto& users, auto message)
+    {
+      auto fan_out = FanOut<TClient>();
+      for (const auto& [user, user_data] : users)
+      {
+        fan_out.Add(user);
+      }
+      fan_out.Post([changes, message](auto& user)
+      {
+        // Users who joined were already sent their own join
+        const auto is_own_join = [&user](const auto& change) {
+          return change.joined_user.get() == &user;
+        };
+        if (std::all_of(changes->begin(), changes->end(), is_own_join)) {
+          return;
+        }
+        user.QueueMessageBatch(
+          [changes, message, is_own_join](auto queue_message)
+          {
+            for (const auto& change : *changes) {
+              if (!is_own_join(change)) {
+                queue_message(change.*message);
+              }
+            }
+          });
+      });
+    };
+    post_changes(users_.GetAdmins(), &UserListChange::admin_message);
+    post_changes(users_.GetRegularUsers(), &UserListChange::user_message);
+  }
+
   template<typename TListElement>
   void AddUserToList(const TUserData& user, TListElement list_info)
   {
@@ -212,8 +376,16 @@ private:
     }
   }
 
-  std::unordered_map<std::shared_ptr<TClient>, TUserData> users_;
-  std::uint32_t admins_count_ = 0;
+  ChannelUsers<std::shared_ptr<TClient>, TUserData> users_;
+  CachedUserList user_list_;
+  CachedUserList admin_user_list_;
+  using PendingUserListChanges =
+    UserListChanges<std::shared_ptr<TClient>, std::shared_ptr<SocketMessage>>;
+  using UserListChange = typename PendingUserListChanges::Change;
+  PendingUserListChanges pending_user_list_changes_;
+  UserListBatchOptions user_list_batching_;
+  boost::asio::steady_timer user_list_timer_;
+  bool user_list_flush_scheduled_ = false;
   CollabVmChatRoom<TClient,
 	                 CollabVm::Common::max_username_len,
                    CollabVm::Common::max_chat_message_len> chat_room_;
@@ -0,0 +1,90 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace CollabVm::Server {
+struct UserListBatchOptions {
+  // Joins, leaves and username changes in channels with at least this many
+  // users are collected for a window and then sent together, smaller
+  // channels send them right away
+  std::size_t min_users = 100;
+  // Zero disables batching
+  std::chrono::milliseconds window = std::chrono::milliseconds(200);
+};
+
+/**
+ * The changes to a channel's user list that haven't been sent yet, each
+ * with a message for regular users and one for admins. A user who joins
+ * and leaves before the changes are sent cancels out, along with any
+ * username changes they made, so nobody is told about them.
+ * Must only be used from one strand.
+ */
+template<typename TUser, typename TMessage>
+class UserListChanges {
+ public:
+  struct Change {
+    // Only set for joins, the user who joined is sent the message
+    // when they join so they should be skipped
+    TUser joined_user;
+    TMessage user_message;
+    TMessage admin_message;
+  };
+
+  void Add(TUser user, TMessage user_message, TMessage admin_message) {
+    Push(user, {user, std::move(user_message), std::move(admin_message)});
+  }
+
+  void Remove(const TUser& user, TMessage message) {
+    const auto user_changes = changes_by_user_.find(user);
+    if (user_changes != changes_by_user_.end()
+        && changes_[user_changes->second.front()].joined_user) {
+      for (const auto index : user_changes->second) {
+        changes_[index] = {};
+      }
+      changes_by_user_.erase(user_changes);
+      return;
+    }
+    Push(user, {{}, message, message});
+  }
+
+  void Rename(const TUser& user, TMessage message) {
+    Push(user, {{}, message, message});
+  }
+
+  // Whether there are changes for the user that haven't been sent
+  bool Contains(const TUser& user) const {
+    return changes_by_user_.find(user) != changes_by_user_.end();
+  }
+
+  bool empty() const {
+    return changes_by_user_.empty();
+  }
+
+  // Returns the changes in the order they were made and forgets them
+  std::vector<Change> Take() {
+    auto changes = std::vector<Change>();
+    changes.reserve(changes_.size());
+    for (auto& change : changes_) {
+      if (change.user_message) {
+        changes.push_back(std::move(change));
+      }
+    }
+    changes_.clear();
+    changes_by_user_.clear();
+    return changes;
+  }
+
+ private:
+  void Push(const TUser& user, Change&& change) {
+    changes_by_user_[user].push_back(changes_.size());
+    changes_.push_back(std::move(change));
+  }
+
+  // Cancelled changes are left without messages
+  std::vector<Change> changes_;
+  std::unordered_map<TUser, std::vector<std::size_t>> changes_by_user_;
+};
+}  // namespace CollabVm::Server
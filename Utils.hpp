@@ -1,7 +1,8 @@
 #pragma once
 #include <iomanip>
 #include <sstream>
-#include <string>
+#include <string>
+#include <string_view>
 
 // Taken from GNU Cgicc
 /*
@@ -127,4 +128,52 @@ std::string form_urlencode(const std::string& src) {
   }
 
   return result.str();
-}
\ No newline at end of file
+}
+// Reverses form_urlencode. Invalid escape sequences are left as they are.
+inline std::string form_urldecode(const std::string_view src) {
+  const auto hex_value = [](char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+  };
+  std::string result;
+  result.reserve(src.size());
+  for (auto i = std::size_t(0); i < src.size(); i++) {
+    if (src[i] == '+') {
+      result += ' ';
+    } else if (src[i] == '%' && i + 2 < src.size()
+               && hex_value(src[i + 1]) >= 0 && hex_value(src[i + 2]) >= 0) {
+      result += char(hex_value(src[i + 1]) * 16 + hex_value(src[i + 2]));
+      i += 2;
+    } else {
+      result += src[i];
+    }
+  }
+  return result;
+}
+
+// Finds a parameter in the query string of a request target and decodes it
+inline std::string GetQueryParameter(const std::string_view target,
+                                     const std::string_view name) {
+  const auto query_start = target.find('?');
+  if (query_start == std::string_view::npos) {
+    return {};
+  }
+  auto query = target.substr(query_start + 1);
+  while (!query.empty()) {
+    const auto separator = query.find('&');
+    const auto parameter = query.substr(0, separator);
+    const auto equals = parameter.find('=');
+    if (parameter.substr(0, equals) == name) {
+      return equals == std::string_view::npos
+               ? std::string()
+               : form_urldecode(parameter.substr(equals + 1));
+    }
+    if (separator == std::string_view::npos) {
+      break;
+    }
+    query.remove_prefix(separator + 1);
+  }
+  return {};
+}
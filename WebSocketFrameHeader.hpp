@@ -0,0 +1,48 @@
+#pragma once
+#include <boost/asio/buffer.hpp>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace CollabVm::Server {
+/**
+ * The header of an unfragmented, uncompressed binary WebSocket frame sent
+ * by the server. Frames sent to clients aren't masked, so the header only
+ * depends on the payload's size and can be shared by every connection a
+ * message is sent to.
+ * https://tools.ietf.org/html/rfc6455#section-5.2
+ */
+class WebSocketFrameHeader {
+ public:
+  // FIN and the binary opcode
+  constexpr static auto first_byte = std::uint8_t(0x82);
+  constexpr static auto max_size = std::size_t(10);
+
+  WebSocketFrameHeader() = default;
+
+  explicit WebSocketFrameHeader(std::uint64_t payload_size) {
+    bytes_[0] = first_byte;
+    if (payload_size < 126) {
+      bytes_[1] = static_cast<std::uint8_t>(payload_size);
+      size_ = 2;
+      return;
+    }
+    // The extended length is big-endian
+    const auto length_bytes = payload_size <= 0xFFFF ? 2 : 8;
+    bytes_[1] = length_bytes == 2 ? 126 : 127;
+    for (auto i = 0; i < length_bytes; i++) {
+      bytes_[2 + i] = static_cast<std::uint8_t>(
+        payload_size >> 8 * (length_bytes - 1 - i));
+    }
+    size_ = 2 + length_bytes;
+  }
+
+  boost::asio::const_buffer GetBuffer() const {
+    return boost::asio::const_buffer(bytes_.data(), size_);
+  }
+
+ private:
+  std::array<std::uint8_t, max_size> bytes_ = {};
+  std::size_t size_ = 0;
+};
+}  // namespace CollabVm::Server
@@ -4,35 +4,87 @@
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
+#include <atomic>
 #include <cerrno>
+#include <cstring>
 #include <filesystem>
 #include <cassert>
 #include <exception>
 #include <functional>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <thread>
+#include <type_traits>
 #include <utility>
 #include <variant>
 #include <vector>
 #include <list>
+#include <sstream>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <unistd.h>
+#endif
+#include "AdmissionControl.hpp"
+#include "ConnectionExecutor.hpp"
+#include "ConnectionSlab.hpp"
+#include "FileUploadReader.hpp"
+#include "ProxyProtocol.hpp"
+#include "SendQueue.hpp"
+#include "StaticFileCache.hpp"
 #include "StrandGuard.hpp"
+#include "TlsStream.hpp"
+#include "UserListChanges.hpp"
 // #include "file_body.hpp"
 
 namespace CollabVm::Server {
 namespace asio = boost::asio;
 namespace beast = boost::beast;
 
+using WebSocketStream = beast::websocket::stream<TlsStream&>;
+
+// Returns an empty value for endpoints that aren't TCP
+inline std::optional<asio::ip::tcp::endpoint> ToTcpEndpoint(
+    const asio::generic::stream_protocol::endpoint& endpoint) {
+  const auto family = endpoint.protocol().family();
+  if (family != AF_INET && family != AF_INET6) {
+    return {};
+  }
+  auto tcp_endpoint = asio::ip::tcp::endpoint();
+  std::memcpy(tcp_endpoint.data(), endpoint.data(), endpoint.size());
+  tcp_endpoint.resize(endpoint.size());
+  return tcp_endpoint;
+}
+
+// Per-message compression requires websocket::stream::compress(),
+// which older versions of Beast don't have
+template<typename TStream, typename = void>
+struct SupportsPerMessageCompression : std::false_type {};
+template<typename TStream>
+struct SupportsPerMessageCompression<TStream,
+  std::void_t<decltype(std::declval<TStream&>().compress(true))>>
+  : std::true_type {};
+
+struct CompressionOptions {
+  // Negotiate permessage-deflate with clients that support it
+  bool enabled = false;
+  // Smaller windows and memory levels reduce the memory used by each
+  // connection's deflate stream at the cost of compression ratio
+  int window_bits = 15;
+  int mem_level = 4;
+};
+
 template <typename TServer>
 class WebServerSocket : public std::enable_shared_from_this<
                             WebServerSocket<TServer>> {
  public:
   WebServerSocket(asio::io_context& io_context,
-                  const std::filesystem::path& doc_root)
-      : socket_(io_context, io_context),
+                  StaticFileCache& file_cache)
+      : context_(std::make_shared<ConnectionContext>(io_context)),
+        socket_(CreateStrand(), io_context),
         request_deadline_(io_context,
                           std::chrono::steady_clock::time_point::max()),
-        doc_root_(doc_root) {}
+        file_cache_(file_cache) {}
 
   virtual ~WebServerSocket() noexcept = default;
 
@@ -40,13 +92,23 @@ class WebServerSocket : public std::enable_shared_from_this<
     socket_.dispatch([ this,
                        self = this->shared_from_this() ](auto& socket) mutable {
       boost::system::error_code ec;
-      ip_address_ = socket.socket.lowest_layer().remote_endpoint(ec).address();
+      const auto endpoint = socket.socket.remote_endpoint(ec);
       if (ec) {
         Close();
         return;
       }
-      socket.socket.set_option(asio::ip::tcp::no_delay(true), ec);
-      ReadHttpRequest(std::move(self));
+      if (const auto tcp_endpoint = ToTcpEndpoint(endpoint)) {
+        ip_address_ = tcp_endpoint->address();
+        socket.socket.set_option(asio::ip::tcp::no_delay(true), ec);
+      } else {
+        // Unix domain sockets are only used by local reverse proxies
+        ip_address_ = asio::ip::address(asio::ip::address_v6::loopback());
+      }
+      if (proxy_protocol_) {
+        ReadProxyHeader(std::move(self), socket);
+        return;
+      }
+      StartHttp(std::move(self), socket);
     });
   }
 
@@ -80,91 +142,343 @@ class WebServerSocket : public std::enable_shared_from_this<
               return;
             }
             OnMessage(std::move(buffer_ptr));
+            if (move_target_) {
+              Move(std::move(self));
+              return;
+            }
             CreateMessageBuffer()->StartRead(std::move(self));
           }));
     });
   }
 
+  // Moves the connection to another io_context after the message that is
+  // being handled, must be called from OnMessage()
+  void MoveTo(asio::io_context& io_context) {
+    move_target_ = &io_context;
+  }
+
+  // The io_context that the connection's strands currently run on
+  asio::io_context& GetIoContext() const {
+    return context_->Get();
+  }
+
+  // The number of connections that have been moved to another io_context
+  static std::uint64_t GetMovedConnections() {
+    return GetMovedConnectionsCounter();
+  }
+
   template<typename TSockets, typename TRequest>
-  bool SendFileResponse(std::shared_ptr<WebServerSocket>& self, TSockets& sockets, const TRequest& request, std::filesystem::path path) {
-    // Verify that the path exists within the doc root and is not a directory
-    auto err = std::error_code();
-    path = std::filesystem::canonical(doc_root_ / path, err);
-    if (err || path.compare(doc_root_) < 0 ||
-          !std::equal(doc_root_.begin(), doc_root_.end(), path.begin())) {
-      return false;
+  bool SendFileResponse(std::shared_ptr<WebServerSocket>& self, TSockets& sockets, const TRequest& request,
+                        std::shared_ptr<const StaticFileCache::File>&& file) {
+    const auto not_modified = StaticFileCache::IsNotModified(
+      *file, request[beast::http::field::if_none_match]);
+    if (!file->cached && !not_modified) {
+      return SendUncachedFileResponse(self, sockets, request, *file);
     }
-    auto status = std::filesystem::status(path, err);
-    if (err || status.type() == std::filesystem::file_type::directory) {
-      return false;
+
+    using span_body = beast::http::span_body<const char>;
+    auto resp = beast::http::response<span_body>();
+    resp.version(request.version());
+    resp.set(beast::http::field::server, "collab-vm-server");
+    resp.set(beast::http::field::etag, file->etag);
+    resp.set(beast::http::field::last_modified, file->last_modified);
+    resp.set(beast::http::field::cache_control, "no-cache");
+    if (!file->gzip_content.empty() || !file->brotli_content.empty()) {
+      resp.set(beast::http::field::vary, "Accept-Encoding");
+    }
+    if (not_modified) {
+      resp.result(beast::http::status::not_modified);
+    } else {
+      resp.result(beast::http::status::ok);
+      resp.set(beast::http::field::content_type, file->content_type);
+      const auto [encoding, content] = StaticFileCache::SelectContent(
+        *file, request[beast::http::field::accept_encoding]);
+      if (encoding == StaticFileCache::Encoding::kGzip) {
+        resp.set(beast::http::field::content_encoding, "gzip");
+      } else if (encoding == StaticFileCache::Encoding::kBrotli) {
+        resp.set(beast::http::field::content_encoding, "br");
+      }
+      resp.body() = span_body::value_type(content->data(), content->size());
     }
+    resp.prepare_payload();
+    // Keep the cached content alive until the response has been sent
+    auto& http_state = *http_state_;
+    http_state.file = std::move(file);
+    http_state.response = std::move(resp);
+
+    http_state.serializer.template emplace<beast::http::response_serializer<span_body>>(
+      std::get<beast::http::response<span_body>>(http_state.response));
+    beast::http::async_write(
+      sockets.stream,
+      std::get<beast::http::response_serializer<span_body>>(http_state.serializer),
+      socket_.wrap([ this, self = std::move(self) ](
+        auto& sockets,
+        const boost::system::error_code ec,
+        std::size_t bytes_transferred) mutable {
+          http_state_->file.reset();
+          if (ec) {
+            Close();
+            return;
+          }
+          ReadHttpRequest(std::move(self));
+        }));
+    return true;
+  }
 
-    auto file_open_error = boost::system::error_code();
-    auto file = beast::http::file_body::value_type();
-    auto path_string = path.string();
-    file.open(path_string.c_str(), beast::file_mode::read, file_open_error);
-    if (file_open_error) {
+  // Streams files that are too large to be cached from disk. The file is
+  // read on the file I/O pool so slow storage never blocks the threads
+  // that deliver WebSocket messages.
+  template<typename TSockets, typename TRequest>
+  bool SendUncachedFileResponse(std::shared_ptr<WebServerSocket>& self, TSockets& sockets, const TRequest& request,
+                                const StaticFileCache::File& cached_file) {
+    auto& http_state = *http_state_;
+    auto& transfer = http_state.file_transfer.emplace();
+    auto ec = boost::system::error_code();
+    transfer.file.open(cached_file.path.string().c_str(), beast::file_mode::read, ec);
+    if (!ec) {
+      transfer.size = transfer.file.size(ec);
+    }
+    if (ec) {
+      http_state.file_transfer.reset();
       return false;
     }
-    auto resp = beast::http::response<beast::http::file_body>();
+
+    auto resp = beast::http::response<beast::http::empty_body>();
     resp.result(beast::http::status::ok);
     resp.version(request.version());
     resp.set(beast::http::field::server, "collab-vm-server");
-    resp.set(beast::http::field::content_type, mime_type(path_string));
-    resp.body() = std::move(file);
-    try {
-      // prepare calls FileBody::write::init() which could fail
-      // and cause an exception to be thrown
-      resp.prepare_payload();
-      response_ = std::move(resp);
-
-      serializer_.emplace<beast::http::response_serializer<beast::http::file_body>>(
-        std::get<beast::http::response<
-          beast::http::file_body>>(response_));
-      beast::http::async_write(
-        sockets.socket,
-        std::get<beast::http::response_serializer<beast::http::file_body>>(serializer_),
-        socket_.wrap([ this, self = std::move(self) ](
-          auto& sockets,
-          const boost::system::error_code ec,
-          std::size_t bytes_transferred) mutable {
-            std::get<
-                beast::http::response<beast::http::file_body>>(
-                response_)
-              .body()
-              .close();
-            if (!ec) {
-              ReadHttpRequest(std::move(self));
+    resp.set(beast::http::field::content_type, cached_file.content_type);
+    resp.set(beast::http::field::etag, cached_file.etag);
+    resp.set(beast::http::field::last_modified, cached_file.last_modified);
+    // The body is written separately after the header
+    resp.content_length(transfer.size);
+
+    http_state.response = std::move(resp);
+    http_state.serializer.template emplace<beast::http::response_serializer<beast::http::empty_body>>(
+      std::get<beast::http::response<beast::http::empty_body>>(http_state.response));
+    beast::http::async_write_header(
+      sockets.stream,
+      std::get<beast::http::response_serializer<beast::http::empty_body>>(http_state.serializer),
+      socket_.wrap([ this, self = std::move(self) ](
+        auto& sockets,
+        const boost::system::error_code ec,
+        std::size_t bytes_transferred) mutable {
+          if (ec) {
+            http_state_->file_transfer.reset();
+            Close();
+            return;
+          }
+#ifdef __linux__
+          // TLS connections can only use sendfile() when the kernel
+          // encrypts the records
+          if (sockets.stream.CanWriteDirectly()) {
+            // sendfile() must not block on the socket, EAGAIN is handled
+            // by waiting for the socket to become writable
+            auto non_blocking_error = boost::system::error_code();
+            sockets.socket.native_non_blocking(true, non_blocking_error);
+            // The pool writes to a duplicate descriptor so that closing the
+            // socket while a chunk is being sent can't cause the number to
+            // be reused by another connection
+            const auto socket_fd = ::dup(sockets.socket.native_handle());
+            if (non_blocking_error || socket_fd == -1) {
+              http_state_->file_transfer.reset();
+              Close();
+              return;
             }
-          }));
-    } catch (const boost::system::system_error&) {
-      return false;
-    }
+            http_state_->file_transfer->socket_fd = socket_fd;
+            http_state_->file_transfer->stream = &sockets.stream;
+          }
+#endif
+          SendFileChunk(std::move(self));
+        }));
     return true;
   }
 
+  void SendFileChunk(std::shared_ptr<WebServerSocket>&& self) {
+    // Nothing else touches the HTTP state while a transfer is in progress,
+    // so the file can be accessed from the pool without the strand
+    asio::post(file_cache_.GetFilePool(), [this, self = std::move(self)]() mutable {
+      auto& transfer = *http_state_->file_transfer;
+      const auto chunk_size = static_cast<std::size_t>(
+        std::min<std::uint64_t>(transfer.size - transfer.offset,
+                                FileTransfer::max_chunk_size));
+#ifdef __linux__
+      if (transfer.socket_fd != -1) {
+        auto offset = static_cast<off_t>(transfer.offset);
+        auto lock = transfer.stream->LockDescriptor();
+        const auto result = ::sendfile(transfer.socket_fd,
+                                       transfer.file.native_handle(),
+                                       &offset, chunk_size);
+        const auto error = result < 0 ? errno : 0;
+        lock.unlock();
+        socket_.dispatch([this, self = std::move(self), result, error](auto& sockets) mutable {
+          if (result < 0 && (error == EAGAIN || error == EWOULDBLOCK)) {
+            sockets.socket.async_wait(
+              StreamSocket::wait_write,
+              socket_.wrap([this, self = std::move(self)](
+                auto& sockets, const boost::system::error_code ec) mutable {
+                  if (ec) {
+                    http_state_->file_transfer.reset();
+                    Close();
+                    return;
+                  }
+                  SendFileChunk(std::move(self));
+                }));
+            return;
+          }
+          OnFileChunkSent(std::move(self), result > 0 ? result : 0);
+        });
+        return;
+      }
+#endif
+      if (!transfer.buffer) {
+        transfer.buffer = std::make_unique<char[]>(FileTransfer::max_chunk_size);
+      }
+      auto ec = boost::system::error_code();
+      const auto bytes_read = transfer.file.read(transfer.buffer.get(), chunk_size, ec);
+      socket_.dispatch([this, self = std::move(self), bytes_read, ec](auto& sockets) mutable {
+        if (ec || !bytes_read) {
+          OnFileChunkSent(std::move(self), 0);
+          return;
+        }
+        asio::async_write(
+          sockets.stream,
+          asio::buffer(http_state_->file_transfer->buffer.get(), bytes_read),
+          socket_.wrap([this, self = std::move(self)](
+            auto& sockets, const boost::system::error_code ec,
+            std::size_t bytes_transferred) mutable {
+              OnFileChunkSent(std::move(self), ec ? 0 : bytes_transferred);
+            }));
+      });
+    });
+  }
+
+  // Called on the socket's strand after part of a file has been written.
+  // Zero bytes means the transfer failed.
+  void OnFileChunkSent(std::shared_ptr<WebServerSocket>&& self,
+                       std::size_t bytes_sent) {
+    auto& transfer = *http_state_->file_transfer;
+    if (!bytes_sent) {
+      http_state_->file_transfer.reset();
+      Close();
+      return;
+    }
+    transfer.offset += bytes_sent;
+    if (transfer.offset < transfer.size) {
+      SendFileChunk(std::move(self));
+      return;
+    }
+    http_state_->file_transfer.reset();
+    ReadHttpRequest(std::move(self));
+  }
+
+  template<typename TSockets>
+  void StartHttp(std::shared_ptr<WebServerSocket>&& self, TSockets& sockets) {
+    if (!tls_context_) {
+      ReadHttpRequest(std::move(self));
+      return;
+    }
+    auto ec = boost::system::error_code();
+    sockets.stream.EnableTls(tls_context_, ec);
+    if (ec) {
+      Close();
+      return;
+    }
+    sockets.stream.async_handshake(socket_.wrap([this, self = std::move(self)](
+        auto& sockets, const boost::system::error_code ec) mutable {
+      if (ec) {
+        Close();
+        return;
+      }
+      ReadHttpRequest(std::move(self));
+    }));
+  }
+
+  // Reads the PROXY protocol header into the HTTP buffer so the bytes that
+  // follow it in the same segment don't need to be read again
+  template<typename TSockets>
+  void ReadProxyHeader(std::shared_ptr<WebServerSocket>&& self,
+                       TSockets& sockets) {
+    if (!http_state_) {
+      http_state_ = std::make_unique<HttpState>();
+      has_http_state_ = true;
+    }
+    auto& buffer = http_state_->buffer;
+    auto header = ProxyHeader();
+    const auto result =
+      ParseProxyHeader(buffer.data().data(), buffer.size(), header);
+    if (result == ProxyParseResult::kOk) {
+      if (header.source_address) {
+        ip_address_ = *header.source_address;
+      }
+      buffer.consume(header.size);
+      StartHttp(std::move(self), sockets);
+      return;
+    }
+    if (result == ProxyParseResult::kInvalid
+        || header.size > buffer.max_size()) {
+      Close();
+      return;
+    }
+    // The TLS handshake reads from the socket directly, so nothing after
+    // the header can be read into the buffer
+    const auto needed = header.size - buffer.size();
+    const auto read_size = tls_context_ ? needed : buffer.capacity() - buffer.size();
+    asio::async_read(
+      sockets.socket, buffer.prepare(read_size), asio::transfer_at_least(needed),
+      socket_.wrap([this, self = std::move(self)](
+          auto& sockets, const boost::system::error_code ec,
+          std::size_t bytes_transferred) mutable {
+        if (ec) {
+          Close();
+          return;
+        }
+        http_state_->buffer.commit(bytes_transferred);
+        ReadProxyHeader(std::move(self), sockets);
+      }));
+  }
+
   void ReadHttpRequest(std::shared_ptr<WebServerSocket>&& self) {
     // Request must be fully processed within 60 seconds.
     request_deadline_.expires_after(std::chrono::seconds(60));
 
     socket_.dispatch([ this, self = std::move(self) ](auto& socket) {
-      buffer_.clear();
-      // Destruct and reconstruct the parser
-      ([](auto& response) {
-        using T = std::remove_reference_t<decltype(response)>;
-        response.~T();
-        new (&response) T;
-      })(parser_);
+      if (http_state_) {
+        // Destruct and reconstruct the parser, the buffer is kept because
+        // the previous read only consumed the bytes it parsed and anything
+        // left is the start of the next request
+        ([](auto& response) {
+          using T = std::remove_reference_t<decltype(response)>;
+          response.~T();
+          new (&response) T;
+        })(http_state_->parser);
+      } else {
+        http_state_ = std::make_unique<HttpState>();
+        has_http_state_ = true;
+      }
+      // Bodies are never read by this parser, but the limit would otherwise
+      // reject uploads by their Content-Length before the target is known.
+      // The usual limit is checked for everything else once the header has
+      // been read.
+      http_state_->parser.body_limit((std::numeric_limits<std::uint64_t>::max)());
 
       beast::http::async_read_header(
-          socket.socket, buffer_, parser_,
+          socket.stream, http_state_->buffer, http_state_->parser,
           socket_.wrap([ this, self = std::move(self) ](
               auto& sockets, const boost::system::error_code ec,
               std::size_t bytes_transferred) mutable {
             if (ec) {
+              Close();
+              return;
+            }
+            auto& http_state = *http_state_;
+            auto& request = http_state.parser.get();
+            if (const auto content_length = http_state.parser.content_length();
+                content_length && *content_length > max_body_size
+                && !IsUploadRequest(request)) {
+              Close();
               return;
             }
-            auto& request = parser_.get();
             if (request.method() == beast::http::verb::get) {
               // Accept WebSocket connections
               if (request.target() == "/") {
@@ -178,7 +492,12 @@ class WebServerSocket : public std::enable_shared_from_this<
                   if (upgrade_header != request.end() &&
                       beast::http::token_list(upgrade_header->value())
                           .exists("websocket")) {
-                    buffer_.consume(buffer_.size());
+                    if (admission_control_
+                        && admission_control_->IsOverloaded()) {
+                      SendServiceUnavailable(std::move(self), sockets);
+                      return;
+                    }
+                    http_state.buffer.consume(http_state.buffer.size());
                     OnPreConnect();
                     return;
                   }
@@ -186,19 +505,9 @@ class WebServerSocket : public std::enable_shared_from_this<
               }
 
               // Serve static content from doc root
-              std::filesystem::path path(request.target().substr(1));
-              // Disallow relative paths
-              if (std::none_of(path.begin(), path.end(), [](const auto& e) {
-                    return e == ".." || e == ".";
-                  })) {
-                // First try the path without modifying it
-                if ((!path.empty() && (SendFileResponse(self, sockets, request, path)
-                  // Then try appending .html to the first part
-                  || SendFileResponse(self, sockets, request, (path = *path.begin(), path += ".html"))))
-                  // Default to index.html if the previous attempts failed
-                  || SendFileResponse(self, sockets, request, "index.html")) {
-                  return;
-                }
+              if (auto file = file_cache_.Find(request.target().substr(1));
+                  file && SendFileResponse(self, sockets, request, std::move(file))) {
+                return;
               }
 
               // Send 404 response
@@ -209,20 +518,22 @@ class WebServerSocket : public std::enable_shared_from_this<
               resp.set(beast::http::field::content_type, "text/html");
               resp.body() = "The file '" + std::string(request.target()) + "' was not found";
               resp.prepare_payload();
-              response_ = std::move(resp);
+              http_state.response = std::move(resp);
 
-              serializer_.emplace<beast::http::response_serializer<beast::http::string_body>>(
+              http_state.serializer.template emplace<beast::http::response_serializer<beast::http::string_body>>(
                     std::get<beast::http::response<beast::http::string_body>>(
-                        response_));
+                        http_state.response));
               beast::http::async_write(
-                  sockets.socket,
-                  std::get<beast::http::response_serializer<beast::http::string_body>>(serializer_),
+                  sockets.stream,
+                  std::get<beast::http::response_serializer<beast::http::string_body>>(http_state.serializer),
                   socket_.wrap([ this, self = std::move(self) ](
                       auto& sockets, const boost::system::error_code ec,
                       std::size_t bytes_transferred) mutable {
-                    if (!ec) {
-                      ReadHttpRequest(std::move(self));
+                    if (ec) {
+                      Close();
+                      return;
                     }
+                    ReadHttpRequest(std::move(self));
                   }));
 
               return;
@@ -231,21 +542,13 @@ class WebServerSocket : public std::enable_shared_from_this<
               // RFC 2616 § 8.2.2 requires clients to stop sending a message
               // body when an error response is received, but most browsers
               // don't comply with it
-              if (request.target() == "/upload") {
-                if (boost::iequals(request[beast::http::field::content_type],
-                                   "application/octet-stream")) {
-                  const auto content_length =
-                      request.find(beast::http::field::content_length);
-                  if (content_length != request.end()) {
-                    unsigned long len = std::strtoul(
-                        content_length->value().data(), nullptr, 10);
-                  }
-                }
+              if (IsUploadRequest(request)) {
+                StartUpload(std::move(self), sockets);
+                return;
               }
 
               // Disconnect socket to prevent data from being received
-              auto err = boost::system::error_code();
-              sockets.socket.close(err);
+              Close();
               return;
             }
 
@@ -257,25 +560,237 @@ class WebServerSocket : public std::enable_shared_from_this<
             resp.set(beast::http::field::content_type, "text/html");
             resp.body() = "The method '" + std::string(request.method_string()) + "' is not allowed";
             resp.prepare_payload();
-            response_ = std::move(resp);
+            http_state.response = std::move(resp);
 
-            serializer_.emplace<beast::http::response_serializer<beast::http::string_body>>(
+            http_state.serializer.template emplace<beast::http::response_serializer<beast::http::string_body>>(
                     std::get<beast::http::response<beast::http::string_body>>(
-                        response_));
+                        http_state.response));
             beast::http::async_write(
-                sockets.socket,
-                std::get<beast::http::response_serializer<beast::http::string_body>>(serializer_),
+                sockets.stream,
+                std::get<beast::http::response_serializer<beast::http::string_body>>(http_state.serializer),
                 socket_.wrap([ this, self = std::move(self) ](
                     auto& sockets, const boost::system::error_code ec,
                     std::size_t bytes_transferred) mutable {
-                  if (!ec) {
-                    ReadHttpRequest(std::move(self));
+                  if (ec) {
+                    Close();
+                    return;
                   }
+                  ReadHttpRequest(std::move(self));
                 }));
           }));
     });
   }
 
+  // Turns away a new connection while the server is overloaded so the
+  // existing ones aren't slowed down
+  template<typename TSockets>
+  void SendServiceUnavailable(std::shared_ptr<WebServerSocket>&& self,
+                              TSockets& sockets) {
+    auto& http_state = *http_state_;
+    auto resp = beast::http::response<beast::http::string_body>();
+    resp.result(beast::http::status::service_unavailable);
+    resp.version(http_state.parser.get().version());
+    resp.set(beast::http::field::server, "collab-vm-server");
+    resp.set(beast::http::field::content_type, "text/plain");
+    resp.set(beast::http::field::retry_after,
+             std::to_string(admission_control_->GetOptions().retry_after.count()));
+    resp.set(beast::http::field::connection, "close");
+    resp.body() = "The server is busy";
+    resp.prepare_payload();
+    http_state.response = std::move(resp);
+
+    http_state.serializer.template emplace<beast::http::response_serializer<beast::http::string_body>>(
+          std::get<beast::http::response<beast::http::string_body>>(
+              http_state.response));
+    beast::http::async_write(
+        sockets.stream,
+        std::get<beast::http::response_serializer<beast::http::string_body>>(http_state.serializer),
+        socket_.wrap([ this, self = std::move(self) ](
+            auto& sockets, const boost::system::error_code ec,
+            std::size_t bytes_transferred) mutable {
+          Close();
+        }));
+  }
+
+  template<typename TRequest>
+  static bool IsUploadRequest(const TRequest& request) {
+    const auto target = request.target();
+    return request.method() == beast::http::verb::post
+           && target.substr(0, target.find('?')) == "/upload";
+  }
+
+  // Validates an upload request and asks the server whether to accept it
+  template<typename TSockets>
+  void StartUpload(std::shared_ptr<WebServerSocket>&& self, TSockets& sockets) {
+    auto& parser = http_state_->parser;
+    auto& request = parser.get();
+    auto error = boost::system::error_code();
+    if (!boost::iequals(request[beast::http::field::content_type],
+                        "application/octet-stream")) {
+      error = UploadErrorCode::kInvalidContentType;
+    } else if (!parser.content_length() || !*parser.content_length()) {
+      error = UploadErrorCode::kNoContentLen;
+    }
+    if (error) {
+      SendUploadResponse(std::move(self), sockets, error);
+      return;
+    }
+    OnUploadRequest(
+      std::string(request.target()), *parser.content_length(),
+      [this, self = std::move(self)](
+          std::shared_ptr<FileUploadReader>&& reader,
+          boost::system::error_code ec) mutable {
+        socket_.dispatch([this, self = std::move(self),
+                          reader = std::move(reader), ec](auto& sockets) mutable {
+          if (!ec) {
+            reader->Open(ec);
+          }
+          if (ec) {
+            SendUploadResponse(std::move(self), sockets, ec);
+            return;
+          }
+          auto& http_state = *http_state_;
+          const auto expects_continue = boost::iequals(
+            http_state.parser.get()[beast::http::field::expect], "100-continue");
+          http_state.upload = std::make_unique<Upload>(
+            request_deadline_.get_executor(), std::move(http_state.parser),
+            std::move(reader));
+          if (!expects_continue) {
+            ReadUploadChunk(std::move(self), sockets);
+            return;
+          }
+          static constexpr auto continue_response =
+            std::string_view("HTTP/1.1 100 Continue\r\n\r\n");
+          asio::async_write(
+            sockets.stream,
+            asio::buffer(continue_response.data(), continue_response.size()),
+            socket_.wrap([this, self = std::move(self)](
+                auto& sockets, const boost::system::error_code ec,
+                std::size_t bytes_transferred) mutable {
+              if (ec) {
+                http_state_->upload.reset();
+                Close();
+                return;
+              }
+              ReadUploadChunk(std::move(self), sockets);
+            }));
+        });
+      });
+  }
+
+  // The body is only read after the previous chunk has been written so
+  // clients can't upload faster than the disk can keep up
+  template<typename TSockets>
+  void ReadUploadChunk(std::shared_ptr<WebServerSocket>&& self, TSockets& sockets) {
+    auto& upload = *http_state_->upload;
+    auto& body = upload.parser.get().body();
+    body.data = upload.buffer.data();
+    body.size = upload.buffer.size();
+    beast::http::async_read(
+      sockets.stream, http_state_->buffer, upload.parser,
+      socket_.wrap([this, self = std::move(self)](
+          auto& sockets, boost::system::error_code ec,
+          std::size_t bytes_transferred) mutable {
+        if (ec == beast::http::error::need_buffer) {
+          ec = {};
+        }
+        auto& upload = *http_state_->upload;
+        if (ec) {
+          http_state_->upload.reset();
+          Close();
+          return;
+        }
+        const auto bytes_read =
+          upload.buffer.size() - upload.parser.get().body().size;
+        asio::post(file_cache_.GetFilePool(),
+          [this, self = std::move(self), bytes_read]() mutable {
+            auto& upload = *http_state_->upload;
+            auto ec = boost::system::error_code();
+            upload.reader->Write(upload.buffer.data(), bytes_read, ec);
+            if (!ec && upload.parser.is_done()) {
+              upload.reader->Finish(ec);
+            }
+            socket_.dispatch([this, self = std::move(self), bytes_read, ec](auto& sockets) mutable {
+              if (ec || http_state_->upload->parser.is_done()) {
+                http_state_->upload.reset();
+                SendUploadResponse(std::move(self), sockets, ec);
+                return;
+              }
+              OnUploadProgress(bytes_read,
+                [this, self = std::move(self)](const auto delay) mutable {
+                  socket_.dispatch([this, self = std::move(self), delay](auto& sockets) mutable {
+                    if (delay == delay.zero()) {
+                      ReadUploadChunk(std::move(self), sockets);
+                      return;
+                    }
+                    auto& timer = http_state_->upload->timer;
+                    timer.expires_after(delay);
+                    timer.async_wait(socket_.wrap([this, self = std::move(self)](
+                        auto& sockets, const boost::system::error_code ec) mutable {
+                      if (ec) {
+                        http_state_->upload.reset();
+                        Close();
+                        return;
+                      }
+                      ReadUploadChunk(std::move(self), sockets);
+                    }));
+                  });
+                });
+            });
+          });
+      }));
+  }
+
+  // Reports the result of an upload. The connection is closed after an
+  // error because most browsers will keep sending the request body.
+  template<typename TSockets>
+  void SendUploadResponse(std::shared_ptr<WebServerSocket>&& self,
+                          TSockets& sockets,
+                          const boost::system::error_code ec) {
+    auto resp = beast::http::response<beast::http::string_body>();
+    if (!ec) {
+      resp.result(beast::http::status::created);
+    } else if (ec == UploadErrorCode::kUploadsDisabled) {
+      resp.result(beast::http::status::forbidden);
+    } else if (ec == UploadErrorCode::kFileExists) {
+      resp.result(beast::http::status::conflict);
+    } else if (ec == UploadErrorCode::kInvalidContentType) {
+      resp.result(beast::http::status::unsupported_media_type);
+    } else if (ec == UploadErrorCode::kNoContentLen) {
+      resp.result(beast::http::status::length_required);
+    } else if (ec == UploadErrorCode::kWriteFailed) {
+      resp.result(beast::http::status::internal_server_error);
+    } else {
+      resp.result(beast::http::status::bad_request);
+    }
+    resp.version(11);
+    resp.set(beast::http::field::server, "collab-vm-server");
+    resp.set(beast::http::field::content_type, "text/plain");
+    if (ec) {
+      resp.set(beast::http::field::connection, "close");
+    }
+    resp.body() = ec ? ec.message() : "Upload complete";
+    resp.prepare_payload();
+    auto& http_state = *http_state_;
+    http_state.response = std::move(resp);
+
+    http_state.serializer.template emplace<beast::http::response_serializer<beast::http::string_body>>(
+          std::get<beast::http::response<beast::http::string_body>>(
+              http_state.response));
+    beast::http::async_write(
+        sockets.stream,
+        std::get<beast::http::response_serializer<beast::http::string_body>>(http_state.serializer),
+        socket_.wrap([ this, self = std::move(self), close = !!ec ](
+            auto& sockets, const boost::system::error_code ec,
+            std::size_t bytes_transferred) mutable {
+          if (close || ec) {
+            Close();
+            return;
+          }
+          ReadHttpRequest(std::move(self));
+        }));
+  }
+
   /*template<class WriteHandler>
   beast::async_return_type<WriteHandler, void(boost::system::error_code)>
   async_write(WriteHandler&& handler)
@@ -298,9 +813,9 @@ class WebServerSocket : public std::enable_shared_from_this<
   }*/
 
   void read_body() {
-    buffer_.consume(buffer_.size());
+    http_state_->buffer.consume(http_state_->buffer.size());
     beast::http::async_read(
-        socket_, buffer_, parser_,
+        socket_, http_state_->buffer, http_state_->parser,
         [ this, self = this->shared_from_this() ](
             const boost::system::error_code ec, std::size_t bytes_transferred){
             //                if (ec)
@@ -310,26 +825,48 @@ class WebServerSocket : public std::enable_shared_from_this<
         });
   }
 
+  // The message is only compressed if compress is true and
+  // permessage-deflate was negotiated
   template <class ConstBufferSequence, class WriteHandler>
   void WriteMessage(ConstBufferSequence&& buffers,
+                    bool compress,
                     WriteHandler&& handler) {
     socket_.dispatch([
         self = this->shared_from_this(),
         buffers = std::forward<ConstBufferSequence>(buffers),
+        compress,
         handler = std::forward<WriteHandler>(handler)
       ](auto& sockets) mutable {
+        if constexpr (SupportsPerMessageCompression<WebSocketStream>::value) {
+          sockets.websocket.compress(compress);
+        }
         sockets.websocket.async_write(
           std::forward<ConstBufferSequence>(buffers),
           std::forward<WriteHandler>(handler));
       });
   }
 
+  // Writes buffers that start with a WebSocketFrameHeader directly to the
+  // stream instead of having the websocket::stream frame them again
+  template <class ConstBufferSequence, class WriteHandler>
+  void WriteFrame(ConstBufferSequence&& buffers, WriteHandler&& handler) {
+    socket_.dispatch([
+        self = this->shared_from_this(),
+        buffers = std::forward<ConstBufferSequence>(buffers),
+        handler = std::forward<WriteHandler>(handler)
+      ](auto& sockets) mutable {
+        auto& websocket = sockets.websocket;
+        sockets.stream.async_write_frame(
+          buffers,
+          std::forward<WriteHandler>(handler),
+          [&websocket] { return websocket.is_open(); });
+      });
+  }
+
   void Close() {
     socket_.post([ this, self = this->shared_from_this() ](auto& sockets) {
       auto ec = boost::system::error_code();
-      sockets.socket.shutdown(
-          asio::ip::tcp::socket::shutdown_type::shutdown_both, ec);
-      sockets.socket.close(ec);
+      sockets.stream.Close(ec);
       if (close_callback_) {
         close_callback_();
         close_callback_ = nullptr;
@@ -386,62 +923,6 @@ class WebServerSocket : public std::enable_shared_from_this<
 
   const IpAddress& GetIpAddress() { return ip_address_; }
 
-  // Return a reasonable mime type based on the extension of a file.
-  std::string_view mime_type(const std::string_view path) {
-    using boost::beast::iequals;
-    const auto ext = [&path] {
-      const auto pos = path.rfind(".");
-      if (pos == std::string_view::npos)
-        return std::string_view{};
-      return path.substr(pos);
-    }();
-    if (iequals(ext, ".htm"))
-      return "text/html";
-    if (iequals(ext, ".html"))
-      return "text/html";
-    if (iequals(ext, ".php"))
-      return "text/html";
-    if (iequals(ext, ".css"))
-      return "text/css";
-    if (iequals(ext, ".txt"))
-      return "text/plain";
-    if (iequals(ext, ".js"))
-      return "application/javascript";
-    if (iequals(ext, ".json"))
-      return "application/json";
-    if (iequals(ext, ".xml"))
-      return "application/xml";
-    if (iequals(ext, ".swf"))
-      return "application/x-shockwave-flash";
-    if (iequals(ext, ".flv"))
-      return "video/x-flv";
-    if (iequals(ext, ".png"))
-      return "image/png";
-    if (iequals(ext, ".jpe"))
-      return "image/jpeg";
-    if (iequals(ext, ".jpeg"))
-      return "image/jpeg";
-    if (iequals(ext, ".jpg"))
-      return "image/jpeg";
-    if (iequals(ext, ".gif"))
-      return "image/gif";
-    if (iequals(ext, ".bmp"))
-      return "image/bmp";
-    if (iequals(ext, ".ico"))
-      return "image/vnd.microsoft.icon";
-    if (iequals(ext, ".tiff"))
-      return "image/tiff";
-    if (iequals(ext, ".tif"))
-      return "image/tiff";
-    if (iequals(ext, ".svg"))
-      return "image/svg+xml";
-    if (iequals(ext, ".svgz"))
-      return "image/svg+xml";
-    if (iequals(ext, ".wasm"))
-      return "application/wasm";
-    return "application/text";
-  }
-
   template <typename TCallback>
   void GetSocket(TCallback&& callback) {
     socket_.dispatch([
@@ -453,11 +934,55 @@ class WebServerSocket : public std::enable_shared_from_this<
     close_callback_ = close_callback;
   }
 
+  void SetCompressionOptions(const CompressionOptions& compression_options) {
+    compression_options_ = compression_options;
+  }
+
+  // Whether messages could be compressed if the client negotiates it
+  bool IsCompressionEnabled() const {
+    return compression_options_.enabled;
+  }
+
+  void SetAdmissionControl(const AdmissionControl& admission_control) {
+    admission_control_ = &admission_control;
+  }
+
+  // Connections are encrypted when a context is given
+  void SetTlsContext(SSL_CTX* tls_context) {
+    tls_context_ = tls_context;
+  }
+
+  // Expect a PROXY protocol header before anything else
+  void SetProxyProtocol(bool proxy_protocol) {
+    proxy_protocol_ = proxy_protocol;
+  }
+
+  // An estimate of the heap memory owned by this connection.
+  // Can be called from any thread.
+  virtual std::size_t GetMemoryUsage() const {
+    return sizeof(WebServerSocket)
+           + (has_http_state_ ? sizeof(HttpState) : 0);
+  }
+
+  bool IsHttpPhase() const {
+    return has_http_state_;
+  }
+
  protected:
   virtual void OnPreConnect() {
     socket_.dispatch([this, self=this->shared_from_this()](auto& sockets) {
+      if (compression_options_.enabled) {
+        auto permessage_deflate = beast::websocket::permessage_deflate();
+        permessage_deflate.server_enable = true;
+        permessage_deflate.server_max_window_bits =
+          compression_options_.window_bits;
+        permessage_deflate.client_max_window_bits =
+          compression_options_.window_bits;
+        permessage_deflate.memLevel = compression_options_.mem_level;
+        sockets.websocket.set_option(permessage_deflate);
+      }
       sockets.websocket.async_accept_ex(
-        parser_.get(),
+        http_state_->parser.get(),
         [](beast::websocket::response_type& res) {
           res.set(beast::http::field::server,
                   "collab-vm-server");
@@ -465,6 +990,9 @@ class WebServerSocket : public std::enable_shared_from_this<
         socket_.wrap([this, self = std::move(self)](
             auto& sockets,
             const boost::system::error_code ec) mutable {
+          // The HTTP state isn't needed once the handshake is over
+          http_state_.reset();
+          has_http_state_ = false;
           if (ec) {
             Close();
             return;
@@ -480,53 +1008,216 @@ class WebServerSocket : public std::enable_shared_from_this<
   virtual void OnMessage(std::shared_ptr<MessageBuffer>&& buffer) = 0;
   virtual void OnDisconnect() = 0;
 
+  // Creates a strand that moves with the connection
+  ConnectionStrand CreateStrand() const {
+    return ConnectionStrand(ConnectionExecutor(context_));
+  }
+
+  // Called before the connection is moved to another io_context. The
+  // callback must be called once nothing is being written to the socket,
+  // and nothing else may be written until ResumeWrites() is called.
+  virtual void PauseWrites(std::function<void()>&& callback) {
+    callback();
+  }
+  virtual void ResumeWrites() {}
+
+  using UploadCallback = std::function<void(
+    std::shared_ptr<FileUploadReader>&&, boost::system::error_code)>;
+  // Called when a file is POSTed to /upload. The callback accepts the
+  // upload when it's given a reader, or rejects it with an error.
+  virtual void OnUploadRequest(std::string&& target,
+                               std::uint64_t content_length,
+                               UploadCallback&& callback) {
+    callback(nullptr, UploadErrorCode::kUploadsDisabled);
+  }
+  // Called after each chunk of an upload has been written. The callback
+  // should be given how long to wait before reading the next chunk.
+  virtual void OnUploadProgress(
+      std::size_t bytes,
+      std::function<void(std::chrono::steady_clock::duration)>&& callback) {
+    callback({});
+  }
+
  private:
+  void Move(std::shared_ptr<WebServerSocket>&& self) {
+    auto& io_context = *std::exchange(move_target_, nullptr);
+    if (&GetIoContext() == &io_context) {
+      CreateMessageBuffer()->StartRead(std::move(self));
+      return;
+    }
+    PauseWrites([this, self = std::move(self), &io_context]() mutable {
+      socket_.dispatch([this, self = std::move(self), &io_context](
+          auto& sockets) mutable {
+        if (!sockets.socket.is_open()) {
+          return;
+        }
+        auto ec = boost::system::error_code();
+        sockets.stream.MoveTo(io_context, ec);
+        if (ec) {
+          Close();
+          return;
+        }
+        // Handlers that are already queued on the strands follow them to
+        // the new io_context
+        context_->MoveTo(io_context);
+        // Timers are bound to an io_context, so they're re-created. Uploads
+        // can't be throttled here because the HTTP state is freed after the
+        // WebSocket upgrade.
+        request_deadline_ =
+          asio::steady_timer(io_context, request_deadline_.expiry());
+        if (http_state_ && http_state_->upload) {
+          http_state_->upload->timer = asio::steady_timer(io_context);
+        }
+        GetMovedConnectionsCounter()++;
+        ResumeWrites();
+        CreateMessageBuffer()->StartRead(std::move(self));
+      });
+    });
+  }
+
+  static std::atomic<std::uint64_t>& GetMovedConnectionsCounter() {
+    static auto moved_connections = std::atomic<std::uint64_t>(0);
+    return moved_connections;
+  }
+
   struct SocketsWrapper {
     SocketsWrapper(boost::asio::io_context& io_context)
-        : socket(io_context), websocket(socket) {}
+        : socket(io_context), stream(socket), websocket(stream) {}
     SocketsWrapper(const SocketsWrapper& io_context) = delete;
-    asio::ip::tcp::socket socket;
-    beast::websocket::stream<asio::ip::tcp::socket&> websocket;
-    // asio::ssl::stream<asio::ip::tcp::socket&> stream_;
+    StreamSocket socket;
+    TlsStream stream;
+    WebSocketStream websocket;
   };
 
-  StrandGuard<boost::asio::io_context::strand, SocketsWrapper> socket_;
-
-  beast::flat_static_buffer<8192> buffer_;
+  std::shared_ptr<ConnectionContext> context_;
+  StrandGuard<ConnectionStrand, SocketsWrapper> socket_;
+  // Only accessed from the socket_ strand
+  asio::io_context* move_target_ = nullptr;
 
   boost::asio::steady_timer request_deadline_;
+  // Beast's default body limit for requests
+  constexpr static auto max_body_size = std::uint64_t(1024 * 1024);
+
+  struct FileTransfer {
+    // Large enough to keep the socket busy without hogging a pool thread
+    constexpr static auto max_chunk_size = std::size_t(1024 * 1024);
+
+    FileTransfer() = default;
+    FileTransfer(const FileTransfer&) = delete;
+#ifdef __linux__
+    ~FileTransfer() {
+      if (socket_fd != -1) {
+        ::close(socket_fd);
+      }
+    }
+#endif
+
+    beast::file file;
+    std::uint64_t offset = 0;
+    std::uint64_t size = 0;
+#ifdef __linux__
+    // Only used by sendfile()
+    int socket_fd = -1;
+    TlsStream* stream = nullptr;
+#endif
+    std::unique_ptr<char[]> buffer;
+  };
 
-  std::variant<beast::http::response<beast::http::string_body>,
-               beast::http::response<beast::http::file_body>>
-      response_;
+  struct Upload {
+    template<typename TExecutor>
+    Upload(const TExecutor& executor,
+           beast::http::request_parser<beast::http::empty_body>&& header_parser,
+           std::shared_ptr<FileUploadReader>&& reader)
+        : parser(std::move(header_parser)),
+          reader(std::move(reader)),
+          timer(executor) {
+      // The reader enforces the Content-Length instead
+      parser.body_limit((std::numeric_limits<std::uint64_t>::max)());
+    }
 
-  std::variant<
-      std::monostate,
-      beast::http::response_serializer<beast::http::string_body>,
-      beast::http::response_serializer<beast::http::file_body>>
-      serializer_;
+    beast::http::request_parser<beast::http::buffer_body> parser;
+    std::shared_ptr<FileUploadReader> reader;
+    // Used to throttle uploads that exceed their quota
+    asio::steady_timer timer;
+    std::array<char, 64 * 1024> buffer;
+  };
 
-  using request_body_t =
-      beast::http::basic_dynamic_body<beast::flat_static_buffer<1024 * 1024>>;
-  beast::http::request_parser<request_body_t> parser_;
+  // Everything needed to serve plain HTTP requests. It is allocated when
+  // the first request is read and freed after the WebSocket upgrade, so
+  // idle WebSocket connections don't carry it around.
+  struct HttpState {
+    beast::flat_static_buffer<8192> buffer;
+
+    std::variant<beast::http::response<beast::http::string_body>,
+                 beast::http::response<beast::http::empty_body>,
+                 beast::http::response<beast::http::span_body<const char>>>
+        response;
+
+    std::variant<
+        std::monostate,
+        beast::http::response_serializer<beast::http::string_body>,
+        beast::http::response_serializer<beast::http::empty_body>,
+        beast::http::response_serializer<beast::http::span_body<const char>>>
+        serializer;
+
+    std::shared_ptr<const StaticFileCache::File> file;
+    std::optional<FileTransfer> file_transfer;
+    std::unique_ptr<Upload> upload;
+
+    // Only headers are ever read, so the request body is never stored
+    beast::http::request_parser<beast::http::empty_body> parser;
+  };
+  std::unique_ptr<HttpState> http_state_;
+  std::atomic<bool> has_http_state_ = false;
 
-  const std::filesystem::path& doc_root_;
+  StaticFileCache& file_cache_;
   IpAddress ip_address_;
 
   std::function<void()> close_callback_;
+  CompressionOptions compression_options_;
+  SSL_CTX* tls_context_ = nullptr;
+  bool proxy_protocol_ = false;
+  const AdmissionControl* admission_control_ = nullptr;
+};
+
+struct ServerOptions {
+  // Give each worker thread its own io_context and SO_REUSEPORT
+  // acceptors so the kernel spreads new connections across them
+  bool reuse_port = false;
+  // With reuse_port, the number of threads that run the shared context used
+  // by the VMs and server state, zero uses the same number as the shards
+  unsigned shared_threads = 0;
+  // Move connections to the shared context when they join a VM's channel
+  bool channel_affinity = false;
+  CompressionOptions compression;
+  // Paths to PEM files, TLS is only used when a certificate is given.
+  // The private key can be omitted if it's in the certificate file.
+  std::string tls_certificate;
+  std::string tls_private_key;
+  AdmissionOptions admission;
+  // Expect connections to start with a PROXY protocol v2 header, which is
+  // where the client's address is taken from
+  bool proxy_protocol = false;
+  SendQueueOptions send_queue;
+  // Mouse movements sent to a VM less than this long after the last one
+  // are held until the window ends, and only the latest is sent
+  std::chrono::milliseconds input_coalesce_window = std::chrono::milliseconds(10);
+  // When changes to a channel's user list are sent
+  UserListBatchOptions user_list_batching;
 };
 
 class WebServer {
  public:
   WebServer(const std::string& doc_root)
-      : sockets_(io_context_),
-        acceptor_(io_context_),
-        doc_root_(doc_root),
-        interrupt_signal_(io_context_, SIGINT, SIGTERM) {}
+      : doc_root_(doc_root),
+        interrupt_signal_(io_context_, SIGINT, SIGTERM),
+        report_signal_(io_context_),
+        file_cache_(io_context_) {}
 
   void Start(std::uint8_t threads,
              const std::string& host,
-             const std::uint16_t port) {
+             const std::uint16_t port,
+             const ServerOptions& options = ServerOptions()) {
                {
     auto ec = std::error_code();
     CreateDocRoot(doc_root_, ec);
@@ -534,70 +1225,234 @@ class WebServer {
       return;
     }
                }
+    file_cache_.SetDocRoot(doc_root_);
 
     interrupt_signal_.async_wait([this](const auto error,
                                         const auto signal_number) { Stop(); });
+#ifdef SIGUSR1
+    report_signal_.add(SIGUSR1);
+    WaitForReportSignal();
+#endif
 
-    auto resolver = asio::ip::tcp::resolver(io_context_);
+    // Each endpoint and how it is printed
+    auto endpoints = std::vector<std::pair<Endpoint, std::string>>();
     auto error_code = boost::system::error_code();
-    auto resolver_results = resolver.resolve(host, std::to_string(port), error_code);
-    if (error_code || resolver_results.empty()) {
-      std::cout << "Could not resolve hostname \"" << host << "\"\n";
-      std::cout << error_code.message() << std::endl;
+    constexpr auto unix_prefix = std::string_view("unix:");
+    if (host.compare(0, unix_prefix.size(), unix_prefix) == 0) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+      const auto path = host.substr(unix_prefix.size());
+      // Remove the socket left behind by a previous instance
+      auto remove_error = std::error_code();
+      if (std::filesystem::is_socket(path, remove_error)) {
+        std::filesystem::remove(path, remove_error);
+      }
+      endpoints.emplace_back(asio::local::stream_protocol::endpoint(path), host);
+#else
+      std::cout << "Unix domain sockets are not supported on this platform"
+                << std::endl;
       return;
+#endif
+    } else {
+      auto resolver = asio::ip::tcp::resolver(io_context_);
+      auto resolver_results = resolver.resolve(host, std::to_string(port), error_code);
+      if (error_code || resolver_results.empty()) {
+        std::cout << "Could not resolve hostname \"" << host << "\"\n";
+        std::cout << error_code.message() << std::endl;
+        return;
+      }
+      for (auto&& entry : resolver_results) {
+        auto name = std::ostringstream();
+        name << entry.endpoint();
+        endpoints.emplace_back(entry.endpoint(), name.str());
+      }
     }
 
-    // TODO: Listen on all resolved endpoints
-    const auto endpoint = asio::ip::tcp::endpoint(*resolver_results.begin());
-
-    try {
-      acceptor_.open(endpoint.protocol());
-      acceptor_.bind(endpoint);
-      acceptor_.listen();
+    if (options.compression.enabled
+        && !SupportsPerMessageCompression<WebSocketStream>::value) {
+      // Compressing every message would waste CPU on images
+      std::cout << "This version of Beast can't choose which messages to "
+                   "compress, permessage-deflate is not supported" << std::endl;
+      std::cout << "Failed to start server" << std::endl;
+      return;
+    }
+    compression_options_ = options.compression;
+    proxy_protocol_ = options.proxy_protocol;
 
-      std::cout << "Listening on " << acceptor_.local_endpoint() << std::endl;
+    if (!options.tls_certificate.empty()) {
+      auto& tls_context = tls_context_.emplace(asio::ssl::context::tls_server);
+      auto ec = boost::system::error_code();
+      ConfigureTlsContext(tls_context, options.tls_certificate,
+                          options.tls_private_key, ec);
+      if (ec) {
+        std::cout << "Failed to load TLS certificate \""
+                  << options.tls_certificate << "\"\n";
+        std::cout << ec.message() << std::endl;
+        return;
+      }
+    }
 
-      DoAccept();
+    auto reuse_port = options.reuse_port;
+#ifndef SO_REUSEPORT
+    if (reuse_port) {
+      std::cout << "SO_REUSEPORT is not supported on this platform, "
+                   "using a single listener" << std::endl;
+      reuse_port = false;
+    }
+#endif
 
-      // Decrement because the current thread will also become a worker
-      --threads;
-      std::vector<std::thread> threads_;
-      threads_.reserve(threads);
+    if (reuse_port) {
+      // Each shard is run by exactly one thread
       for (auto i = 0u; i < threads; i++) {
-        threads_.emplace_back([&] { io_context_.run(); });
+        auto& io_context = *shard_contexts_.emplace_back(
+          std::make_unique<asio::io_context>(1));
+        shards_.emplace_back(io_context);
       }
-
-      io_context_.run();
-
-      for (auto&& thread : threads_) {
-        thread.join();
+    } else {
+      shards_.emplace_back(io_context_);
+    }
+    admission_control_.SetOptions(options.admission);
+    // The shared context is counted after the shards when it has its own
+    // threads
+    admission_control_.SetEventLoopCount(
+      reuse_port ? shards_.size() + 1 : shards_.size());
+
+    for (const auto& [endpoint, name] : endpoints) {
+      auto& listener = listeners_.emplace_back();
+      try {
+        if (ToTcpEndpoint(endpoint)) {
+          for (auto& shard : shards_) {
+            Listen(shard, listener, endpoint, reuse_port,
+                   options.admission.backlog);
+          }
+        } else {
+          // Only one socket can be bound to a path
+          Listen(shards_.front(), listener, endpoint, false,
+                 options.admission.backlog);
+        }
+        std::cout << "Listening on " << name << std::endl;
+      } catch (const boost::system::system_error& exception) {
+        std::cout << "Failed to listen on " << name << '\n';
+        std::cout << exception.what() << std::endl;
+        error_code = exception.code();
+        for (auto& shard : shards_) {
+          if (!shard.acceptors.empty()
+              && &shard.acceptors.back().listener == &listener) {
+            shard.acceptors.pop_back();
+          }
+        }
+        listeners_.pop_back();
       }
-    } catch (const boost::system::system_error& exception) {
-      std::cout << "Failed to start server\n";
-      std::cout << exception.what() << std::endl;
-      error_code = exception.code();
+    }
+
+    if (listeners_.empty()) {
+      std::cout << "Failed to start server" << std::endl;
       if (port < 1024
           && error_code.category() == boost::asio::error::get_system_category()
           && error_code.value() == EACCES) {
         std::cout << "Elevated permissions may be required to listen on ports below 1024" << std::endl;
       }
+      shards_.clear();
+      return;
+    }
+
+    auto shard_index = std::size_t(0);
+    for (auto& shard : shards_) {
+      shard.index = shard_index++;
+      MonitorLag(shard);
+      for (auto& acceptor : shard.acceptors) {
+        DoAccept(shard, acceptor);
+      }
+    }
+    if (reuse_port) {
+      // The shared context doesn't accept connections, but the VMs and
+      // server state that run on it can fall behind too
+      auto& shared_shard = shared_shard_.emplace(io_context_);
+      shared_shard.index = shards_.size();
+      MonitorLag(shared_shard);
+    }
+
+    auto threads_ = std::vector<std::thread>();
+    if (reuse_port) {
+      // The shared context used by the VMs and server state gets its own
+      // threads, the current thread is one of them
+      const auto shared_threads = std::max(
+        options.shared_threads ? options.shared_threads : threads, 1u);
+      threads_.reserve(shard_contexts_.size() + shared_threads - 1);
+      for (auto& io_context : shard_contexts_) {
+        threads_.emplace_back([&io_context] { io_context->run(); });
+      }
+      for (auto i = 1u; i < shared_threads; i++) {
+        threads_.emplace_back([&] { io_context_.run(); });
+      }
+    } else {
+      // Start at one because the current thread will also become a worker
+      threads_.reserve(threads);
+      for (auto i = 1u; i < threads; i++) {
+        threads_.emplace_back([&] { io_context_.run(); });
+      }
+    }
+
+    io_context_.run();
+
+    for (auto&& thread : threads_) {
+      thread.join();
     }
   }
 
   virtual void Stop() {
     auto ec = boost::system::error_code();
     interrupt_signal_.cancel(ec);
-    acceptor_.close(ec);
+    report_signal_.cancel(ec);
+    file_cache_.Close();
+
+    // Connections are closed once no shard can accept any more
+    auto shards_remaining =
+      std::make_shared<std::atomic<std::size_t>>(shards_.size());
+    for (auto& shard : shards_) {
+      shard.strand.dispatch([this, &shard, shards_remaining] {
+        if (shard.stopping) {
+          return;
+        }
+        shard.stopping = true;
+        auto ec = boost::system::error_code();
+        shard.lag_timer.cancel(ec);
+        for (auto& acceptor : shard.acceptors) {
+          acceptor.acceptor.close(ec);
+        }
+        if (--*shards_remaining == 0) {
+          CloseConnections();
+        }
+      });
+    }
+    if (shared_shard_) {
+      shared_shard_->strand.dispatch([this] {
+        shared_shard_->stopping = true;
+        auto ec = boost::system::error_code();
+        shared_shard_->lag_timer.cancel(ec);
+      });
+    }
+  }
 
-    sockets_.dispatch([this](auto& sockets) {
-      if (stopping_) {
-        return;
-      }
-      stopping_ = true;
-      for (auto&& socket : sockets) {
-        socket->Close();
+  // Prints the number of open connections and an estimate of how much
+  // memory they use
+  virtual void ReportMemoryUsage() {
+    auto connections = std::size_t(0);
+    auto http_connections = std::size_t(0);
+    auto bytes = std::size_t(0);
+    connections_.ForEach([&](auto& socket) {
+      connections++;
+      if (socket->IsHttpPhase()) {
+        http_connections++;
       }
+      bytes += socket->GetMemoryUsage();
     });
+    std::cout << "Connections: " << connections
+              << " (" << http_connections << " HTTP), memory: "
+              << bytes / 1024 << " KiB";
+    if (connections) {
+      std::cout << ", " << bytes / connections << " bytes per connection";
+    }
+    std::cout << std::endl;
   }
 
   boost::asio::io_context& GetContext() {
@@ -609,9 +1464,73 @@ class WebServer {
 
   virtual std::shared_ptr<TSocket> CreateSocket(
       boost::asio::io_context& io_context,
-      const std::filesystem::path& doc_root) = 0;
+      StaticFileCache& file_cache) = 0;
+
+  template<typename TCallback>
+  void ForEachConnection(TCallback&& callback) {
+    connections_.ForEach(std::forward<TCallback>(callback));
+  }
 
  private:
+#ifdef SO_REUSEPORT
+  using reuse_port_option =
+    asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+  // A TCP or Unix domain socket endpoint
+  using Endpoint = asio::generic::stream_protocol::endpoint;
+
+  // An endpoint being listened on, each shard has its own acceptor for it
+  struct Listener {
+    std::atomic<std::size_t> connections = 0;
+  };
+
+  struct Acceptor {
+    Acceptor(asio::io_context& io_context, Listener& listener)
+      : acceptor(io_context), listener(listener) {}
+
+    asio::basic_socket_acceptor<asio::generic::stream_protocol> acceptor;
+    Listener& listener;
+  };
+
+  struct Shard {
+    explicit Shard(asio::io_context& io_context)
+      : io_context(io_context), strand(io_context), lag_timer(io_context) {}
+    Shard(const Shard&) = delete;
+
+    asio::io_context& io_context;
+    std::list<Acceptor> acceptors;
+    // Serializes accepting with Stop()
+    asio::io_context::strand strand;
+    bool stopping = false;
+    std::size_t index = 0;
+    asio::steady_timer lag_timer;
+  };
+
+  constexpr static auto lag_sample_interval = std::chrono::milliseconds(100);
+
+  static void Listen(Shard& shard,
+                     Listener& listener,
+                     const Endpoint& endpoint,
+                     const bool reuse_port,
+                     const int backlog) {
+    auto& acceptor =
+      shard.acceptors.emplace_back(shard.io_context, listener).acceptor;
+    try {
+      acceptor.open(endpoint.protocol());
+#ifdef SO_REUSEPORT
+      if (reuse_port) {
+        acceptor.set_option(reuse_port_option(true));
+      }
+#endif
+      acceptor.bind(endpoint);
+      acceptor.listen(backlog);
+    } catch (const boost::system::system_error&) {
+      shard.acceptors.pop_back();
+      throw;
+    }
+  }
+
   static void CreateDocRoot(std::filesystem::path& path,
                             std::error_code& ec) {
     auto status = std::filesystem::status(path, ec);
@@ -640,48 +1559,108 @@ class WebServer {
     }
   }
 
-  void DoAccept() {
-    sockets_.dispatch([this](auto& sockets) {
-      if (stopping_) {
+  void DoAccept(Shard& shard, Acceptor& acceptor) {
+    shard.strand.dispatch([this, &shard, &acceptor] {
+      if (shard.stopping) {
         return;
       }
-      const auto socket_ptr = sockets.emplace_front(
-          CreateSocket(io_context_, doc_root_));
-      const auto socket_it = sockets.cbegin();
+      const auto socket_ptr = CreateSocket(shard.io_context, file_cache_);
+      const auto handle = connections_.Insert(socket_ptr);
+      // Only connections that were admitted are counted
+      auto admitted = std::make_shared<std::atomic<bool>>(false);
       socket_ptr->SetCloseCallback(
-          [this, socket_it] { RemoveSocket(socket_it); });
+          [this, handle, &listener = acceptor.listener, admitted] {
+            connections_.Remove(handle);
+            if (*admitted) {
+              admission_control_.Release(listener.connections);
+            }
+          });
+      socket_ptr->SetCompressionOptions(compression_options_);
+      socket_ptr->SetAdmissionControl(admission_control_);
+      socket_ptr->SetProxyProtocol(proxy_protocol_);
+      if (tls_context_) {
+        socket_ptr->SetTlsContext(tls_context_->native_handle());
+      }
 
-      socket_ptr->GetSocket([this, socket_ptr](auto& socket) {
-        acceptor_.async_accept(
+      socket_ptr->GetSocket([this, &shard, &acceptor, socket_ptr,
+                             admitted = std::move(admitted)](auto& socket) {
+        acceptor.acceptor.async_accept(
             socket,
-            [this, socket_ptr](const boost::system::error_code ec) {
-              if (ec || !acceptor_.is_open()) {
+            [this, &shard, &acceptor, socket_ptr, admitted = std::move(admitted)](
+                const boost::system::error_code ec) {
+              if (ec || !acceptor.acceptor.is_open()) {
                 socket_ptr->Close();
                 return;
               }
-              socket_ptr->Start();
-              DoAccept();
+              // Over the limits the connection is closed before anything
+              // is read from it
+              *admitted = admission_control_.TryAdmit(acceptor.listener.connections);
+              if (*admitted) {
+                socket_ptr->Start();
+              } else {
+                socket_ptr->Close();
+              }
+              DoAccept(shard, acceptor);
             });
       });
     });
   }
 
-  void RemoveSocket(
-      typename std::list<std::shared_ptr<TSocket>>::const_iterator it) {
-    sockets_.dispatch([this, it](auto& sockets) {
-      if (!stopping_) {
-        sockets.erase(it);
+  // Measures how late a timer fires to tell how far behind the shard's
+  // event loop is running
+  void MonitorLag(Shard& shard) {
+    shard.lag_timer.expires_after(lag_sample_interval);
+    shard.lag_timer.async_wait(asio::bind_executor(shard.strand,
+      [this, &shard](const boost::system::error_code ec) {
+        if (ec || shard.stopping) {
+          return;
+        }
+        admission_control_.ReportLag(
+          shard.index,
+          std::chrono::steady_clock::now() - shard.lag_timer.expiry());
+        MonitorLag(shard);
+      }));
+  }
+
+  // Each partition of the connection table is closed by a different
+  // thread so shutting down doesn't wait on a single one
+  void CloseConnections() {
+    auto shard = shards_.begin();
+    for (auto i = std::size_t(0); i < connections_.GetPartitionCount(); i++) {
+      asio::post(shard->io_context, [this, i] {
+        connections_.ForEach(i, [](auto& socket) { socket->Close(); });
+      });
+      if (++shard == shards_.end()) {
+        shard = shards_.begin();
       }
-    });
+    }
   }
 
-  bool stopping_ = false;
-  StrandGuard<
-    boost::asio::io_context::strand,
-    std::list<std::shared_ptr<TSocket>>> sockets_;
+  void WaitForReportSignal() {
+    report_signal_.async_wait([this](const auto error, const auto signal_number) {
+      if (error) {
+        return;
+      }
+      ReportMemoryUsage();
+      WaitForReportSignal();
+    });
+  }
 
-  boost::asio::ip::tcp::acceptor acceptor_;
+  std::vector<std::unique_ptr<boost::asio::io_context>> shard_contexts_;
+  std::list<Shard> shards_;
+  // Only used to monitor the lag of io_context_ when the shards have their
+  // own io_contexts
+  std::optional<Shard> shared_shard_;
+  std::list<Listener> listeners_;
+  ConnectionSlab<std::shared_ptr<TSocket>> connections_;
+  AdmissionControl admission_control_;
   std::filesystem::path doc_root_;
+  CompressionOptions compression_options_;
+  bool proxy_protocol_ = false;
+  // Shared by every listener so sessions can be resumed on any of them
+  std::optional<asio::ssl::context> tls_context_;
   boost::asio::signal_set interrupt_signal_;
+  boost::asio::signal_set report_signal_;
+  StaticFileCache file_cache_;
 };
 }  // namespace CollabVm::Server
@@ -0,0 +1,148 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include "ChannelUsers.hpp"
+
+struct UserData {
+  std::string username;
+  bool admin;
+
+  bool IsAdmin() const {
+    return admin;
+  }
+};
+using User = std::shared_ptr<int>;
+using Users = CollabVm::Server::ChannelUsers<User, UserData>;
+
+// Checks that the admins come first and every user can be found both ways,
+// users who share a username can be found as any of them
+static bool IsConsistent(const Users& users) {
+  auto count = std::size_t(0);
+  for (const auto& [user, user_data] : users.GetAdmins()) {
+    if (!user_data.IsAdmin()) {
+      return false;
+    }
+    count++;
+  }
+  for (const auto& [user, user_data] : users.GetRegularUsers()) {
+    if (user_data.IsAdmin()) {
+      return false;
+    }
+    count++;
+  }
+  for (const auto& slot : users) {
+    const auto found = users.FindByUsername(slot.data.username);
+    if (users.Find(slot.user) != &slot.data || !found
+        || found->data.username != slot.data.username) {
+      return false;
+    }
+  }
+  return count == users.size();
+}
+
+static bool TestInsertAndErase() {
+  auto users = Users();
+  const auto first = std::make_shared<int>(1);
+  const auto second = std::make_shared<int>(2);
+  const auto third = std::make_shared<int>(3);
+  const auto fourth = std::make_shared<int>(4);
+  users.Insert(first, {"first", false});
+  users.Insert(second, {"second", true});
+  users.Insert(third, {"third", false});
+  if (users.Insert(third, {"third", false})) {
+    std::cout << "A user was added twice" << std::endl;
+    return false;
+  }
+  users.Insert(fourth, {"fourth", true});
+  if (users.size() != 4 || !IsConsistent(users)) {
+    std::cout << "Users weren't grouped by role after being added" << std::endl;
+    return false;
+  }
+  if (!users.Erase(second) || users.Erase(second)) {
+    std::cout << "An admin couldn't be removed exactly once" << std::endl;
+    return false;
+  }
+  if (users.Find(second) || users.FindByUsername("second")
+      || users.size() != 3 || !IsConsistent(users)) {
+    std::cout << "Users weren't moved correctly after removing an admin"
+              << std::endl;
+    return false;
+  }
+  users.Erase(first);
+  users.Erase(fourth);
+  if (users.size() != 1 || !IsConsistent(users)) {
+    std::cout << "Users weren't moved correctly after removing users"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestUpdate() {
+  auto users = Users();
+  const auto first = std::make_shared<int>(1);
+  const auto second = std::make_shared<int>(2);
+  users.Insert(first, {"first", false});
+  users.Insert(second, {"second", false});
+  users.Update(first, [](auto& user_data) {
+    user_data.username = "renamed";
+    user_data.admin = true;
+  });
+  if (users.FindByUsername("first") || !users.FindByUsername("renamed")
+      || users.GetAdmins().begin()->user != first || !IsConsistent(users)) {
+    std::cout << "A user's name and role weren't updated" << std::endl;
+    return false;
+  }
+  users.Update(first, [](auto& user_data) { user_data.admin = false; });
+  if (users.GetAdmins().begin() != users.GetAdmins().end()
+      || !IsConsistent(users)) {
+    std::cout << "A user wasn't moved after losing their role" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// One account can be logged in on several sockets
+static bool TestSharedUsername() {
+  auto users = Users();
+  const auto first = std::make_shared<int>(1);
+  const auto second = std::make_shared<int>(2);
+  const auto third = std::make_shared<int>(3);
+  users.Insert(first, {"shared", false});
+  users.Insert(third, {"third", false});
+  users.Insert(second, {"shared", true});
+  if (!IsConsistent(users)) {
+    std::cout << "Users who share a username weren't added" << std::endl;
+    return false;
+  }
+  users.Erase(first);
+  const auto found = users.FindByUsername("shared");
+  if (!found || found->user != second || !IsConsistent(users)) {
+    std::cout << "Removing a user removed another with the same username"
+              << std::endl;
+    return false;
+  }
+  users.Insert(first, {"shared", false});
+  users.Update(second, [](auto& user_data) {
+    user_data.username = "renamed";
+    user_data.admin = false;
+  });
+  if (!users.FindByUsername("shared") || !users.FindByUsername("renamed")
+      || users.FindByUsername("shared")->user != first
+      || !IsConsistent(users)) {
+    std::cout << "Renaming a user renamed another with the same username"
+              << std::endl;
+    return false;
+  }
+  users.Erase(first);
+  if (users.FindByUsername("shared") || !IsConsistent(users)) {
+    std::cout << "A username was kept after all of its users were removed"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  return !(TestInsertAndErase() && TestUpdate() && TestSharedUsername());
+}
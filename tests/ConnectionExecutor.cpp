@@ -0,0 +1,107 @@
+#include <boost/asio.hpp>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "ConnectionExecutor.hpp"
+
+using CollabVm::Server::ConnectionContext;
+using CollabVm::Server::ConnectionExecutor;
+using CollabVm::Server::ConnectionStrand;
+
+static bool TestInlineDispatch() {
+  auto io_context = boost::asio::io_context();
+  auto strand = ConnectionStrand(ConnectionExecutor(
+    std::make_shared<ConnectionContext>(io_context)));
+  auto ran_inline = false;
+  boost::asio::post(io_context, [&] {
+    auto ran = false;
+    boost::asio::dispatch(strand, [&] { ran = true; });
+    ran_inline = ran;
+  });
+  io_context.run();
+  if (!ran_inline) {
+    std::cout << "An idle strand wasn't run inline from its io_context"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestMove() {
+  auto old_context = boost::asio::io_context();
+  auto new_context = boost::asio::io_context();
+  auto context = std::make_shared<ConnectionContext>(old_context);
+  auto strand = ConnectionStrand(ConnectionExecutor(context));
+  auto messages = std::vector<std::pair<int, boost::asio::io_context*>>();
+  const auto queue = [&](int message) {
+    boost::asio::dispatch(strand, [&, message] {
+      auto& io_context =
+        old_context.get_executor().running_in_this_thread()
+          ? old_context : new_context;
+      messages.emplace_back(message, &io_context);
+    });
+  };
+  queue(1);
+  context->MoveTo(new_context);
+  // Waits behind the first message, which was already handed to the old
+  // io_context, and is then handed to the new one
+  queue(2);
+  if (new_context.poll() != 0) {
+    std::cout << "A strand that was already scheduled ran on the new io_context"
+              << std::endl;
+    return false;
+  }
+  old_context.run();
+  queue(3);
+  old_context.restart();
+  if (old_context.run() != 0) {
+    std::cout << "A strand was run on the old io_context after moving"
+              << std::endl;
+    return false;
+  }
+  new_context.restart();
+  new_context.run();
+  const auto expected = std::vector<std::pair<int, boost::asio::io_context*>>{
+    {1, &old_context}, {2, &new_context}, {3, &new_context}};
+  if (messages != expected) {
+    std::cout << "A strand didn't keep its order while moving" << std::endl;
+    return false;
+  }
+  if (&static_cast<boost::asio::io_context&>(strand.context()) != &new_context) {
+    std::cout << "A strand's io_context wasn't changed" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestMoveWork() {
+  auto old_context = boost::asio::io_context();
+  auto new_context = boost::asio::io_context();
+  auto context = std::make_shared<ConnectionContext>(old_context);
+  auto work = boost::asio::executor_work_guard<ConnectionExecutor>(
+    ConnectionExecutor(context));
+  context->MoveTo(new_context);
+  if (old_context.run() != 0 || !old_context.stopped()) {
+    std::cout << "The old io_context kept the work after moving" << std::endl;
+    return false;
+  }
+  new_context.run_for(std::chrono::milliseconds(10));
+  if (new_context.stopped()) {
+    std::cout << "The new io_context ran out of work while it was outstanding"
+              << std::endl;
+    return false;
+  }
+  work.reset();
+  new_context.run();
+  if (!new_context.stopped()) {
+    std::cout << "The new io_context kept running after the work finished"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  return TestInlineDispatch() && TestMove() && TestMoveWork() ? 0 : 1;
+}
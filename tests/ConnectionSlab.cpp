@@ -0,0 +1,70 @@
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "ConnectionSlab.hpp"
+
+int main() {
+  using CollabVm::Server::ConnectionSlab;
+  auto slab = ConnectionSlab<std::shared_ptr<int>>(4);
+
+  const auto first = slab.Insert(std::make_shared<int>(1));
+  const auto second = slab.Insert(std::make_shared<int>(2));
+  if (slab.GetSize() != 2) {
+    std::cout << "Expected two connections" << std::endl;
+    return 1;
+  }
+
+  const auto removed = slab.Remove(first);
+  if (!removed || *removed != 1) {
+    std::cout << "Removed the wrong connection" << std::endl;
+    return 1;
+  }
+
+  // The freed slot is reused, but the old handle must not remove the new value
+  const auto third = slab.Insert(std::make_shared<int>(3));
+  if (third.index != first.index || third.generation == first.generation) {
+    std::cout << "The freed slot wasn't reused" << std::endl;
+    return 1;
+  }
+  if (slab.Remove(first) || slab.GetSize() != 2) {
+    std::cout << "A stale handle removed a connection" << std::endl;
+    return 1;
+  }
+
+  auto sum = 0;
+  slab.ForEach([&sum](auto& value) { sum += *value; });
+  if (sum != 5) {
+    std::cout << "ForEach visited the wrong connections" << std::endl;
+    return 1;
+  }
+  slab.Remove(second);
+  slab.Remove(third);
+
+  // Concurrent inserts and removals from several threads
+  auto threads = std::vector<std::thread>();
+  for (auto i = 0; i < 8; i++) {
+    threads.emplace_back([&slab] {
+      auto handles = std::vector<ConnectionSlab<std::shared_ptr<int>>::Handle>();
+      for (auto j = 0; j < 10000; j++) {
+        handles.push_back(slab.Insert(std::make_shared<int>(j)));
+        if (j % 2) {
+          slab.Remove(handles.back());
+          handles.pop_back();
+        }
+      }
+      for (const auto& handle : handles) {
+        slab.Remove(handle);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (slab.GetSize() != 0) {
+    std::cout << "Connections were leaked" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
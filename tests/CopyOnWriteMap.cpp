@@ -0,0 +1,64 @@
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "CopyOnWriteMap.hpp"
+
+using Map = CollabVm::Server::CopyOnWriteMap<int, std::shared_ptr<int>>;
+
+static bool TestSnapshot() {
+  auto map = Map();
+  map.Update([](auto& map) { map.emplace(1, std::make_shared<int>(1)); });
+  const auto snapshot = map.Load();
+  map.Update([](auto& map) { map.erase(1); });
+  if (snapshot->size() != 1 || !snapshot->at(1)) {
+    std::cout << "A loaded snapshot was changed by an update" << std::endl;
+    return false;
+  }
+  if (map.Find(1) || map.Load()->size() != 0) {
+    std::cout << "An erased key was found" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestConcurrentReads() {
+  auto map = Map();
+  auto done = std::atomic<bool>(false);
+  auto invalid_reads = std::atomic<int>(0);
+  auto readers = std::vector<std::thread>();
+  for (auto i = 0; i < 4; i++) {
+    readers.emplace_back([&map, &done, &invalid_reads] {
+      while (!done) {
+        // Values are only ever equal to their keys
+        for (auto key = 0; key < 8; key++) {
+          if (const auto value = map.Find(key); value && *value != key) {
+            invalid_reads++;
+          }
+        }
+      }
+    });
+  }
+  for (auto i = 0; i < 10000; i++) {
+    const auto key = i % 8;
+    map.Update([key](auto& map) {
+      if (!map.erase(key)) {
+        map.emplace(key, std::make_shared<int>(key));
+      }
+    });
+  }
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  if (invalid_reads) {
+    std::cout << "A reader saw an invalid value" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  return TestSnapshot() && TestConcurrentReads() ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+#include <boost/asio.hpp>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "ConnectionExecutor.hpp"
+#include "FanOut.hpp"
+
+using CollabVm::Server::ConnectionContext;
+using CollabVm::Server::ConnectionExecutor;
+using CollabVm::Server::ConnectionStrand;
+
+// Records messages from its strand like a socket's send queue
+struct Recipient {
+  explicit Recipient(boost::asio::io_context& io_context)
+      : strand(ConnectionExecutor(
+          std::make_shared<ConnectionContext>(io_context))) {}
+
+  ConnectionStrand strand;
+  std::vector<int> messages;
+  bool received_in_context = true;
+
+  boost::asio::io_context& GetIoContext() {
+    return static_cast<boost::asio::io_context&>(strand.context());
+  }
+
+  void Queue(int message) {
+    boost::asio::dispatch(strand, [this, message] {
+      messages.push_back(message);
+      received_in_context = received_in_context
+        && GetIoContext().get_executor().running_in_this_thread();
+    });
+  }
+};
+
+using FanOut = CollabVm::Server::FanOut<Recipient>;
+
+static void Receive(Recipient& recipient) {
+  recipient.Queue(1);
+}
+
+static bool TestGroups() {
+  auto first_context = boost::asio::io_context();
+  auto second_context = boost::asio::io_context();
+  auto recipients = std::vector<std::shared_ptr<Recipient>>();
+  auto fan_out = FanOut();
+  for (auto i = 0; i < 10; i++) {
+    auto& context = i % 2 ? first_context : second_context;
+    recipients.push_back(std::make_shared<Recipient>(context));
+    fan_out.Add(recipients.back());
+  }
+  fan_out.Post(Receive);
+  fan_out.Post(Receive);
+  if (first_context.run() != 1 || second_context.run() != 1) {
+    std::cout << "Each io_context wasn't given one handler per broadcast"
+              << std::endl;
+    return false;
+  }
+  for (auto& recipient : recipients) {
+    if (recipient->messages.size() != 1 || !recipient->received_in_context) {
+      std::cout << "A recipient wasn't called once from its io_context"
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool TestLocalGroup() {
+  auto local_context = boost::asio::io_context();
+  auto other_context = boost::asio::io_context();
+  auto local_recipient = std::make_shared<Recipient>(local_context);
+  auto other_recipient = std::make_shared<Recipient>(other_context);
+  auto received_inline = false;
+  const auto stats = FanOut::GetStats();
+  boost::asio::post(local_context, [&] {
+    auto fan_out = FanOut();
+    fan_out.Add(local_recipient);
+    fan_out.Add(other_recipient);
+    fan_out.Post(Receive);
+    received_inline = local_recipient->messages.size() == 1;
+  });
+  if (local_context.run() != 1 || !received_inline) {
+    std::cout << "The caller's io_context wasn't handled inline" << std::endl;
+    return false;
+  }
+  other_context.run();
+  if (other_recipient->messages.size() != 1) {
+    std::cout << "Another io_context wasn't posted to" << std::endl;
+    return false;
+  }
+  const auto new_stats = FanOut::GetStats();
+  if (new_stats.local_recipients - stats.local_recipients != 1
+      || new_stats.remote_recipients - stats.remote_recipients != 1
+      || new_stats.handoffs - stats.handoffs != 1) {
+    std::cout << "Local and remote recipients weren't counted" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestOrderWithDirectSends() {
+  auto sender_context = boost::asio::io_context();
+  auto recipient_context = boost::asio::io_context();
+  auto recipient = std::make_shared<Recipient>(recipient_context);
+  // Keeps the strand busy so a broadcast that reached it late would be
+  // queued behind the direct send
+  recipient->Queue(0);
+  boost::asio::post(sender_context, [&] {
+    auto fan_out = FanOut();
+    fan_out.Add(recipient);
+    fan_out.Post([](auto& recipient) { recipient.Queue(1); });
+    recipient->Queue(2);
+  });
+  sender_context.run();
+  recipient_context.run();
+  if (recipient->messages != std::vector<int>{0, 1, 2}) {
+    std::cout << "A direct send overtook a broadcast" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  return TestGroups() && TestLocalGroup() && TestOrderWithDirectSends()
+    ? 0 : 1;
+}
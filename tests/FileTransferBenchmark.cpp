@@ -0,0 +1,177 @@
+// Measures how long WebSocket messages are delayed while large static files
+// are being downloaded from the same server.
+// Usage: file-transfer-benchmark [port] [downloaders] [file size in MiB]
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <thread>
+#include <vector>
+#include "WebSocketServer.hpp"
+
+using namespace CollabVm::Server;
+using Clock = std::chrono::steady_clock;
+
+constexpr auto frame_interval = std::chrono::milliseconds(5);
+constexpr auto phase_duration = std::chrono::seconds(5);
+
+// Sends its current time to the client every few milliseconds, like a VM
+// sending display updates
+class FrameSocket final : public WebServerSocket<WebServer> {
+ public:
+  FrameSocket(boost::asio::io_context& io_context, StaticFileCache& file_cache)
+      : WebServerSocket(io_context, file_cache), timer_(io_context) {}
+
+  class DiscardBuffer final : public MessageBuffer {
+    boost::beast::flat_buffer buffer;
+   public:
+    void StartRead(std::shared_ptr<WebServerSocket>&& socket) override {
+      socket->ReadWebSocketMessage(
+        std::move(socket),
+        std::static_pointer_cast<DiscardBuffer>(shared_from_this()));
+    }
+    auto& GetBuffer() { return buffer; }
+  };
+
+  std::shared_ptr<MessageBuffer> CreateMessageBuffer() override {
+    return std::make_shared<DiscardBuffer>();
+  }
+
+ private:
+  void OnConnect() override { SendFrame(); }
+  void OnMessage(std::shared_ptr<MessageBuffer>&&) override {}
+  void OnDisconnect() override { timer_.cancel(); }
+
+  void SendFrame() {
+    timer_.expires_after(frame_interval);
+    timer_.async_wait([this, self = shared_from_this()](const auto ec) {
+      if (ec) {
+        return;
+      }
+      timestamp_ = Clock::now().time_since_epoch().count();
+      WriteMessage(boost::asio::buffer(&timestamp_, sizeof(timestamp_)), false,
+                   [this, self](const auto ec, auto) {
+                     if (!ec) {
+                       SendFrame();
+                     }
+                   });
+    });
+  }
+
+  boost::asio::steady_timer timer_;
+  Clock::rep timestamp_;
+};
+
+class BenchmarkServer final : public WebServer {
+ public:
+  using WebServer::WebServer;
+
+ private:
+  std::shared_ptr<TSocket> CreateSocket(
+      boost::asio::io_context& io_context,
+      StaticFileCache& file_cache) override {
+    return std::make_shared<FrameSocket>(io_context, file_cache);
+  }
+};
+
+template <typename TPhase>
+void MeasureLatency(const char* name, const std::string& port, TPhase&& phase) {
+  namespace websocket = boost::beast::websocket;
+  auto io_context = boost::asio::io_context();
+  auto socket = boost::asio::ip::tcp::socket(io_context);
+  boost::asio::connect(socket, boost::asio::ip::tcp::resolver(io_context)
+                                 .resolve("127.0.0.1", port));
+  auto ws = websocket::stream<boost::asio::ip::tcp::socket&>(socket);
+  ws.handshake("127.0.0.1", "/");
+
+  auto done = std::atomic<bool>(false);
+  auto phase_thread = std::thread([&] { phase(done); });
+
+  auto latencies = std::vector<Clock::duration>();
+  const auto end = Clock::now() + phase_duration;
+  auto buffer = boost::beast::flat_buffer();
+  while (Clock::now() < end) {
+    ws.read(buffer);
+    auto timestamp = Clock::rep();
+    std::memcpy(&timestamp, buffer.data().data(), sizeof(timestamp));
+    buffer.consume(buffer.size());
+    // The server runs in this process, so both ends share the same clock
+    latencies.push_back(Clock::now() - Clock::time_point(Clock::duration(timestamp)));
+  }
+  done = true;
+  phase_thread.join();
+
+  std::sort(latencies.begin(), latencies.end());
+  const auto percentile = [&](double p) {
+    const auto latency = latencies[static_cast<std::size_t>(
+      p * (latencies.size() - 1))];
+    return std::chrono::duration<double, std::milli>(latency).count();
+  };
+  std::cout << name << ": " << latencies.size() << " frames, p50 "
+            << percentile(0.5) << " ms, p99 " << percentile(0.99)
+            << " ms, max " << percentile(1) << " ms" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  const auto port = argc > 1 ? argv[1] : "8099";
+  const auto downloaders = argc > 2 ? std::atoi(argv[2]) : 8;
+  const auto file_size = (argc > 3 ? std::atoi(argv[3]) : 64) * 1024 * 1024;
+
+  // Larger than StaticFileCache::max_file_size so it's streamed from disk
+  const auto doc_root =
+    std::filesystem::temp_directory_path() / "collab-vm-benchmark";
+  std::filesystem::create_directories(doc_root);
+  {
+    auto file = std::ofstream(doc_root / "bundle.js", std::ios::binary);
+    const auto chunk = std::string(1024 * 1024, 'x');
+    for (auto i = 0; i < file_size / static_cast<int>(chunk.size()); i++) {
+      file << chunk;
+    }
+  }
+
+  auto server = BenchmarkServer(doc_root.string());
+  auto server_thread = std::thread([&] {
+    server.Start(2, "127.0.0.1", std::atoi(port));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  MeasureLatency("Idle", port, [](auto& done) {});
+
+  auto bytes_downloaded = std::atomic<std::uint64_t>(0);
+  MeasureLatency("Downloading", port, [&](auto& done) {
+    auto threads = std::vector<std::thread>();
+    for (auto i = 0; i < downloaders; i++) {
+      threads.emplace_back([&] {
+        namespace http = boost::beast::http;
+        auto io_context = boost::asio::io_context();
+        auto socket = boost::asio::ip::tcp::socket(io_context);
+        boost::asio::connect(socket, boost::asio::ip::tcp::resolver(io_context)
+                                       .resolve("127.0.0.1", port));
+        auto request = http::request<http::empty_body>(http::verb::get,
+                                                       "/bundle.js", 11);
+        auto buffer = boost::beast::flat_buffer();
+        while (!done) {
+          http::write(socket, request);
+          auto parser = http::response_parser<http::string_body>();
+          parser.body_limit(std::numeric_limits<std::uint64_t>::max());
+          http::read(socket, buffer, parser);
+          bytes_downloaded += parser.get().body().size();
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  });
+  std::cout << "Downloaded " << bytes_downloaded / (1024 * 1024) << " MiB"
+            << std::endl;
+
+  server.Stop();
+  server_thread.join();
+  std::filesystem::remove_all(doc_root);
+}
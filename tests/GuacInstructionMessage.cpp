@@ -0,0 +1,72 @@
+#include <capnp/message.h>
+#include <capnp/pretty-print.h>
+#include <capnp/serialize.h>
+#include <boost/asio/buffer.hpp>
+#include <iostream>
+#include <vector>
+#include "CollabVm.capnp.h"
+#include "SocketMessage.hpp"
+
+using CollabVm::Server::SocketMessage;
+
+// The spliced message must read the same as one built with setGuacInstr()
+static bool ReadsLikeCopy(capnp::MallocMessageBuilder& instruction_builder) {
+  auto copy = capnp::MallocMessageBuilder();
+  copy.initRoot<CollabVmServerMessage>().initMessage().setGuacInstr(
+    instruction_builder.getRoot<Guacamole::GuacServerInstruction>().asReader());
+  const auto expected =
+    capnp::prettyPrint(copy.getRoot<CollabVmServerMessage>().asReader()).flatten();
+
+  auto message = SocketMessage::CreateGuacInstruction(instruction_builder);
+  const auto& buffer = message->GetBuffers().front();
+  const auto reader = capnp::FlatArrayMessageReader(kj::arrayPtr(
+    static_cast<const capnp::word*>(buffer.data()),
+    buffer.size() / sizeof(capnp::word)));
+  const auto root = reader.getRoot<CollabVmServerMessage>();
+  return root.getMessage().which() == CollabVmServerMessage::Message::GUAC_INSTR
+         && capnp::prettyPrint(root).flatten() == expected;
+}
+
+int main() {
+  auto instruction_builder = capnp::MallocMessageBuilder();
+  instruction_builder.initRoot<Guacamole::GuacServerInstruction>()
+                     .initImg().setLayer(1);
+  if (!ReadsLikeCopy(instruction_builder)) {
+    std::cout << "The instruction was not spliced correctly" << std::endl;
+    return 1;
+  }
+
+  // A one word first segment forces the root into a second segment,
+  // so the message's root pointer is a far pointer
+  auto small_builder =
+    capnp::MallocMessageBuilder(1, capnp::AllocationStrategy::FIXED_SIZE);
+  small_builder.initRoot<Guacamole::GuacServerInstruction>()
+               .initImg().setLayer(2);
+  if (small_builder.getSegmentsForOutput().size() < 2
+      || !ReadsLikeCopy(small_builder)) {
+    std::cout << "The multi-segment instruction was not spliced correctly"
+              << std::endl;
+    return 1;
+  }
+
+  // Instructions from one flush share a buffer and are read one after another
+  auto buffer = CollabVm::Server::GuacInstructionMessage::Buffer();
+  CollabVm::Server::GuacInstructionMessage::Append(buffer, instruction_builder);
+  CollabVm::Server::GuacInstructionMessage::Append(buffer, small_builder);
+  auto words = kj::arrayPtr(reinterpret_cast<const capnp::word*>(buffer.data()),
+                            buffer.size());
+  auto layers = std::vector<std::uint32_t>();
+  while (words.size() != 0) {
+    auto reader = capnp::FlatArrayMessageReader(words);
+    layers.push_back(reader.getRoot<CollabVmServerMessage>().getMessage()
+                       .getGuacInstr().getImg().getLayer());
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+  }
+  if (layers != std::vector<std::uint32_t>{1, 2}) {
+    std::cout << "Instructions in the same buffer were not read back"
+              << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
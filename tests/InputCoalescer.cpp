@@ -0,0 +1,82 @@
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include "InputCoalescer.hpp"
+
+// A mouse position and button mask
+struct Move {
+  int x;
+  int buttons;
+};
+using Coalescer = CollabVm::Server::InputCoalescer<Move>;
+using namespace std::chrono_literals;
+
+static bool CanMerge(const Move& pending, const Move& move) {
+  return pending.buttons == move.buttons;
+}
+
+static bool TestMerge() {
+  auto coalescer = Coalescer();
+  auto sent = std::vector<Move>();
+  const auto send = [&sent](Move&& move) { sent.push_back(move); };
+  const auto start = Coalescer::Clock::now();
+  coalescer.AddMove({1, 0}, 10ms, start, CanMerge, send);
+  if (sent.size() != 1) {
+    std::cout << "The first move wasn't sent right away" << std::endl;
+    return false;
+  }
+  if (!coalescer.AddMove({2, 0}, 10ms, start + 1ms, CanMerge, send)
+      || coalescer.AddMove({3, 0}, 10ms, start + 2ms, CanMerge, send)
+      || sent.size() != 1) {
+    std::cout << "Moves within the window weren't held" << std::endl;
+    return false;
+  }
+  if (coalescer.GetFlushTime(10ms) != start + 10ms) {
+    std::cout << "The flush time wasn't the end of the window" << std::endl;
+    return false;
+  }
+  coalescer.Flush(send, start + 10ms);
+  if (sent.size() != 2 || sent.back().x != 3) {
+    std::cout << "The latest move wasn't sent when flushed" << std::endl;
+    return false;
+  }
+  coalescer.AddMove({4, 0}, 10ms, start + 20ms, CanMerge, send);
+  if (sent.size() != 3) {
+    std::cout << "A move after the window wasn't sent right away" << std::endl;
+    return false;
+  }
+  coalescer.AddMove({5, 0}, 0ms, start + 20ms, CanMerge, send);
+  if (sent.size() != 4) {
+    std::cout << "A move was held without a window" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestButtons() {
+  auto coalescer = Coalescer();
+  auto sent = std::vector<Move>();
+  const auto send = [&sent](Move&& move) { sent.push_back(move); };
+  const auto start = Coalescer::Clock::now();
+  coalescer.AddMove({1, 0}, 10ms, start, CanMerge, send);
+  coalescer.AddMove({2, 0}, 10ms, start + 1ms, CanMerge, send);
+  coalescer.AddMove({3, 1}, 10ms, start + 2ms, CanMerge, send);
+  if (sent.size() != 3 || sent[1].x != 2 || sent[2].x != 3) {
+    std::cout << "A button press wasn't sent in order" << std::endl;
+    return false;
+  }
+  coalescer.AddMove({4, 0}, 10ms, start + 3ms, CanMerge, send);
+  coalescer.AddMove({5, 0}, 10ms, start + 4ms, CanMerge, send);
+  coalescer.Flush(send);
+  coalescer.Flush(send);
+  if (sent.size() != 4 || sent.back().x != 5) {
+    std::cout << "The held move wasn't sent once before other input"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  return TestMerge() && TestButtons() ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include "ProxyProtocol.hpp"
+
+using CollabVm::Server::ParseProxyHeader;
+using CollabVm::Server::ProxyHeader;
+using CollabVm::Server::ProxyParseResult;
+
+static std::vector<unsigned char> CreateHeader(unsigned char command,
+                                               unsigned char family,
+                                               std::vector<unsigned char> addresses) {
+  auto header = std::vector<unsigned char>{
+    0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A,
+    static_cast<unsigned char>(0x20 | command),
+    static_cast<unsigned char>(family << 4 | 1),
+    static_cast<unsigned char>(addresses.size() >> 8),
+    static_cast<unsigned char>(addresses.size())
+  };
+  header.insert(header.end(), addresses.begin(), addresses.end());
+  return header;
+}
+
+int main() {
+  auto header = ProxyHeader();
+
+  // Source and destination addresses followed by the ports
+  auto ipv4 = CreateHeader(1, 1, {192, 0, 2, 1, 127, 0, 0, 1, 0x30, 0x39, 0, 80});
+  ipv4.insert(ipv4.end(), {'G', 'E', 'T'});
+  if (ParseProxyHeader(ipv4.data(), ipv4.size(), header) != ProxyParseResult::kOk
+      || header.size != 28
+      || header.source_address != boost::asio::ip::make_address("192.0.2.1")) {
+    std::cout << "Failed to parse IPv4 header" << std::endl;
+    return 1;
+  }
+
+  auto ipv6_addresses = std::vector<unsigned char>(36);
+  ipv6_addresses[0] = 0x20;
+  ipv6_addresses[1] = 0x01;
+  ipv6_addresses[2] = 0x0D;
+  ipv6_addresses[3] = 0xB8;
+  ipv6_addresses[15] = 1;
+  const auto ipv6 = CreateHeader(1, 2, ipv6_addresses);
+  if (ParseProxyHeader(ipv6.data(), ipv6.size(), header) != ProxyParseResult::kOk
+      || header.source_address != boost::asio::ip::make_address("2001:db8::1")) {
+    std::cout << "Failed to parse IPv6 header" << std::endl;
+    return 1;
+  }
+
+  // Health checks from the proxy itself don't have an address
+  const auto local = CreateHeader(0, 0, {});
+  if (ParseProxyHeader(local.data(), local.size(), header) != ProxyParseResult::kOk
+      || header.source_address) {
+    std::cout << "Failed to parse LOCAL header" << std::endl;
+    return 1;
+  }
+
+  if (ParseProxyHeader(ipv4.data(), 10, header) != ProxyParseResult::kNeedMore
+      || ParseProxyHeader(ipv4.data(), 20, header) != ProxyParseResult::kNeedMore
+      || header.size != 28) {
+    std::cout << "Partial headers should need more data" << std::endl;
+    return 1;
+  }
+
+  const auto request = std::string("GET / HTTP/1.1\r\n");
+  if (ParseProxyHeader(request.data(), 4, header) != ProxyParseResult::kInvalid) {
+    std::cout << "Connections without a header should be rejected" << std::endl;
+    return 1;
+  }
+
+  auto version_one = ipv4;
+  version_one[12] = 0x11;
+  if (ParseProxyHeader(version_one.data(), version_one.size(), header)
+      != ProxyParseResult::kInvalid) {
+    std::cout << "Only version 2 should be accepted" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
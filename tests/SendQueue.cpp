@@ -0,0 +1,148 @@
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include "SendQueue.hpp"
+
+using CollabVm::Server::SendMessageType;
+using CollabVm::Server::SendQueueOptions;
+using CollabVm::Server::SlowConsumerPolicy;
+using Queue = CollabVm::Server::SendQueue<std::shared_ptr<int>>;
+
+static bool TestDropDroppable() {
+  auto options = SendQueueOptions();
+  options.high_watermark = 100;
+  options.low_watermark = 20;
+  options.policy = SlowConsumerPolicy::kDropDroppable;
+  options.max_bytes = 200;
+  auto queue = Queue(options);
+  auto message = std::make_shared<int>();
+  queue.Push(message, SendMessageType::kDroppable, 50);
+  queue.Push(message, SendMessageType::kDisplay, 40);
+  if (queue.Push(message, SendMessageType::kRequired, 30)
+      != Queue::PushResult::kQueued
+      || queue.size() != 2 || queue.GetBytes() != 70) {
+    std::cout << "Droppable messages weren't discarded at the high watermark"
+              << std::endl;
+    return false;
+  }
+  if (queue.Push(message, SendMessageType::kDroppable, 1)
+      != Queue::PushResult::kDropped) {
+    std::cout << "A droppable message was queued over the limit" << std::endl;
+    return false;
+  }
+  queue.Pop();
+  queue.FinishSend();
+  if (queue.Push(message, SendMessageType::kDroppable, 1)
+      != Queue::PushResult::kDropped) {
+    std::cout << "The limit ended before the low watermark" << std::endl;
+    return false;
+  }
+  queue.Pop();
+  queue.FinishSend();
+  if (queue.Push(message, SendMessageType::kDroppable, 1)
+      != Queue::PushResult::kQueued) {
+    std::cout << "The limit didn't end at the low watermark" << std::endl;
+    return false;
+  }
+  if (queue.Push(message, SendMessageType::kRequired, 250)
+      != Queue::PushResult::kDisconnect) {
+    std::cout << "The queue grew past max_bytes" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestResync() {
+  auto options = SendQueueOptions();
+  options.high_watermark = 100;
+  options.low_watermark = 20;
+  options.policy = SlowConsumerPolicy::kResync;
+  auto queue = Queue(options);
+  auto message = std::make_shared<int>();
+  queue.Push(message, SendMessageType::kDisplay, 30);
+  queue.Pop();
+  queue.Push(message, SendMessageType::kDisplay, 40);
+  queue.Push(message, SendMessageType::kRequired, 10);
+  if (queue.Push(message, SendMessageType::kDisplay, 30)
+      != Queue::PushResult::kDropped
+      || queue.size() != 1 || queue.GetBytes() != 40) {
+    std::cout << "Display instructions weren't discarded for a resync"
+              << std::endl;
+    return false;
+  }
+  if (queue.TakeResyncRequest()) {
+    std::cout << "A resync was requested before the queue drained" << std::endl;
+    return false;
+  }
+  queue.FinishSend();
+  if (!queue.TakeResyncRequest() || queue.TakeResyncRequest()) {
+    std::cout << "A resync wasn't requested once" << std::endl;
+    return false;
+  }
+  if (queue.Push(message, SendMessageType::kDisplay, 1)
+      != Queue::PushResult::kDropped) {
+    std::cout << "Display instructions were queued before the resync"
+              << std::endl;
+    return false;
+  }
+  queue.PushResync(message, 50);
+  if (queue.Push(message, SendMessageType::kDisplay, 1)
+      != Queue::PushResult::kQueued || queue.size() != 3) {
+    std::cout << "Display instructions were dropped after the resync"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestDisplayLag() {
+  auto options = SendQueueOptions();
+  options.max_display_lag = std::chrono::milliseconds(100);
+  auto queue = Queue(options);
+  auto message = std::make_shared<int>();
+  const auto start = Queue::Clock::time_point();
+  queue.Push(message, SendMessageType::kDisplay, 10, start);
+  queue.Push(message, SendMessageType::kRequired, 10, start);
+  queue.Push(message, SendMessageType::kDisplay, 10,
+             start + std::chrono::milliseconds(50));
+  if (queue.size() != 3 || queue.TakeResyncRequest()) {
+    std::cout << "A resync was requested before the display lagged"
+              << std::endl;
+    return false;
+  }
+  if (queue.Push(message, SendMessageType::kDisplay, 10,
+                 start + std::chrono::milliseconds(150))
+      != Queue::PushResult::kDropped
+      || queue.size() != 1 || queue.GetBytes() != 10) {
+    std::cout << "Display instructions weren't discarded when they lagged"
+              << std::endl;
+    return false;
+  }
+  if (!queue.TakeResyncRequest()) {
+    std::cout << "A resync wasn't requested when the display lagged"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestDisconnect() {
+  auto options = SendQueueOptions();
+  options.high_watermark = 100;
+  options.policy = SlowConsumerPolicy::kDisconnect;
+  auto queue = Queue(options);
+  auto message = std::make_shared<int>();
+  queue.Push(message, SendMessageType::kRequired, 60);
+  if (queue.Push(message, SendMessageType::kDroppable, 40)
+      != Queue::PushResult::kDisconnect) {
+    std::cout << "The client wasn't disconnected at the high watermark"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  return TestDropDroppable() && TestResync() && TestDisplayLag()
+         && TestDisconnect() ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+// Measures round trips of small WebSocket messages, which the server reads
+// and then echoes with a vectored write of a frame header and the payload.
+// Build it with and without USE_IO_URING to compare io_uring with epoll.
+// Usage: socket-backend-benchmark [port] [connections] [message size]
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "WebSocketFrameHeader.hpp"
+#include "WebSocketServer.hpp"
+
+using namespace CollabVm::Server;
+using Clock = std::chrono::steady_clock;
+
+constexpr auto benchmark_duration = std::chrono::seconds(10);
+
+class EchoSocket final : public WebServerSocket<WebServer> {
+ public:
+  using WebServerSocket::WebServerSocket;
+
+  class EchoBuffer final : public MessageBuffer {
+    boost::beast::flat_buffer buffer;
+   public:
+    void StartRead(std::shared_ptr<WebServerSocket>&& socket) override {
+      socket->ReadWebSocketMessage(
+        std::move(socket),
+        std::static_pointer_cast<EchoBuffer>(shared_from_this()));
+    }
+    auto& GetBuffer() { return buffer; }
+    WebSocketFrameHeader header;
+  };
+
+  std::shared_ptr<MessageBuffer> CreateMessageBuffer() override {
+    return std::make_shared<EchoBuffer>();
+  }
+
+ private:
+  void OnConnect() override {}
+  void OnDisconnect() override {}
+
+  void OnMessage(std::shared_ptr<MessageBuffer>&& buffer) override {
+    auto& echo_buffer = static_cast<EchoBuffer&>(*buffer);
+    const auto payload = echo_buffer.GetBuffer().data();
+    echo_buffer.header = WebSocketFrameHeader(payload.size());
+    WriteFrame(
+      std::array<boost::asio::const_buffer, 2>{
+        echo_buffer.header.GetBuffer(), payload},
+      [buffer = std::move(buffer)](const auto, auto) {});
+  }
+};
+
+class BenchmarkServer final : public WebServer {
+ public:
+  using WebServer::WebServer;
+
+ private:
+  std::shared_ptr<TSocket> CreateSocket(
+      boost::asio::io_context& io_context,
+      StaticFileCache& file_cache) override {
+    return std::make_shared<EchoSocket>(io_context, file_cache);
+  }
+};
+
+int main(int argc, char** argv) {
+  const auto port = argc > 1 ? argv[1] : "8098";
+  const auto connections = argc > 2 ? std::atoi(argv[2]) : 64;
+  const auto message_size = argc > 3 ? std::atoi(argv[3]) : 64;
+
+#ifdef BOOST_ASIO_HAS_IO_URING_AS_DEFAULT
+  std::cout << "Backend: io_uring" << std::endl;
+#else
+  std::cout << "Backend: default reactor" << std::endl;
+#endif
+
+  auto server = BenchmarkServer(
+    std::filesystem::temp_directory_path().string());
+  auto server_thread = std::thread([&] {
+    server.Start(2, "127.0.0.1", std::atoi(port));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  namespace websocket = boost::beast::websocket;
+  auto latencies = std::vector<std::vector<Clock::duration>>(connections);
+  auto clients = std::vector<std::thread>();
+  const auto end = Clock::now() + benchmark_duration;
+  for (auto i = 0; i < connections; i++) {
+    clients.emplace_back([&, &client_latencies = latencies[i]] {
+      auto io_context = boost::asio::io_context();
+      auto socket = boost::asio::ip::tcp::socket(io_context);
+      boost::asio::connect(socket, boost::asio::ip::tcp::resolver(io_context)
+                                     .resolve("127.0.0.1", port));
+      socket.set_option(boost::asio::ip::tcp::no_delay(true));
+      auto ws = websocket::stream<boost::asio::ip::tcp::socket&>(socket);
+      ws.handshake("127.0.0.1", "/");
+      ws.binary(true);
+      const auto message = std::string(message_size, 'x');
+      auto buffer = boost::beast::flat_buffer();
+      while (Clock::now() < end) {
+        const auto start = Clock::now();
+        ws.write(boost::asio::buffer(message));
+        ws.read(buffer);
+        buffer.consume(buffer.size());
+        client_latencies.push_back(Clock::now() - start);
+      }
+    });
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+
+  auto all_latencies = std::vector<Clock::duration>();
+  for (auto& client_latencies : latencies) {
+    all_latencies.insert(all_latencies.end(), client_latencies.begin(),
+                         client_latencies.end());
+  }
+  std::sort(all_latencies.begin(), all_latencies.end());
+  const auto percentile = [&](double p) {
+    const auto latency = all_latencies[static_cast<std::size_t>(
+      p * (all_latencies.size() - 1))];
+    return std::chrono::duration<double, std::milli>(latency).count();
+  };
+  const auto seconds =
+    std::chrono::duration<double>(benchmark_duration).count();
+  std::cout << connections << " connections, " << message_size
+            << " byte messages: " << all_latencies.size() / seconds
+            << " round trips/s, p50 " << percentile(0.5) << " ms, p99 "
+            << percentile(0.99) << " ms, max " << percentile(1) << " ms"
+            << std::endl;
+
+  server.Stop();
+  server_thread.join();
+}
@@ -0,0 +1,422 @@
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "TlsStream.hpp"
+
+namespace asio = boost::asio;
+using asio::ip::tcp;
+using CollabVm::Server::ConfigureTlsContext;
+using CollabVm::Server::StreamSocket;
+using CollabVm::Server::TlsStream;
+
+// Writes a self-signed certificate and its private key to one PEM file
+static bool CreateCertificate(const std::filesystem::path& path) {
+  auto key = static_cast<EVP_PKEY*>(nullptr);
+  const auto key_context = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  const auto generated = key_context
+    && EVP_PKEY_keygen_init(key_context) > 0
+    && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(
+         key_context, NID_X9_62_prime256v1) > 0
+    && EVP_PKEY_keygen(key_context, &key) > 0;
+  EVP_PKEY_CTX_free(key_context);
+  if (!generated) {
+    return false;
+  }
+  const auto certificate = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+  X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+  X509_gmtime_adj(X509_getm_notAfter(certificate), 60 * 60);
+  X509_set_pubkey(certificate, key);
+  const auto name = X509_get_subject_name(certificate);
+  X509_NAME_add_entry_by_txt(
+    name, "CN", MBSTRING_ASC,
+    reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(certificate, name);
+  const auto bio = BIO_new_file(path.string().c_str(), "w");
+  const auto written = X509_sign(certificate, key, EVP_sha256()) > 0
+    && bio
+    && PEM_write_bio_X509(bio, certificate)
+    && PEM_write_bio_PrivateKey(bio, key, nullptr, nullptr, 0,
+                                nullptr, nullptr);
+  BIO_free(bio);
+  X509_free(certificate);
+  EVP_PKEY_free(key);
+  return written;
+}
+
+// The server's side of a connection
+struct ServerConnection {
+  explicit ServerConnection(tcp::socket&& tcp_socket)
+      : socket(std::move(tcp_socket)), stream(socket) {}
+
+  StreamSocket socket;
+  TlsStream stream;
+};
+
+// Accepts a connection and starts the server's side of the handshake
+template<typename THandler>
+static void AcceptTls(tcp::acceptor& acceptor, SSL_CTX* context,
+                      std::unique_ptr<ServerConnection>& connection,
+                      THandler handler) {
+  acceptor.async_accept(
+    [context, &connection, handler](auto ec, tcp::socket socket) mutable {
+      if (ec) {
+        handler(ec);
+        return;
+      }
+      connection = std::make_unique<ServerConnection>(std::move(socket));
+      connection->stream.EnableTls(context, ec);
+      if (ec) {
+        handler(ec);
+        return;
+      }
+      connection->stream.async_handshake(handler);
+    });
+}
+
+using ClientStream = asio::ssl::stream<tcp::socket>;
+
+static std::unique_ptr<ClientStream> ConnectTls(asio::io_context& io_context,
+                                                asio::ssl::context& context,
+                                                const tcp::endpoint& endpoint,
+                                                SSL_SESSION* session,
+                                                boost::system::error_code& ec) {
+  auto stream = std::make_unique<ClientStream>(io_context, context);
+  stream->next_layer().connect(endpoint, ec);
+  if (ec) {
+    return nullptr;
+  }
+  if (session) {
+    SSL_set_session(stream->native_handle(), session);
+  }
+  stream->handshake(asio::ssl::stream_base::client, ec);
+  return stream;
+}
+
+static char Pattern(std::size_t offset) {
+  return static_cast<char>(offset % 251);
+}
+
+// Completes a handshake, echoes a message and returns the client's session
+// so it can be resumed
+static bool TestHandshake(asio::ssl::context& server_context,
+                          asio::ssl::context& client_context,
+                          SSL_SESSION*& session,
+                          bool& kernel_tls) {
+  auto io_context = asio::io_context();
+  auto acceptor = tcp::acceptor(
+    io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  auto connection = std::unique_ptr<ServerConnection>();
+  auto server_error = boost::system::error_code();
+  auto buffer = std::array<char, 64>();
+  AcceptTls(acceptor, server_context.native_handle(), connection,
+    [&](const boost::system::error_code ec) {
+      if (ec) {
+        server_error = ec;
+        return;
+      }
+      kernel_tls = connection->stream.IsKernelTlsSendEnabled();
+      connection->stream.async_read_some(asio::buffer(buffer),
+        [&](const boost::system::error_code ec,
+            std::size_t bytes_transferred) {
+          if (ec) {
+            server_error = ec;
+            return;
+          }
+          asio::async_write(connection->stream,
+                            asio::buffer(buffer.data(), bytes_transferred),
+            [&](const boost::system::error_code ec, std::size_t) {
+              if (ec) {
+                server_error = ec;
+                return;
+              }
+              connection->stream.async_shutdown(
+                [&](const auto ec) { server_error = ec; });
+            });
+        });
+    });
+
+  auto client_error = boost::system::error_code();
+  auto reply = std::string();
+  auto client = std::thread([&] {
+    auto client_io_context = asio::io_context();
+    auto stream = ConnectTls(client_io_context, client_context,
+                             acceptor.local_endpoint(), session, client_error);
+    if (client_error) {
+      return;
+    }
+    asio::write(*stream, asio::buffer("hello", 5), client_error);
+    reply.resize(5);
+    asio::read(*stream, asio::buffer(reply), client_error);
+    if (client_error) {
+      return;
+    }
+    // OpenSSL won't resume a session that wasn't shut down cleanly. TLS 1.3
+    // tickets also arrive after the handshake, so the session is only taken
+    // once something has been read.
+    stream->shutdown(client_error);
+    session = SSL_get1_session(stream->native_handle());
+  });
+  io_context.run();
+  client.join();
+  if (server_error || client_error) {
+    std::cout << "The handshake or echo failed: " << server_error.message()
+              << ", " << client_error.message() << std::endl;
+    return false;
+  }
+  if (reply != "hello") {
+    std::cout << "The message wasn't echoed" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestResumption(asio::ssl::context& server_context,
+                           asio::ssl::context& client_context,
+                           SSL_SESSION* session) {
+  auto io_context = asio::io_context();
+  auto acceptor = tcp::acceptor(
+    io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  auto connection = std::unique_ptr<ServerConnection>();
+  auto server_error = boost::system::error_code();
+  AcceptTls(acceptor, server_context.native_handle(), connection,
+            [&](const boost::system::error_code ec) { server_error = ec; });
+
+  auto client_error = boost::system::error_code();
+  auto reused = false;
+  auto client = std::thread([&] {
+    auto client_io_context = asio::io_context();
+    auto stream = ConnectTls(client_io_context, client_context,
+                             acceptor.local_endpoint(), session, client_error);
+    reused = stream && SSL_session_reused(stream->native_handle());
+  });
+  io_context.run();
+  client.join();
+  if (server_error || client_error) {
+    std::cout << "The resumed handshake failed: " << server_error.message()
+              << ", " << client_error.message() << std::endl;
+    return false;
+  }
+  if (!reused) {
+    std::cout << "The session wasn't resumed" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Reads and writes from different strands at the same time. Without kernel
+// TLS, the client also asks for key updates, so the server's SSL_read()
+// writes records of its own while data is being written.
+static bool TestConcurrentReadWrite(asio::ssl::context& server_context,
+                                    asio::ssl::context& client_context,
+                                    bool key_updates) {
+  constexpr auto size = std::size_t(8 * 1024 * 1024);
+  constexpr auto chunk_size = std::size_t(64 * 1024);
+  auto data = std::vector<char>(size);
+  for (auto i = std::size_t(0); i < size; i++) {
+    data[i] = Pattern(i);
+  }
+
+  auto io_context = asio::io_context();
+  auto acceptor = tcp::acceptor(
+    io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  auto connection = std::unique_ptr<ServerConnection>();
+  auto read_strand = asio::make_strand(io_context);
+  auto write_strand = asio::make_strand(io_context);
+  auto error_mutex = std::mutex();
+  auto server_error = boost::system::error_code();
+  // Closing the connection stops the client too
+  const auto on_server_error = [&](const boost::system::error_code ec) {
+    auto lock = std::lock_guard(error_mutex);
+    if (!server_error) {
+      server_error = ec;
+    }
+    auto close_error = boost::system::error_code();
+    connection->stream.Close(close_error);
+  };
+  auto server_mismatch = std::atomic<bool>(false);
+  auto server_received = std::size_t(0);
+  auto read_buffer = std::array<char, 16 * 1024>();
+  auto read = std::function<void()>();
+  read = [&] {
+    connection->stream.async_read_some(asio::buffer(read_buffer),
+      asio::bind_executor(read_strand,
+        [&](const boost::system::error_code ec,
+            std::size_t bytes_transferred) {
+          if (ec) {
+            on_server_error(ec);
+            return;
+          }
+          for (auto i = std::size_t(0); i < bytes_transferred; i++) {
+            if (read_buffer[i] != Pattern(server_received + i)) {
+              server_mismatch = true;
+            }
+          }
+          server_received += bytes_transferred;
+          if (server_received < size) {
+            read();
+          }
+        }));
+  };
+  AcceptTls(acceptor, server_context.native_handle(), connection,
+    [&](const boost::system::error_code ec) {
+      if (ec) {
+        server_error = ec;
+        return;
+      }
+      asio::post(read_strand, read);
+      asio::post(write_strand, [&] {
+        asio::async_write(connection->stream, asio::buffer(data),
+          asio::bind_executor(write_strand,
+            [&](const boost::system::error_code ec, std::size_t) {
+              if (ec) {
+                on_server_error(ec);
+              }
+            }));
+      });
+    });
+
+  auto client_error = boost::system::error_code();
+  auto client_mismatch = false;
+  // The client waits for the server before closing the connection, so
+  // unread KeyUpdate responses don't make it send a reset
+  auto server_finished = std::promise<void>();
+  auto client = std::thread([&] {
+    auto client_io_context = asio::io_context();
+    auto stream = ConnectTls(client_io_context, client_context,
+                             acceptor.local_endpoint(), nullptr, client_error);
+    if (client_error) {
+      return;
+    }
+    auto sent = std::size_t(0);
+    auto write = std::function<void()>();
+    write = [&] {
+      if (key_updates) {
+        SSL_key_update(stream->native_handle(), SSL_KEY_UPDATE_REQUESTED);
+      }
+      asio::async_write(*stream,
+        asio::buffer(data.data() + sent, std::min(chunk_size, size - sent)),
+        [&](const boost::system::error_code ec,
+            std::size_t bytes_transferred) {
+          sent += bytes_transferred;
+          if (ec) {
+            client_error = ec;
+            stream->next_layer().close();
+          } else if (sent < size) {
+            write();
+          }
+        });
+    };
+    auto received = std::size_t(0);
+    auto buffer = std::array<char, 16 * 1024>();
+    auto read = std::function<void()>();
+    read = [&] {
+      stream->async_read_some(asio::buffer(buffer),
+        [&](const boost::system::error_code ec,
+            std::size_t bytes_transferred) {
+          if (ec) {
+            client_error = ec;
+            stream->next_layer().close();
+            return;
+          }
+          for (auto i = std::size_t(0); i < bytes_transferred; i++) {
+            if (buffer[i] != Pattern(received + i)) {
+              client_mismatch = true;
+            }
+          }
+          received += bytes_transferred;
+          if (received < size) {
+            read();
+          }
+        });
+    };
+    write();
+    read();
+    client_io_context.run();
+    server_finished.get_future().wait();
+  });
+  auto threads = std::vector<std::thread>();
+  for (auto i = 0; i < 3; i++) {
+    threads.emplace_back([&] { io_context.run(); });
+  }
+  io_context.run();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  server_finished.set_value();
+  client.join();
+  if (server_error || client_error) {
+    std::cout << "A concurrent read or write failed: "
+              << server_error.message() << ", "
+              << client_error.message() << std::endl;
+    return false;
+  }
+  if (server_mismatch || client_mismatch || server_received != size) {
+    std::cout << "Data was corrupted while reading and writing at the same time"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestTls(bool enable_kernel_tls,
+                    const std::filesystem::path& certificate) {
+  auto server_context = asio::ssl::context(asio::ssl::context::tls_server);
+  auto ec = boost::system::error_code();
+  ConfigureTlsContext(server_context, certificate.string(), "", ec);
+  if (ec) {
+    std::cout << "The TLS context couldn't be configured: " << ec.message()
+              << std::endl;
+    return false;
+  }
+#ifdef SSL_OP_ENABLE_KTLS
+  if (!enable_kernel_tls) {
+    SSL_CTX_clear_options(server_context.native_handle(), SSL_OP_ENABLE_KTLS);
+  }
+#endif
+  auto client_context = asio::ssl::context(asio::ssl::context::tls_client);
+  client_context.set_verify_mode(asio::ssl::verify_none);
+
+  auto session = static_cast<SSL_SESSION*>(nullptr);
+  auto kernel_tls = false;
+  const auto passed =
+    TestHandshake(server_context, client_context, session, kernel_tls)
+    && TestResumption(server_context, client_context, session)
+    && TestConcurrentReadWrite(server_context, client_context, !kernel_tls);
+  SSL_SESSION_free(session);
+  if (enable_kernel_tls) {
+    std::cout << "Kernel TLS was " << (kernel_tls ? "used" : "unavailable")
+              << std::endl;
+  }
+  return passed;
+}
+
+int main() {
+  const auto certificate = std::filesystem::temp_directory_path()
+    / ("tls-stream-test-"
+       + std::to_string(
+           std::chrono::steady_clock::now().time_since_epoch().count())
+       + ".pem");
+  if (!CreateCertificate(certificate)) {
+    std::cout << "The certificate couldn't be created" << std::endl;
+    return 1;
+  }
+  const auto passed = TestTls(false, certificate) && TestTls(true, certificate);
+  std::filesystem::remove(certificate);
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,31 @@
+#include <chrono>
+#include <iostream>
+#include "IPData.hpp"
+
+int main() {
+  using namespace std::chrono_literals;
+  using CollabVm::Server::UploadQuota;
+  auto quota = UploadQuota();
+  const auto start = std::chrono::steady_clock::now();
+
+  // The burst can be used without waiting
+  if (quota.Consume(UploadQuota::max_burst, start) != 0s) {
+    std::cout << "Upload within the burst was throttled" << std::endl;
+    return 1;
+  }
+
+  // Going over the burst requires waiting for the bucket to refill
+  const auto delay = quota.Consume(UploadQuota::bytes_per_second, start);
+  if (delay < 999ms || delay > 1001ms) {
+    std::cout << "Expected a one second delay" << std::endl;
+    return 1;
+  }
+
+  // After waiting, the bucket is empty but no longer in debt
+  if (quota.Consume(0, start + delay) != 0s) {
+    std::cout << "Quota didn't refill" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "UserListChanges.hpp"
+
+using Message = std::shared_ptr<std::string>;
+using Changes = CollabVm::Server::UserListChanges<std::shared_ptr<int>, Message>;
+
+static Message CreateMessage(const char* text) {
+  return std::make_shared<std::string>(text);
+}
+
+static std::string GetMessages(std::vector<Changes::Change>&& changes) {
+  auto messages = std::string();
+  for (const auto& change : changes) {
+    messages += *change.user_message;
+  }
+  return messages;
+}
+
+static bool TestOrder() {
+  auto changes = Changes();
+  const auto first = std::make_shared<int>(1);
+  const auto second = std::make_shared<int>(2);
+  changes.Add(first, CreateMessage("a"), CreateMessage("A"));
+  changes.Rename(second, CreateMessage("r"));
+  changes.Remove(second, CreateMessage("x"));
+  if (!changes.Contains(first) || !changes.Contains(second)) {
+    std::cout << "Users with changes weren't found" << std::endl;
+    return false;
+  }
+  auto taken = changes.Take();
+  if (taken.size() != 3 || taken[0].joined_user != first
+      || *taken[0].admin_message != "A" || taken[1].joined_user) {
+    std::cout << "A join wasn't kept with its user and admin message"
+              << std::endl;
+    return false;
+  }
+  if (GetMessages(std::move(taken)) != "arx") {
+    std::cout << "Changes weren't taken in the order they were made"
+              << std::endl;
+    return false;
+  }
+  if (!changes.empty() || changes.Contains(first)) {
+    std::cout << "Changes were kept after they were taken" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool TestCancel() {
+  auto changes = Changes();
+  const auto first = std::make_shared<int>(1);
+  const auto second = std::make_shared<int>(2);
+  changes.Add(first, CreateMessage("a"), CreateMessage("A"));
+  changes.Add(second, CreateMessage("b"), CreateMessage("B"));
+  changes.Rename(first, CreateMessage("r"));
+  changes.Remove(first, CreateMessage("x"));
+  if (changes.Contains(first)) {
+    std::cout << "A user who joined and left still had changes" << std::endl;
+    return false;
+  }
+  if (GetMessages(changes.Take()) != "b") {
+    std::cout << "A user who joined and left wasn't cancelled out" << std::endl;
+    return false;
+  }
+  changes.Add(first, CreateMessage("a"), CreateMessage("A"));
+  changes.Remove(first, CreateMessage("x"));
+  if (!changes.empty()) {
+    std::cout << "Cancelled changes weren't forgotten" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  return !(TestOrder() && TestCancel());
+}
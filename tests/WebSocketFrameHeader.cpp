@@ -0,0 +1,31 @@
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include "WebSocketFrameHeader.hpp"
+
+using CollabVm::Server::WebSocketFrameHeader;
+
+static bool HasBytes(std::uint64_t payload_size,
+                     const std::vector<std::uint8_t>& expected) {
+  const auto header = WebSocketFrameHeader(payload_size);
+  const auto buffer = header.GetBuffer();
+  const auto bytes = static_cast<const std::uint8_t*>(buffer.data());
+  if (std::vector<std::uint8_t>(bytes, bytes + buffer.size()) == expected) {
+    return true;
+  }
+  std::cout << "Incorrect header for a payload of "
+            << payload_size << " bytes" << std::endl;
+  return false;
+}
+
+int main() {
+  const auto passed =
+    HasBytes(0, {0x82, 0})
+    && HasBytes(125, {0x82, 125})
+    && HasBytes(126, {0x82, 126, 0x00, 0x7E})
+    && HasBytes(0xFFFF, {0x82, 126, 0xFF, 0xFF})
+    && HasBytes(0x10000, {0x82, 127, 0, 0, 0, 0, 0, 0x01, 0x00, 0x00})
+    && HasBytes(0x0102030405060708,
+                {0x82, 127, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08});
+  return passed ? 0 : 1;
+}